@@ -11,10 +11,14 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
 
 static int lliowd_connfd = -1;
 static int lliowd_watchfd = -2;
 
+// Number of lliowd_ok() calls that returned 0 since the last lliowd_report().
+static unsigned lliowd_failures = 0;
+
 static void lliowd_getwatchfd() {
 
   // lliowd_connfd is alive. Either retrieve lliowd_watchfd from it,
@@ -67,8 +71,52 @@ static void lliowd_getwatchfd() {
 
 #define UNIX_PATH_MAX 108
 
+void lliowd_report() {
+
+  if(!lliowd_failures)
+    return;
+
+  int ctlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(ctlfd == -1)
+    return;
+
+  struct sockaddr_un ctladdr;
+  ctladdr.sun_family = AF_UNIX;
+
+  const char* homedir = getenv("HOME");
+  if(!homedir || snprintf(ctladdr.sun_path, UNIX_PATH_MAX, "%s/.lliowd-ctl-socket", homedir) >= UNIX_PATH_MAX) {
+
+    close(ctlfd);
+    return;
+
+  }
+
+  // Name ourselves: we're usually exiting, so by the time the daemon reads this
+  // it may no longer be able to find our executable from the connection.
+  char exebuf[PATH_MAX];
+  ssize_t exelen = readlink("/proc/self/exe", exebuf, PATH_MAX - 1);
+  if(exelen < 0)
+    exelen = 0;
+  exebuf[exelen] = '\0';
+
+  if(connect(ctlfd, (struct sockaddr*)&ctladdr, sizeof(struct sockaddr_un)) == 0) {
+
+    char msgbuf[PATH_MAX + 32];
+    int msglen = snprintf(msgbuf, PATH_MAX + 32, "failures %u %s\n", lliowd_failures, exebuf);
+    if(send(ctlfd, msgbuf, msglen, MSG_NOSIGNAL) == msglen)
+      lliowd_failures = 0;
+
+  }
+
+  close(ctlfd);
+
+}
+
 void lliowd_init() {
 
+  // Tell the daemon how often we fell back to unspecialised code when we exit.
+  atexit(lliowd_report);
+
   lliowd_connfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
   if(lliowd_connfd == -1) {
 
@@ -116,7 +164,7 @@ void lliowd_init() {
    
 }
 
-int lliowd_ok() {
+static int lliowd_check() {
 
   if(lliowd_watchfd == -1) {
 
@@ -189,3 +237,12 @@ int lliowd_ok() {
   return 1;
 
 }
+
+int lliowd_ok() {
+
+  int ret = lliowd_check();
+  if(!ret)
+    ++lliowd_failures;
+  return ret;
+
+}
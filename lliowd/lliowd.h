@@ -6,4 +6,7 @@ void lliowd_init();
 
 int lliowd_ok();
 
+// Report lliowd_ok() failures to the daemon. Called automatically at exit.
+void lliowd_report();
+
 #endif
@@ -11,9 +11,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
 
 #include <iostream>
 #include <vector>
+#include <map>
 #include <sstream>
 #include <fstream>
 
@@ -21,16 +26,63 @@ using namespace std;
 
 #define UNIX_PATH_MAX 108
 
+// Runtime counters kept for each watched file.
+// last_validated is 0 if the file has never been verified.
+struct spec_file {
+
+  std::string name;
+  unsigned invalidations;
+  time_t last_validated;
+
+};
+
 // watch_fd is set to -1 if files are already non-matching.
+// The counters are reported through the control socket (see handle_control).
 struct spec_program {
 
   std::string binary_name;
   int watch_fd;
+  std::vector<struct spec_file> files;
+
+  unsigned connections;
+  unsigned invalidations;
+  unsigned client_failures;
+  time_t last_validated;
 
 };
 
 std::vector<struct spec_program> progs;
 
+// Private inotify instance used to count invalidations. We can't read the per-program
+// watch fds because they are shared with clients, and reading would consume their events.
+static int monitor_fd = -1;
+
+// Map from monitor_fd watch descriptors to (program index, file index) pairs. inotify returns
+// the same descriptor each time a file is watched, so several programs may share one.
+static std::map<int, std::vector<std::pair<unsigned, unsigned> > > monitor_watches;
+
+// Control connections still sending their command or receiving our reply.
+// Each is dropped if it hasn't finished within CONTROL_TIMEOUT seconds.
+#define CONTROL_TIMEOUT 5
+#define CONTROL_MAX_CMD 8192
+
+struct control_conn {
+
+  std::string cmd;
+  std::string reply;
+  size_t replied;
+  time_t accepted;
+
+  control_conn() : replied(0), accepted(0) {}
+
+};
+
+static std::map<int, struct control_conn> control_conns;
+
+// Connections from executables we don't know about, or whose identity we couldn't establish.
+static unsigned failed_identifications = 0;
+static std::map<std::string, unsigned> unknown_programs;
+
 static struct spec_program* findprog(const char* name) {
 
   std::string names(name);
@@ -96,6 +148,10 @@ static void parse_config(const char* confname) {
       }
 
       progs.back().watch_fd = new_watch;
+      progs.back().connections = 0;
+      progs.back().invalidations = 0;
+      progs.back().client_failures = 0;
+      progs.back().last_validated = 0;
 
       cout << "Adding program " << progs.back().binary_name << "\n";
 
@@ -135,6 +191,12 @@ static void parse_config(const char* confname) {
       
       std::string fname(fline, 0, timestart);
 
+      progs.back().files.push_back(spec_file());
+      struct spec_file& thisfile = progs.back().files.back();
+      thisfile.name = fname;
+      thisfile.invalidations = 0;
+      thisfile.last_validated = 0;
+
       // Add an inotify watch *before* verifying file, to avoid race.
       if(inotify_add_watch(progs.back().watch_fd, fname.c_str(), IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY) == -1) {
 
@@ -144,6 +206,11 @@ static void parse_config(const char* confname) {
 
       }
 
+      // Likewise for our private monitor watch. Failure here only costs us statistics.
+      int monitor_wd = inotify_add_watch(monitor_fd, fname.c_str(), IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY);
+      if(monitor_wd != -1)
+	monitor_watches[monitor_wd].push_back(std::make_pair(progs.size() - 1, progs.back().files.size() - 1));
+
       // First of all: file exists?
       struct stat filestat;
       if(stat(fname.c_str(), &filestat) == -1) {
@@ -265,41 +332,103 @@ static void parse_config(const char* confname) {
       }
 
       cout << "Verified " << fname << "\n";
+      thisfile.last_validated = time(0);
 
     }
 
   }
 
+  // Programs whose files all verified were validated now.
+  for(std::vector<struct spec_program>::iterator it = progs.begin(), itend = progs.end(); it != itend; ++it) {
+
+    if(it->watch_fd != -1)
+      it->last_validated = time(0);
+
+  }
+
 }
 
-static int createlistensock() {
+// Drain the monitor inotify fd, charging each event to the file and program it concerns.
+static void read_monitor_events() {
 
-  int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if(listenfd == -1) {
+  char evbuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
 
-    fprintf(stderr, "Socket\n");
-    exit(1);
+  ssize_t thisread = read(monitor_fd, evbuf, sizeof(evbuf));
+  if(thisread <= 0)
+    return;
+
+  for(char* p = evbuf; p < evbuf + thisread; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+
+    struct inotify_event* ev = (struct inotify_event*)p;
+
+    // Ignore IN_IGNORED and friends.
+    if(!(ev->mask & (IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY)))
+      continue;
+
+    std::map<int, std::vector<std::pair<unsigned, unsigned> > >::iterator findit = monitor_watches.find(ev->wd);
+    if(findit == monitor_watches.end())
+      continue;
+
+    for(std::vector<std::pair<unsigned, unsigned> >::iterator it = findit->second.begin(),
+	  itend = findit->second.end(); it != itend; ++it) {
+
+      struct spec_program& prog = progs[it->first];
+      struct spec_file& file = prog.files[it->second];
+
+      // Count each file event, but only count the program invalidated once per validation.
+      ++file.invalidations;
+      if(prog.last_validated) {
+
+	++prog.invalidations;
+	prog.last_validated = 0;
+
+      }
+
+      cout << file.name << " changed; " << prog.binary_name << " invalidated\n";
+
+    }
 
   }
 
-  struct sockaddr_un bindaddr;
-  bindaddr.sun_family = AF_UNIX;
+}
+
+static bool getsockpath(struct sockaddr_un& addr, const char* sockname) {
+
+  addr.sun_family = AF_UNIX;
   
   const char* homedir = getenv("HOME");
   if(!homedir) {
 
     fprintf(stderr, "HOME not set\n");
-    exit(1);
+    return false;
 
   }
 
-  if(snprintf(bindaddr.sun_path, UNIX_PATH_MAX, "%s/.lliowd-socket", homedir) >= UNIX_PATH_MAX) {
+  if(snprintf(addr.sun_path, UNIX_PATH_MAX, "%s/%s", homedir, sockname) >= UNIX_PATH_MAX) {
 
     fprintf(stderr, "Socket path too long\n");
+    return false;
+
+  }
+
+  return true;
+
+}
+
+static int createlistensock(const char* sockname) {
+
+  int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listenfd == -1) {
+
+    fprintf(stderr, "Socket\n");
     exit(1);
 
   }
 
+  struct sockaddr_un bindaddr;
+  if(!getsockpath(bindaddr, sockname))
+    exit(1);
+
   unlink(bindaddr.sun_path);
 
   if(bind(listenfd, (struct sockaddr*)&bindaddr, sizeof(struct sockaddr_un)) == -1) {
@@ -320,105 +449,437 @@ static int createlistensock() {
 
 }
 
-int main(int argc, char** argv) {
+// Find the executable behind a connected socket, writing it to exebuf.
+static bool identify_peer(int connfd, char* exebuf, size_t exebuflen) {
+
+  struct ucred otherendcreds;
+  socklen_t otherendcredslen = sizeof(struct ucred);
+  if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &otherendcreds, &otherendcredslen) == -1) {
+
+    fprintf(stderr, "getsockopt failed\n");
+    return false;
 
-  if(argc < 2) {
-    fprintf(stderr, "Usage: lliowd config_file\n");
-    exit(1);
   }
 
-  parse_config(argv[1]);
+  char pathbuf[128];
+  sprintf(pathbuf, "/proc/%d/exe", otherendcreds.pid);
 
-  int listenfd = createlistensock();
+  ssize_t rlret = readlink(pathbuf, exebuf, exebuflen);
+  if(rlret < 0 || rlret == (ssize_t)exebuflen) {
 
-  while(1) {
+    cerr << "Path name too long for " << pathbuf << "\n";
+    return false;
+
+  }
 
-    struct sockaddr_un otherend;
-    socklen_t otherendlen;
-    int connfd = accept(listenfd, (struct sockaddr*)&otherend, &otherendlen);
+  exebuf[rlret] = '\0';
+  return true;
+
+}
+
+static struct spec_program* lookup_program(const char* exe) {
+
+  struct spec_program* prog = findprog(exe);
+  if(!prog) {
+
+    cerr << "No such program " << exe << "\n";
+    ++failed_identifications;
+    ++unknown_programs[exe];
+    return 0;
+
+  }
+
+  return prog;
+
+}
+
+static struct spec_program* identify_program(int connfd) {
+
+  char exebuf[4096];
+  if(!identify_peer(connfd, exebuf, 4096)) {
+
+    ++failed_identifications;
+    return 0;
+
+  }
+
+  return lookup_program(exebuf);
+
+}
+
+static void write_since(std::ostream& os, time_t when, time_t now) {
+
+  if(!when)
+    os << "never";
+  else
+    os << (now - when);
+
+}
+
+static void write_stats(std::ostream& os) {
+
+  time_t now = time(0);
+
+  os << "failed_identifications " << failed_identifications << "\n";
+  for(std::map<std::string, unsigned>::iterator it = unknown_programs.begin(), itend = unknown_programs.end(); it != itend; ++it)
+    os << "unknown " << it->first << " " << it->second << "\n";
+
+  for(std::vector<struct spec_program>::iterator it = progs.begin(), itend = progs.end(); it != itend; ++it) {
+
+    os << "program " << it->binary_name << " valid " << (it->watch_fd != -1 && it->last_validated ? 1 : 0)
+       << " connections " << it->connections << " invalidations " << it->invalidations
+       << " client_failures " << it->client_failures << " since_validation ";
+    write_since(os, it->last_validated, now);
+    os << "\n";
+
+    for(std::vector<struct spec_file>::iterator fit = it->files.begin(), fitend = it->files.end(); fit != fitend; ++fit) {
+
+      os << "  file " << fit->name << " invalidations " << fit->invalidations << " since_validation ";
+      write_since(os, fit->last_validated, now);
+      os << "\n";
 
-    if(connfd == -1) {
-      fprintf(stderr, "Accept failed\n");
-      continue;
     }
 
-    struct ucred otherendcreds;
-    socklen_t otherendcredslen = sizeof(struct ucred);
-    if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &otherendcreds, &otherendcredslen) == -1) {
+  }
 
-      fprintf(stderr, "getsockopt failed\n");
-      close(connfd);
-      continue;
+}
+
+// Control connections carry one line-oriented command:
+// "stats": reply with the counters for every program and file.
+// "failures N [exe]": program exe's lliowd_ok() failed N times since its last report.
+// Reporting clients are normally exiting, so they name themselves; without a name
+// we fall back to asking the kernel who is connected.
+// Any reply is queued in conn.reply for the poll loop to send.
+static void handle_control(int connfd, struct control_conn& conn) {
+
+  std::string& cmd = conn.cmd;
+  std::string::size_type nl = cmd.find('\n');
+  if(nl != std::string::npos)
+    cmd.erase(nl);
+
+  if(cmd == "stats") {
+
+    std::ostringstream oss;
+    write_stats(oss);
+    conn.reply = oss.str();
+
+  }
+  else if(cmd.compare(0, 9, "failures ") == 0) {
 
+    std::istringstream iss(std::string(cmd, 9));
+    unsigned nfailures;
+    if(!(iss >> nfailures)) {
+      cerr << "Bad failure report " << cmd << "\n";
+      return;
     }
 
-    char pathbuf[128];
-    sprintf(pathbuf, "/proc/%d/exe", otherendcreds.pid);
+    std::string exe;
+    if(iss.get() == ' ')
+      std::getline(iss, exe);
 
-    char exebuf[4096];
-    ssize_t rlret = readlink(pathbuf, exebuf, 4096);
-    if(rlret < 0 || rlret == 4096) {
+    struct spec_program* prog = exe.empty() ? identify_program(connfd) : lookup_program(exe.c_str());
+    if(prog)
+      prog->client_failures += nfailures;
 
-      cerr << "Path name too long for " << pathbuf << "\n";
-      close(connfd);
-      continue;
+  }
+  else {
+
+    cerr << "Bad control command " << cmd << "\n";
+
+  }
+
+}
 
+static void close_control(int connfd) {
+
+  close(connfd);
+  control_conns.erase(connfd);
+
+}
+
+// Send as much of connfd's queued reply as it will take without blocking,
+// closing the connection once it has all been sent or the client has gone away.
+static void write_control(int connfd) {
+
+  struct control_conn& conn = control_conns[connfd];
+
+  while(conn.replied < conn.reply.size()) {
+
+    ssize_t thiswrite = send(connfd, conn.reply.data() + conn.replied, conn.reply.size() - conn.replied, MSG_NOSIGNAL);
+    if(thiswrite == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+
+    if(thiswrite <= 0) {
+      cerr << "Write failed\n";
+      break;
     }
 
-    exebuf[rlret] = '\0';
+    conn.replied += thiswrite;
 
-    struct spec_program* prog = findprog(exebuf);
-    if(!prog) {
+  }
 
-      cerr << "No such program " << exebuf << "\n";
-      close(connfd);
-      continue;
+  close_control(connfd);
+
+}
+
+// Read whatever control connection connfd has sent; once it has sent a whole command
+// (or closed, or sent too much) act on it, then either close the connection or start replying.
+static void read_control(int connfd) {
+
+  struct control_conn& conn = control_conns[connfd];
+  char readbuf[256];
+  ssize_t thisread;
+  bool finished = false;
+
+  while((thisread = read(connfd, readbuf, 256)) > 0) {
 
+    conn.cmd.append(readbuf, thisread);
+    if(conn.cmd.find('\n') != std::string::npos || conn.cmd.size() >= CONTROL_MAX_CMD) {
+      finished = true;
+      break;
     }
 
-    if(prog->watch_fd == -1) {
+  }
+
+  // EOF or error; EAGAIN just means the rest hasn't arrived yet.
+  if(thisread == 0 || (thisread == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+    finished = true;
+
+  if(finished) {
+
+    handle_control(connfd, conn);
+    if(conn.reply.empty())
+      close_control(connfd);
+    else
+      write_control(connfd);
+
+  }
+
+}
+
+static bool control_replying(const struct control_conn& conn) {
+
+  return !conn.reply.empty();
+
+}
+
+// Drop control connections that have taken too long to send their command or take our reply.
+static void expire_control_conns() {
+
+  time_t now = time(0);
 
-      // Couldn't verify this program's files
-      if(send(connfd, "\0", 1, MSG_NOSIGNAL) == -1)
-	cerr << "Write failed\n";
+  for(std::map<int, struct control_conn>::iterator it = control_conns.begin(); it != control_conns.end();) {
+
+    if(now - it->second.accepted >= CONTROL_TIMEOUT) {
+
+      cerr << "Control connection timed out\n";
+      close(it->first);
+      control_conns.erase(it++);
 
     }
     else {
 
-      // The program's files were good at startup, and hopefully remain so! Send the inotify handle:
-      struct msghdr hdr;
-      struct iovec data;
+      ++it;
+
+    }
+
+  }
+
+}
+
+static void handle_client(int connfd) {
+
+  struct spec_program* prog = identify_program(connfd);
+  if(!prog)
+    return;
+
+  ++prog->connections;
+
+  if(prog->watch_fd == -1) {
+
+    // Couldn't verify this program's files
+    if(send(connfd, "\0", 1, MSG_NOSIGNAL) == -1)
+      cerr << "Write failed\n";
+
+  }
+  else {
+
+    // The program's files were good at startup, and hopefully remain so! Send the inotify handle:
+    struct msghdr hdr;
+    struct iovec data;
+
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+
+    char dummy = '\x01';
+    data.iov_base = &dummy;
+    data.iov_len = sizeof(dummy);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = NULL;
+    hdr.msg_namelen = 0;
+    hdr.msg_iov = &data;
+    hdr.msg_iovlen = 1;
+    hdr.msg_flags = 0;
+
+    hdr.msg_control = cmsgbuf;
+    hdr.msg_controllen = CMSG_LEN(sizeof(int));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+
+    *(int*)CMSG_DATA(cmsg) = prog->watch_fd;
+
+    int n = sendmsg(connfd, &hdr, MSG_NOSIGNAL);
+    if(n == -1)
+      cerr << "sendmsg failed\n";
+
+  }
+
+}
+
+// lliowd -q: ask a running daemon for its statistics and print them.
+static int query_stats() {
 
-      char cmsgbuf[CMSG_SPACE(sizeof(int))];
+  int connfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(connfd == -1) {
 
-      char dummy = '\x01';
-      data.iov_base = &dummy;
-      data.iov_len = sizeof(dummy);
+    fprintf(stderr, "Socket\n");
+    return 1;
+
+  }
+
+  struct sockaddr_un addr;
+  if(!getsockpath(addr, ".lliowd-ctl-socket"))
+    return 1;
+
+  if(connect(connfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == -1) {
+
+    fprintf(stderr, "Connect failed (is lliowd running?)\n");
+    return 1;
+
+  }
 
-      memset(&hdr, 0, sizeof(hdr));
-      hdr.msg_name = NULL;
-      hdr.msg_namelen = 0;
-      hdr.msg_iov = &data;
-      hdr.msg_iovlen = 1;
-      hdr.msg_flags = 0;
+  if(send(connfd, "stats\n", 6, MSG_NOSIGNAL) != 6) {
 
-      hdr.msg_control = cmsgbuf;
-      hdr.msg_controllen = CMSG_LEN(sizeof(int));
+    fprintf(stderr, "Write failed\n");
+    return 1;
 
-      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
-      cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
-      cmsg->cmsg_level = SOL_SOCKET;
-      cmsg->cmsg_type  = SCM_RIGHTS;
+  }
+
+  char readbuf[4096];
+  ssize_t thisread;
+  while((thisread = read(connfd, readbuf, 4096)) > 0)
+    fwrite(readbuf, 1, thisread, stdout);
+
+  close(connfd);
+  return thisread == -1 ? 1 : 0;
+
+}
+
+int main(int argc, char** argv) {
+
+  if(argc < 2) {
+    fprintf(stderr, "Usage: lliowd config_file\n       lliowd -q\n");
+    exit(1);
+  }
+
+  if(!strcmp(argv[1], "-q"))
+    return query_stats();
+
+  monitor_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(monitor_fd == -1)
+    cerr << "Monitor inotify open failed; invalidations will not be counted\n";
+
+  parse_config(argv[1]);
+
+  int listenfd = createlistensock(".lliowd-socket");
+  int ctlfd = createlistensock(".lliowd-ctl-socket");
+
+  while(1) {
+
+    // Listening sockets and the monitor fd first, then any control connections in progress.
+    std::vector<struct pollfd> waitfds(3);
+    waitfds[0].fd = listenfd;
+    waitfds[1].fd = ctlfd;
+    waitfds[2].fd = monitor_fd;
+
+    for(unsigned i = 0; i < waitfds.size(); ++i) {
+      waitfds[i].events = POLLIN;
+      waitfds[i].revents = 0;
+    }
 
-      *(int*)CMSG_DATA(cmsg) = prog->watch_fd;
+    for(std::map<int, struct control_conn>::iterator it = control_conns.begin(),
+	  itend = control_conns.end(); it != itend; ++it) {
 
-      int n = sendmsg(connfd, &hdr, MSG_NOSIGNAL);
-      if(n == -1)
-	cerr << "sendmsg failed\n";
+      struct pollfd connpoll;
+      connpoll.fd = it->first;
+      connpoll.events = control_replying(it->second) ? POLLOUT : POLLIN;
+      connpoll.revents = 0;
+      waitfds.push_back(connpoll);
 
     }
 
-    close(connfd);
+    // A negative fd is ignored by poll, which takes care of a missing monitor fd.
+    int timeout = control_conns.empty() ? -1 : 1000;
+    int npolled = poll(&waitfds[0], waitfds.size(), timeout);
+
+    expire_control_conns();
+
+    if(npolled <= 0)
+      continue;
+
+    if(waitfds[2].revents & POLLIN)
+      read_monitor_events();
+
+    for(unsigned i = 3; i < waitfds.size(); ++i) {
+
+      if(!(waitfds[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+	continue;
+
+      // Might have just expired.
+      std::map<int, struct control_conn>::iterator findit = control_conns.find(waitfds[i].fd);
+      if(findit == control_conns.end())
+	continue;
+
+      if(control_replying(findit->second))
+	write_control(waitfds[i].fd);
+      else
+	read_control(waitfds[i].fd);
+
+    }
+
+    for(int i = 0; i < 2; ++i) {
+
+      if(!(waitfds[i].revents & POLLIN))
+	continue;
+
+      struct sockaddr_un otherend;
+      socklen_t otherendlen = sizeof(otherend);
+      int connfd = accept(waitfds[i].fd, (struct sockaddr*)&otherend, &otherendlen);
+
+      if(connfd == -1) {
+	fprintf(stderr, "Accept failed\n");
+	continue;
+      }
+
+      if(i == 0) {
+
+	handle_client(connfd);
+	close(connfd);
+
+      }
+      else {
+
+	// Don't let a slow client block the loop: collect its command as it arrives.
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+	control_conns[connfd].accepted = time(0);
+	read_control(connfd);
+
+      }
+
+    }
 
   }
 
@@ -11,11 +11,15 @@ int main(int argc, char** argv) {
   while(1) {
 
     printf("Press return to check:");
-    getchar();
+    if(getchar() == EOF)
+      break;
 
     const char* msg = lliowd_ok() ? "Specialised files ok\n" : "Specialised files bad\n";
     puts(msg);
 
   }
 
+  lliowd_report();
+  return 0;
+
 }
@@ -12,6 +12,7 @@
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/ImmutableSet.h"
 #include "llvm/ADT/IntervalMap.h"
 #include "llvm/IR/ValueMap.h"
 #include "llvm/ADT/SmallVector.h"
@@ -37,6 +38,8 @@
 #include "llvm/Transforms/Utils/ValueMapper.h"
 
 #include <limits.h>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -67,6 +70,7 @@ class AliasAnalysis;
 class Loop;
 class LoopInfo;
 class IntegrationAttempt;
+struct SizeBudgetCandidate;
 class PtrToIntInst;
 class IntToPtrInst;
 class BinaryOperator;
@@ -202,6 +206,9 @@ struct SpecialLocationDescriptor {
 
 };
 
+// Path conditions that are verified by a single runtime test.
+typedef SmallVector<PathCondition*, 4> PathConditionGroup;
+
 struct PathConditions {
 
   std::vector<PathCondition> IntPathConditions;
@@ -247,10 +254,12 @@ struct AllocatorFn {
     uint32_t sizeArg;
     ConstantInt* allocSize;
   };
+  // For arena allocators, the argument giving the arena; UINT_MAX otherwise.
+  uint32_t arenaArg;
   
-AllocatorFn() : isConstantSize(false), allocSize(0) {}
-AllocatorFn(uint32_t S) : isConstantSize(false), sizeArg(S) {}
-AllocatorFn(ConstantInt* C) : isConstantSize(true), allocSize(C) {}
+AllocatorFn() : isConstantSize(false), allocSize(0), arenaArg(UINT_MAX) {}
+AllocatorFn(uint32_t S) : isConstantSize(false), sizeArg(S), arenaArg(UINT_MAX) {}
+AllocatorFn(ConstantInt* C) : isConstantSize(true), allocSize(C), arenaArg(UINT_MAX) {}
 
   static AllocatorFn getConstantSize(ConstantInt* size) {
     return AllocatorFn(size);
@@ -264,9 +273,11 @@ AllocatorFn(ConstantInt* C) : isConstantSize(true), allocSize(C) {}
 struct DeallocatorFn {
 
   uint32_t arg;
+  // If set, arg is an arena and every object allocated from it is released.
+  bool resetsArena;
 
-DeallocatorFn() : arg(UINT_MAX) {}
-DeallocatorFn(uint32_t a) : arg(a) {}
+DeallocatorFn() : arg(UINT_MAX), resetsArena(false) {}
+DeallocatorFn(uint32_t a, bool ra = false) : arg(a), resetsArena(ra) {}
 
 };
 
@@ -280,11 +291,23 @@ ReallocatorFn(uint32_t pa, uint32_t sa) : ptrArg(pa), sizeArg(sa) {}
 
 };
 
+// The objects a yield point (lock acquire, barrier...) may expose to other threads' writes:
+// some globals, and/or every heap object allocated at some allocation sites.
+struct YieldDomain {
+
+  std::vector<GlobalVariable*> globals;
+  SmallPtrSet<Instruction*, 4> allocSites;
+
+};
+
 struct IHPLocationInfo {
   
   void (*getLocation)(ShadowValue CS, ShadowValue& Loc, uint64_t& LocSize);
   uint64_t argIndex;
   uint64_t argSize;
+  // If nonzero, argSize is ignored and the extent is sizeArgMultiplier * the value of argument sizeArgIndex.
+  uint64_t sizeArgIndex;
+  uint64_t sizeArgMultiplier;
 
 };
 
@@ -400,6 +423,23 @@ ArgStore(uint32_t hi) : heapIdx(hi) {}
 
 };
 
+// One entry in a batch of specialisations (-llpe-batch-config): the root function's arguments are set
+// as though by -spec-env, -spec-argv and -spec-param, and the result is committed as <root>.<name>.
+struct SpecialisationConfig {
+
+  std::string name;
+  std::string env;
+  std::string argv;
+  std::vector<std::string> params;
+
+  // What the specialisation assumed, for the batch dispatcher to check at runtime:
+  // root argument values (0 = unknown), and argv strings by index.
+  std::vector<Constant*> argConstants;
+  std::vector<std::pair<uint64_t, Constant*> > argvStrings;
+  uint32_t argvIdx;
+
+};
+
 class LLPEAnalysisPass : public ModulePass {
 
  public:
@@ -414,6 +454,12 @@ class LLPEAnalysisPass : public ModulePass {
    DenseMap<Function*, SmallSet<BasicBlock*, 1> > ignoreLoops;
    DenseMap<Function*, SmallSet<BasicBlock*, 1> > ignoreLoopsWithChildren;
    DenseMap<std::pair<Function*, BasicBlock*>, uint64_t> maxLoopIters;
+   // Peeling budgets: iterations per loop (0 = unlimited, overridable per loop),
+   // and peeled iterations alive across the whole specialisation.
+   uint64_t peelBudget;
+   DenseMap<std::pair<Function*, BasicBlock*>, uint64_t> loopPeelBudgets;
+   uint64_t totalPeelBudget;
+   uint64_t livePeelIterations;
    DenseSet<Instruction*> simpleVolatileLoads;
    
    DenseMap<ShadowInstruction*, std::string> optimisticForwardStatus;
@@ -450,8 +496,16 @@ class LLPEAnalysisPass : public ModulePass {
    SmallPtrSet<Function*, 8> blacklistedFunctions;
    void initBlacklistedFunctions(Module&);
 
+   ImmutableSet<Function*>::Factory stackFunctionsFactory;
+
    SmallPtrSet<Function*, 8> splitFunctions;
 
+   // Execution counts from a profiling run of the original program (-llpe-profile).
+   // Functions not mentioned in the profile are weighted as though every block runs once per entry.
+   DenseMap<BasicBlock*, uint64_t> blockProfile;
+   SmallPtrSet<Function*, 8> profiledFunctions;
+   void loadBlockProfile(Module&, std::string&);
+
    DenseMap<Function*, std::vector<InlineAttempt*> > IAsByFunction;
 
    PathConditions pathConditions;
@@ -460,6 +514,8 @@ class LLPEAnalysisPass : public ModulePass {
    SmallDenseMap<Function*, AllocatorFn, 4> allocatorFunctions;
    SmallDenseMap<Function*, DeallocatorFn, 4> deallocatorFunctions;
    SmallDenseMap<Function*, ReallocatorFn, 4> reallocatorFunctions;
+   // Heap objects allocated from each arena (identified by its base object), for arena resets.
+   DenseMap<ShadowValue, std::vector<uint32_t> > arenaObjects;
    SmallDenseMap<Function*, Function*> modelFunctions;
    SmallPtrSet<Function*, 4> yieldFunctions;
 
@@ -472,17 +528,27 @@ class LLPEAnalysisPass : public ModulePass {
 
    SmallVector<Function*, 4> commitFunctions;
 
-   SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4> lockDomains;
+   SmallDenseMap<CallInst*, YieldDomain, 4> lockDomains;
+   SmallDenseMap<Function*, YieldDomain, 4> yieldDomains;
+   // Heap objects allocated at sites mentioned by some YieldDomain.
+   DenseMap<Instruction*, std::vector<uint32_t> > heapObjectsBySite;
    SmallSet<CallInst*, 4> pessimisticLocks;
 
    // Of an allocation or FD, record instructions that may use it in the emitted program.
    DenseMap<ShadowValue, std::vector<std::pair<ShadowValue, uint32_t> > > indirectDIEUsers;
+   // Current DIE run, and values whose liveness must be re-examined in it; see DIE.cpp.
+   uint32_t DIEGeneration;
+   std::vector<ShadowValue> DIEWorklist;
    // Of a successful copy instruction, records the values read.
    DenseMap<ShadowInstruction*, SmallVector<IVSRange, 4> > memcpyValues;
 
    DenseMap<ShadowInstruction*, OpenStatus*> forwardableOpenCalls;
    DenseMap<ShadowInstruction*, ReadFile> resolvedReadCalls;
    DenseMap<ShadowInstruction*, SeekFile> resolvedSeekCalls;
+   // Constant globals emitted to hold file contents read by the specialised program, by content,
+   // and by file name for files emitted whole (0 if too big).
+   DenseMap<Constant*, GlobalVariable*> fileBytesGlobals;
+   std::map<std::string, GlobalVariable*> wholeFileGlobals;
 
    void addSharableFunction(InlineAttempt*);
    void removeSharableFunction(InlineAttempt*);
@@ -505,6 +571,8 @@ class LLPEAnalysisPass : public ModulePass {
    int llioPreludeStackIdx;
    std::string llioConfigFile;
    std::vector<std::string> llioDependentFiles;
+   // For -llpe-file-deps: the contexts (by printContextPath) whose analysis read each file.
+   std::map<std::string, std::set<std::string> > fileReaders;
 
    DenseSet<ShadowInstruction*> barrierInstructions;
 
@@ -521,6 +589,8 @@ class LLPEAnalysisPass : public ModulePass {
    DenseMap<ShadowInstruction*, TrackedAlloc*> trackedAllocs;
    DenseMap<Value*, uint32_t> committedHeapAllocations;
    DenseMap<Value*, uint32_t> committedFDs;
+   // Placeholder selects queued by addPatchRequest that patchReferences has yet to fill in.
+   DenseSet<Instruction*> pendingPatchTargets;
 
    std::vector<void*> IAs;
 
@@ -533,9 +603,18 @@ class LLPEAnalysisPass : public ModulePass {
    std::string statsFile;
    unsigned maxContexts;
 
+   // Batch mode: each configuration is analysed and committed in turn, sharing the invariant
+   // per-function information above. batchRoots holds the committed root of each.
+   std::vector<SpecialisationConfig> batchConfigs;
+   std::vector<Function*> batchRoots;
+   // Instructions loadArgv added to the root function for the current configuration.
+   std::vector<Instruction*> rootArgvInsts;
+
    explicit LLPEAnalysisPass() : ModulePass(ID), cacheDisabled(false) { 
 
      mallocAlignment = 0;
+     livePeelIterations = 0;
+     DIEGeneration = 0;
 
    }
 
@@ -558,10 +637,18 @@ class LLPEAnalysisPass : public ModulePass {
    void loadArgv(Function*, std::string&, unsigned argvidx, unsigned& argc);
    void setParam(InlineAttempt* IA, long Idx, Constant* Val);
    void parseArgs(Function& F, std::vector<Constant*>&, uint32_t& argvIdx);
+   void parseSpecialisationArgs(Function& F, const SpecialisationConfig&, std::vector<Constant*>&, uint32_t& argvIdx);
+   void parseBatchConfig(const std::string& filename);
    void parseArgsPostCreation(InlineAttempt* IA);
    void parsePathConditions(cl::list<std::string>& L, PathConditionTypes Ty, InlineAttempt* IA);
    void createSpecialLocations();
    void createPointerArguments(InlineAttempt*);
+   void specialiseRoot(Function& F, std::vector<Constant*>&, uint32_t argvIdx);
+   void resetSpecialisationState();
+   void eraseRootArgvInsts();
+   void finishBatchSpecialisation(const std::string& name);
+   void noteBatchAssumptions(SpecialisationConfig&, std::vector<Constant*>& argConstants, uint32_t argvIdx);
+   void emitBatchDispatcher();
 
    virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
@@ -606,6 +693,29 @@ class LLPEAnalysisPass : public ModulePass {
      return it->second == C;
    }
 
+   bool peelBudgetExceeded(Function* F, BasicBlock* HBB, uint64_t iter) {
+     if(totalPeelBudget != 0 && livePeelIterations >= totalPeelBudget)
+       return true;
+     DenseMap<std::pair<Function*, BasicBlock*>, uint64_t>::iterator it = loopPeelBudgets.find(std::make_pair(F, HBB));
+     uint64_t budget = it == loopPeelBudgets.end() ? peelBudget : it->second;
+     return budget != 0 && iter >= budget;
+   }
+
+   // The narrowest domain declared for yield point CI calling F, if any.
+   YieldDomain* getYieldDomain(CallInst* CI, Function* F) {
+
+     SmallDenseMap<CallInst*, YieldDomain, 4>::iterator it = lockDomains.find(CI);
+     if(it != lockDomains.end())
+       return &it->second;
+     
+     SmallDenseMap<Function*, YieldDomain, 4>::iterator fit;
+     if(F && (fit = yieldDomains.find(F)) != yieldDomains.end())
+       return &fit->second;
+
+     return 0;
+
+   }
+
    bool atomicOpIsSimple(Instruction* LI) {
 
      return programSingleThreaded || simpleVolatileLoads.count(LI);
@@ -640,11 +750,15 @@ class LLPEAnalysisPass : public ModulePass {
    BasicBlock* parsePCBlock(Function* fStack, std::string& bbName);
    int64_t parsePCInst(BasicBlock* bb, Module* M, std::string& instIndexStr);
    void writeLliowdConfig();
+   void writeFileDeps();
+   void checkFileDepsBaseline();
 
    void initMRInfo(Module*);
+   void loadMRModels(Module*, const std::string&);
    IHPFunctionInfo* getMRInfo(Function*);
 
    void postCommitStats();
+   void mergeIdenticalCommitFunctions();
 
    void fixNonLocalUses();
    void initGlobalFDStore();
@@ -1237,6 +1351,7 @@ protected:
   bool tryPromoteOpenCall(ShadowInstruction* CI);
   bool tryResolveVFSCall(ShadowInstruction*);
   bool executeStatCall(ShadowInstruction* SI, Function* F, std::string& Filename);
+  bool executeMmapCall(ShadowInstruction* SI);
   WalkInstructionResult isVfsCallUsingFD(ShadowInstruction* VFSCall, ShadowInstruction* FD, bool ignoreClose);
   virtual void resolveReadCall(ShadowInstruction*, struct ReadFile);
   virtual void resolveSeekCall(ShadowInstruction*, struct SeekFile);
@@ -1245,6 +1360,7 @@ protected:
   bool isUnusedReadCall(ShadowInstruction*);
   OpenStatus& getOpenStatus(ShadowInstruction*);
   void tryKillAllVFSOps();
+  void batchVFSChecks();
   void initialiseFDStore(FDStore*);
 
   // Load forwarding extensions for varargs:
@@ -1257,6 +1373,9 @@ protected:
   void tryKillStoresInLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool disableWrites, bool latchToHeader = false);
   void tryKillStoresInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool disableWrites);
   void DSEAnalyseInstruction(ShadowInstruction* I, bool commitDisabledHere, bool disableWrites, bool enterCalls, bool& bail);
+  void DSEPassStoreToSuccessors(ShadowBB* BB, const ShadowLoopInvar* L, bool latchToHeader);
+  void findTentativeLoadsAndKillStoresInLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool secondPass, bool TLLatchToHeader, bool disableWrites, bool DSELatchToHeader);
+  void findTentativeLoadsAndKillStoresInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool secondPass, bool disableWrites);
 
   // User visitors:
   
@@ -1269,6 +1388,7 @@ protected:
 
   bool valueIsDead(ShadowValue);
   bool shouldDIE(ShadowInstruction* V);
+  bool tryKillInst(ShadowInstruction* SI);
   virtual void runDIE();
 
   virtual bool ctxContains(IntegrationAttempt*) = 0;
@@ -1290,6 +1410,10 @@ protected:
   // Estimating inlining / unrolling benefit:
 
   virtual void findProfitableIntegration();
+  double getProfileWeight(ShadowBBInvar*);
+  virtual uint64_t predictCommitSize();
+  void collectSizeBudgetCandidates(std::vector<SizeBudgetCandidate>&, int32_t parentIdx);
+  uint64_t getCommittedChildCharge(bool onlyEnabled);
   virtual void findResidualFunctions(DenseSet<Function*>&, DenseMap<Function*, unsigned>&);
   int64_t getResidualInstructions();
 
@@ -1297,6 +1421,7 @@ protected:
 
   void inheritDiagnosticsFrom(IntegrationAttempt*);
   void countTentativeInstructions();
+  void reportTLChecks();
   void printRHS(ShadowValue, raw_ostream& Out);
   void printOutgoingEdge(ShadowBBInvar* BBI, ShadowBB* BB, ShadowBBInvar* SBI, ShadowBB* SB, uint32_t i, bool useLabels, const ShadowLoopInvar* deferEdgesOutside, SmallVector<std::string, 4>* deferredEdges, raw_ostream& Out, bool brief);
   void describeBlockAsDOT(ShadowBBInvar* BBI, ShadowBB* BB, const ShadowLoopInvar* deferEdgesOutside, SmallVector<std::string, 4>* deferredEdges, raw_ostream& Out, SmallVector<ShadowBBInvar*, 4>* forceSuccessors, bool brief, bool plain = false);
@@ -1324,6 +1449,7 @@ protected:
   // Data export for the Integrator pass:
 
   virtual std::string getShortHeader() = 0;
+  virtual void printContextPath(raw_ostream&) = 0;
   bool hasChildren();
   virtual bool canDisable() = 0;
   unsigned getTotalInstructions();
@@ -1370,6 +1496,11 @@ protected:
   Value* getCommittedValueOrBlock(ShadowInstruction* I, uint32_t idx, ConstantInt*& failValue, BasicBlock*& failBlock);
   BasicBlock* getInvokeNormalSuccessor(ShadowInstruction*, bool& toCheckBlock);
   void releaseMemoryPostCommit();
+  void releaseContextMemory(bool discarding);
+  void discardUncommitted();
+  void forgetAllocationsAndFDs(DenseSet<uint32_t>& forgottenHeapObjects);
+  void discardPeelAttempt(PeelAttempt*);
+  void rerollPeeledLoops();
   BasicBlock* createBasicBlock(LLVMContext& Ctx, const Twine& Name, Function* AddF, bool isEntryBlock, bool isFailedBlock);
   BasicBlock* CloneBasicBlockFrom(const BasicBlock* BB,
 				  ValueToValueMapTy& VMap,
@@ -1418,7 +1549,9 @@ protected:
   SmallVector<CommittedBlock, 1>::iterator emitPathConditionChecks(ShadowBB* BB);
   ShadowValue getPathConditionSV(uint32_t instStackIdx, BasicBlock* instBB, uint32_t instIdx);
   ShadowValue getPathConditionSV(PathCondition& Cond);
-  void emitPathConditionCheck(PathCondition& Cond, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
+  Instruction* emitPathConditionTest(PathCondition& Cond, PathConditionTypes Ty, BasicBlock* emitBlock);
+  Instruction* emitIntmemRunTest(PathCondition** begin, PathCondition** end, BasicBlock* emitBlock);
+  void emitPathConditionCheck(PathConditionGroup& Group, PathConditionTypes Ty, ShadowBB* BB, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
   void emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
   void emitPathConditionChecks2(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& it);
   bool hasSpecialisedCompanion(ShadowBBInvar* BBI);
@@ -1447,6 +1580,7 @@ protected:
   void findTentativeLoadsInLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool secondPass, bool latchToHeader = false);
   void findTentativeLoadsInUnboundedLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool secondPass);
   void TLAnalyseInstruction(ShadowInstruction&, bool commitDisabledHere, bool secondPass, bool inLoopAnalyser);
+  void TLPassStoreToSuccessors(ShadowBB* BB, const ShadowLoopInvar* L, bool latchToHeader);
   bool requiresRuntimeCheck2(ShadowValue V, bool includeSpecialChecks);
   bool containsTentativeLoads();
   void addCheckpointFailedBlocks();
@@ -1530,6 +1664,7 @@ public:
   virtual void collectAllLoopStats(); 
 
   virtual std::string getShortHeader(); 
+  virtual void printContextPath(raw_ostream&);
 
   virtual bool canDisable(); 
   virtual bool isEnabled(); 
@@ -1605,6 +1740,9 @@ class PeelAttempt {
 
    const ShadowLoopInvar* L;
 
+   // Set if we stopped peeling because an iteration budget ran out.
+   bool overBudget;
+
    int64_t totalIntegrationGoodness;
    bool integrationGoodnessValid;
 
@@ -1657,6 +1795,9 @@ class PeelAttempt {
 
    void releaseCommittedChildren();
 
+   void rerollIterations();
+   bool rerollIsProfitable(uint32_t runLength, uint32_t bodyInsts, uint32_t overheadInsts);
+
    std::string getLName() const;
 
 };
@@ -1697,6 +1838,8 @@ class InlineAttempt : public IntegrationAttempt {
   SmallVector<ShadowInstruction*, 1> Callers;
   ShadowInstruction* activeCaller;
   IntegrationAttempt* uniqueParent;
+  // Functions with a call on the stack leading here, including F.
+  ImmutableSet<Function*> stackFunctions;
 
   Function* CommitF;
   Function::iterator firstFailedBlock;
@@ -1730,8 +1873,18 @@ class InlineAttempt : public IntegrationAttempt {
 
   SharingState* sharing;
 
+  // The DIE run that last swept this context; see DIE.cpp.
+  uint32_t DIEGeneration;
+
+  // Instructions charged against the size budget by committing this context and its children; see IntBenefit.cpp.
+  uint64_t chargedSize;
+
   DominatorTree* DT;
   SmallDenseMap<uint32_t, uint32_t, 8>* blocksReachableOnFailure;
+  // Set if unspecialised code can be entered anywhere other than the very start of the function.
+  bool failsMidFunction;
+  // Set during commit if failing paths call the original function rather than a private clone of it.
+  bool usingSharedFallback;
   std::vector<SmallVector<std::pair<BasicBlock*, uint32_t>, 1> > failedBlocks;
   ValueToValueMapTy* failedBlockMap;
   // Indexes from CLONED instruction/block to replacement PHI node to use in that block.
@@ -1767,6 +1920,7 @@ class InlineAttempt : public IntegrationAttempt {
   virtual void collectAllLoopStats(); 
 
   virtual std::string getShortHeader(); 
+  virtual void printContextPath(raw_ostream&);
 
   virtual bool canDisable(); 
   virtual bool isEnabled(); 
@@ -1783,6 +1937,8 @@ class InlineAttempt : public IntegrationAttempt {
 
   virtual void findResidualFunctions(DenseSet<Function*>&, DenseMap<Function*, unsigned>&); 
   virtual void findProfitableIntegration(); 
+  virtual uint64_t predictCommitSize();
+  void enforceSizeBudget();
 
   virtual WalkInstructionResult queuePredecessorsBW(ShadowBB* FromBB, BackwardIAWalker* Walker, void* ctx);
   virtual void queueSuccessorsFW(ShadowBB* BB, ForwardIAWalker* Walker, void* ctx);
@@ -1800,6 +1956,9 @@ class InlineAttempt : public IntegrationAttempt {
   std::string getCommittedBlockPrefix();
   BasicBlock* getCommittedEntryBlock();
   virtual void runDIE();
+  void runDIEFromRoot();
+  bool tryKillArg(ShadowArg* SA);
+  void queueDIEReturns();
   virtual void visitExitPHI(ShadowInstructionInvar* UserI, DIVisitor& Visitor);
 
   Value* getArgCommittedValue(ShadowArg* SA, BasicBlock* emitBB);
@@ -1839,6 +1998,9 @@ class InlineAttempt : public IntegrationAttempt {
   // Conditional specialisation:
   void addBlockAndPreds(uint32_t idx, DenseSet<uint32_t>& Set);
   void markBlockAndSuccsReachableUnspecialised(uint32_t idx, uint32_t instIdx);
+  void markBlockAndSuccsReachableUnspecialised2(uint32_t idx, uint32_t instIdx);
+  bool canUseSharedFallback();
+  void createSharedFallbackBlock();
   void setTargetCall(std::pair<BasicBlock*, uint32_t>& arg, uint32_t stackIdx);
   virtual BasicBlock* getSuccessorBB(ShadowBB* BB, uint32_t succIdx, bool& markUnreachable);
   bool hasFailedReturnPath();
@@ -1864,8 +2026,12 @@ class InlineAttempt : public IntegrationAttempt {
   BasicBlock* getSubBlockForInst(uint32_t, uint32_t);
 
   void tryKillStores(bool commitDisabledHere, bool disableWrites);
+  void initDSEEntryStore();
 
   void findTentativeLoads(bool commitDisabledHere, bool secondPass);
+  void initTLEntryStore();
+
+  void findTentativeLoadsAndKillStores(bool commitDisabledHere, bool secondPass);
 
   virtual void printPathConditions(raw_ostream& Out, ShadowBBInvar* BBI, ShadowBB* BB);
   virtual void noteAsExpectedChecks(ShadowBB* BB);
@@ -1876,6 +2042,8 @@ class InlineAttempt : public IntegrationAttempt {
 
   virtual uint64_t findSaveSplits();
   void splitCommitHere();
+  double estimateDynamicEntries();
+  uint32_t getSplitBoundaryCost();
 
   void gatherIndirectUsers();
   InlineAttempt* getStackFrameCtx(int32_t);
@@ -2060,6 +2228,8 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  bool blockAssumedToExecute(ShadowBB*);
 
  Function* cloneEmptyFunction(Function* F, GlobalValue::LinkageTypes LT, const Twine& Name, bool addFailedReturnFlag);
+ void unregisterCommittedAllocations(Function* F);
+ void unregisterCommittedAllocations(BasicBlock* BB);
 
  Constant* getGVOffset(Constant* GV, int64_t Offset, Type* targetType);
 
@@ -2101,6 +2271,8 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& SrcPtrSet, uint64_t Size, ShadowInstruction*);
  void executeVaStartInst(ShadowInstruction* SI);
  void executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uint64_t FileOffset, uint64_t Size);
+ void executeMmapInst(ShadowInstruction* SI, Constant* FileBytes);
+ bool executeMunmapInst(ShadowInstruction* SI);
  void executeUnexpandedCall(ShadowInstruction* SI);
  bool clobberSyscallModLocations(Function* F, ShadowInstruction* SI);
  void executeWriteInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& ValPB, uint64_t PtrSize, ShadowInstruction*);
@@ -2141,11 +2313,13 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  PHINode* makePHI(Type* Ty, const Twine& Name, BasicBlock* emitBB);
  
  void printPathCondition(PathCondition& PC, PathConditionTypes t, ShadowBB* BB, raw_ostream& Out, bool HTMLEscaped);
+ Instruction* emitStringEqualityTest(Value* Str, Constant* Expected, BasicBlock* emitBlock);
  void emitRuntimePrint(BasicBlock* BB, std::string& message, Value* param, Instruction* insertBefore = 0);
  void escapePercent(std::string&);
 
  void clearAsExpectedChecks(ShadowBB*);
  void noteLLIODependency(std::string&);
+ void noteFileReader(std::string&, IntegrationAttempt*);
 
  const GlobalValue* getUnderlyingGlobal(const GlobalValue* V);
 
@@ -2178,6 +2352,14 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void doDSECallMerge(ShadowBB* BB, InlineAttempt* IA);
 
  void TLWalkPathConditions(ShadowBB* BB, bool contextEnabled, bool secondPass);
+ bool TLReportEnabled();
+ void noteTLClobber(ShadowInstruction*);
+ void noteTLCheck(ShadowInstruction*);
+ void countTLCheck(ShadowInstruction*);
+ void resetTLClobber();
+ void resetTLReportState();
+ void writeTLReport();
+ void resetSizeBudget();
  void rerunTentativeLoads(ShadowInstruction*, InlineAttempt*, bool inLoopAnalyser);
  void patchReferences(std::vector<std::pair<WeakVH, uint32_t> >& Refs, Value* V);
  void forwardReferences(Value* Fwd, Module* M);
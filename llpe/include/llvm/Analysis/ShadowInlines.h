@@ -1111,7 +1111,7 @@ struct OrdinaryStoreExtraState {
 
 struct TrackedStore {
 
-  ShadowInstruction* I; // Invalid if isCommitted
+  ShadowInstruction* I; // Invalid if isCommitted; null if the owning context was discarded
   bool isCommitted;
   WeakVH* committedInsts; // Valid if the store was live when committed.
   uint64_t nCommittedInsts;
@@ -1123,6 +1123,7 @@ struct TrackedStore {
   bool canKill() const;
   void kill();
   void derefBytes(uint64_t nBytes);
+  void discard();
 
 };
 
@@ -1138,6 +1139,7 @@ struct TrackedAlloc {
   bool isNeeded;
 
   bool dropReference();
+  void discard();
 
   TrackedAlloc(ShadowInstruction* _SI);
   ~TrackedAlloc();
@@ -1213,13 +1215,20 @@ class TLMapPointer;
 extern TLMapPointer TLEmptyMapPtr;
 class TLStoreExtraState;
 
+// Objects no larger than this keep their known-good bytes in an inline bitmap
+// rather than an IntervalMap, which is the common case and much cheaper to copy and merge.
+#define TL_SMALL_OBJECT_BYTES 64
+
 struct TLMapPointer {
 
   TLMapTy* M;
+  uint64_t smallGood; // Valid if isSmall; bit i set means byte i is known good.
+  bool isSmall;
 
-TLMapPointer() : M(0) {}
-TLMapPointer(TLMapTy* _M) : M(_M) {}
-TLMapPointer(const TLMapPointer& other) : M(other.M) {}
+TLMapPointer() : M(0), smallGood(0), isSmall(false) {}
+TLMapPointer(TLMapTy* _M) : M(_M), smallGood(0), isSmall(false) {}
+TLMapPointer(uint64_t _smallGood) : M(0), smallGood(_smallGood), isSmall(true) {}
+TLMapPointer(const TLMapPointer& other) : M(other.M), smallGood(other.smallGood), isSmall(other.isSmall) {}
 
   static TLMapPointer& getEmptyStore() {
 
@@ -1227,20 +1236,29 @@ TLMapPointer(const TLMapPointer& other) : M(other.M) {}
 
   }
 
+  // Small maps are compared by value, since they're never shared.
   static bool LT(const TLMapPointer* a, const TLMapPointer* b) {
 
+    if(a->isSmall != b->isSmall)
+      return a->isSmall < b->isSmall;
+    if(a->isSmall)
+      return a->smallGood < b->smallGood;
     return a->M < b->M;
 
   }
 
   static bool EQ(const TLMapPointer* a, const TLMapPointer* b) {
 
+    if(a->isSmall != b->isSmall)
+      return false;
+    if(a->isSmall)
+      return a->smallGood == b->smallGood;
     return a->M == b->M;
 
   }
 
   static LocalStoreMap<TLMapPointer, TLStoreExtraState>* getMapForBlock(ShadowBB* BB);
-  bool isValid() { return !!M; }
+  bool isValid() { return isSmall || !!M; }
   void checkMergedResult() { }
   TLMapPointer getReadableCopy();
   bool dropReference();
@@ -1249,6 +1267,10 @@ TLMapPointer(const TLMapPointer& other) : M(other.M) {}
 			  uint64_t ASize, MergeBlockVisitor<TLMapPointer, TLStoreExtraState>* Visitor);
   static void simplifyStore(TLMapPointer*) { }
   bool derefWillAllowSimplify() { return false; }
+  bool isGood(uint64_t Start, uint64_t Stop);
+  void markGood(uint64_t Start, uint64_t Stop);
+  void clear();
+  void makeSmall();
   
 };
 
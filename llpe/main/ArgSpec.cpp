@@ -158,7 +158,8 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
       // Get a pointer into the real argv:
       Constant* gepArg = ConstantInt::get(Int64, i);
       Instruction* argvPtr = GetElementPtrInst::Create(Arg, gepArg, "argv_ptr", InsertBefore);
-      new StoreInst(stringPtr, argvPtr, InsertBefore);
+      rootArgvInsts.push_back(argvPtr);
+      rootArgvInsts.push_back(new StoreInst(stringPtr, argvPtr, InsertBefore));
 
     }
 
@@ -168,7 +169,8 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
   Constant* gepArg = ConstantInt::get(Int64, argc);
   Instruction* argvEndPtr = GetElementPtrInst::Create(Arg, gepArg, "argv_end_ptr", InsertBefore);
   Constant* nullPtr = Constant::getNullValue(BytePtr);
-  new StoreInst(nullPtr, argvEndPtr, InsertBefore);
+  rootArgvInsts.push_back(argvEndPtr);
+  rootArgvInsts.push_back(new StoreInst(nullPtr, argvEndPtr, InsertBefore));
 
   F->setDoesNotAlias(argvIdx+1);
 
@@ -13,6 +13,8 @@
 #include "llvm/IR/DIBuilder.h"
 #include "llvm/Support/CommandLine.h"
 
+#include <algorithm>
+#include <fstream>
 #include <sstream>
 #include <string>
 
@@ -28,6 +30,7 @@ static cl::opt<std::string> EnvFileAndIdx("spec-env", cl::init(""));
 static cl::opt<std::string> ArgvFileAndIdxs("spec-argv", cl::init(""));
 static cl::opt<unsigned> MallocAlignment("llpe-malloc-alignment", cl::init(1));
 static cl::list<std::string> SpecialiseParams("spec-param", cl::ZeroOrMore);
+static cl::opt<std::string> BatchConfigFile("llpe-batch-config", cl::init(""));
 static cl::list<std::string> AlwaysInlineFunctions("llpe-always-inline", cl::ZeroOrMore);
 static cl::list<std::string> OptimisticLoops("llpe-optimistic-loop", cl::ZeroOrMore);
 static cl::list<std::string> AlwaysIterLoops("llpe-always-iterate", cl::ZeroOrMore);
@@ -36,6 +39,9 @@ static cl::list<std::string> IgnoreLoops("llpe-ignore-loop", cl::ZeroOrMore);
 static cl::list<std::string> IgnoreLoopsWithChildren("llpe-ignore-loop-children", cl::ZeroOrMore);
 static cl::list<std::string> AlwaysExploreFunctions("llpe-always-explore", cl::ZeroOrMore);
 static cl::list<std::string> LoopMaxIters("llpe-loop-max", cl::ZeroOrMore);
+static cl::opt<unsigned> PeelBudget("llpe-peel-budget", cl::init(0));
+static cl::list<std::string> LoopPeelBudgets("llpe-peel-budget-loop", cl::ZeroOrMore);
+static cl::opt<unsigned> TotalPeelBudget("llpe-total-peel-budget", cl::init(0));
 static cl::list<std::string> IgnoreBlocks("llpe-ignore-block", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsInt("llpe-path-condition-int", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsFptr("llpe-path-condition-fptr", cl::ZeroOrMore);
@@ -59,12 +65,14 @@ static cl::list<std::string> YieldFunctions("llpe-yield-function", cl::ZeroOrMor
 static cl::list<std::string> TargetStack("llpe-target-stack", cl::ZeroOrMore);
 static cl::list<std::string> SimpleVolatiles("llpe-simple-volatile-load", cl::ZeroOrMore);
 static cl::list<std::string> LockDomains("llpe-lock-domain", cl::ZeroOrMore);
+static cl::list<std::string> YieldDomains("llpe-yield-domain", cl::ZeroOrMore);
 static cl::list<std::string> PessimisticLocks("llpe-pessimistic-lock", cl::ZeroOrMore);
 static cl::opt<bool> DumpDSE("llpe-dump-dse");
 static cl::opt<bool> DumpTL("llpe-dump-tl");
 static cl::list<std::string> ForceNoAliasArgs("llpe-force-noalias-arg", cl::ZeroOrMore);
 static cl::list<std::string> VarAllocators("llpe-allocator-fn", cl::ZeroOrMore);
 static cl::list<std::string> ConstAllocators("llpe-allocator-fn-const", cl::ZeroOrMore);
+static cl::list<std::string> ArenaAllocators("llpe-arena-allocator-fn", cl::ZeroOrMore);
 static cl::opt<bool> VerbosePathConditions("llpe-verbose-path-conditions");
 static cl::opt<std::string> LLIOPreludeFn("llpe-prelude-fn", cl::init(""));
 static cl::opt<int> LLIOPreludeStackIdx("llpe-prelude-stackidx", cl::init(-1));
@@ -76,6 +84,7 @@ static cl::opt<bool> OmitChecks("llpe-omit-checks");
 static cl::opt<bool> OmitMallocChecks("llpe-omit-malloc-checks");
 static cl::list<std::string> SplitFunctions("llpe-force-split");
 static cl::opt<bool> EmitFakeDebug("llpe-emit-fake-debug");
+static cl::opt<std::string> ProfileFile("llpe-profile", cl::init(""));
 
 static void dieEnvUsage() {
 
@@ -102,7 +111,7 @@ static bool parseIntCommaString(const std::string& str, long& idx, std::string&
 
   size_t splitIdx = str.find(',');
 
-  if(splitIdx == std::string::npos || splitIdx == 0 || splitIdx == EnvFileAndIdx.size() - 1) {
+  if(splitIdx == std::string::npos || splitIdx == 0 || splitIdx == str.size() - 1) {
     return false;
   }
   
@@ -245,6 +254,56 @@ static void parseFBI(const char* paramName, const std::string& arg, Module& M, F
 
 }
 
+// Parse a comma-separated list of objects a yield point may expose: each is either
+// a global variable name or an allocation site given as function:block:index.
+// Allocation sites are registered in SiteObjects so their heap objects get recorded.
+static void parseYieldDomain(const char* paramName, const std::string& objects, Module& M, YieldDomain& Domain,
+			     DenseMap<Instruction*, std::vector<uint32_t> >& SiteObjects) {
+
+  std::istringstream istr(objects);
+  while(!istr.eof()) {
+      
+    std::string thisObject;
+    std::getline(istr, thisObject, ',');
+    if(thisObject.empty())
+      continue;
+
+    if(thisObject.find(':') == std::string::npos) {
+
+      GlobalVariable* GV = M.getGlobalVariable(thisObject, true);
+      if(!GV) {
+
+	errs() << "Global not found: " << thisObject << "\n";
+	exit(1);
+
+      }
+      Domain.globals.push_back(GV);
+      continue;
+
+    }
+
+    std::string FBI(thisObject);
+    std::replace(FBI.begin(), FBI.end(), ':', ',');
+
+    Function* SiteF;
+    BasicBlock* BB;
+    uint64_t Offset;
+    parseFBI(paramName, FBI, M, SiteF, BB, Offset);
+
+    BasicBlock::iterator BI = BB->begin();
+    std::advance(BI, Offset);
+    if((!isa<CallInst>(BI)) && (!isa<InvokeInst>(BI))) {
+      errs() << paramName << ": " << thisObject << " does not denote an allocation call\n";
+      exit(1);
+    }
+
+    Domain.allocSites.insert(BI);
+    SiteObjects[BI];
+
+  }
+
+}
+
 void LLPEAnalysisPass::setParam(InlineAttempt* IA, long Idx, Constant* Val) {
 
   Type* Target = IA->F.getFunctionType()->getParamType(Idx);
@@ -618,17 +677,14 @@ void LLPEAnalysisPass::parsePathConditions(cl::list<std::string>& L, PathConditi
 
 }
 
-void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstants, uint32_t& argvIdxOut) {
+// Set root function arguments according to Config's environment, argv and parameter specifications.
+void LLPEAnalysisPass::parseSpecialisationArgs(Function& F, const SpecialisationConfig& Config, std::vector<Constant*>& argConstants, uint32_t& argvIdxOut) {
 
-  this->statsFile = StatsFile;
-  this->mallocAlignment = MallocAlignment;
-  this->maxContexts = MaxContexts;
-  
-  if(EnvFileAndIdx != "") {
+  if(!Config.env.empty()) {
 
     long idx;
     std::string EnvFile;
-    if(!parseIntCommaString(EnvFileAndIdx, idx, EnvFile))
+    if(!parseIntCommaString(Config.env, idx, EnvFile))
       dieEnvUsage();
 
     CHECK_ARG(idx, argConstants);
@@ -637,11 +693,11 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
-  if(ArgvFileAndIdxs != "") {
+  if(!Config.argv.empty()) {
 
     long argcIdx;
     std::string ArgvFileAndIdx;
-    if(!parseIntCommaString(ArgvFileAndIdxs, argcIdx, ArgvFileAndIdx))
+    if(!parseIntCommaString(Config.argv, argcIdx, ArgvFileAndIdx))
       dieArgvUsage();
     long argvIdx;
     std::string ArgvFile;
@@ -656,7 +712,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
-  for(cl::list<std::string>::const_iterator ArgI = SpecialiseParams.begin(), ArgE = SpecialiseParams.end(); ArgI != ArgE; ++ArgI) {
+  for(std::vector<std::string>::const_iterator ArgI = Config.params.begin(), ArgE = Config.params.end(); ArgI != ArgE; ++ArgI) {
 
     long idx;
     std::string Param;
@@ -739,6 +795,95 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+}
+
+// Read a batch of specialisation configurations, one per line, of the form
+// name [spec-env=N,file] [spec-argv=M,N,file] [spec-param=N,value]...
+// Blank lines and those starting with # are ignored.
+void LLPEAnalysisPass::parseBatchConfig(const std::string& filename) {
+
+  std::ifstream ifs(filename.c_str());
+  if(!ifs.good()) {
+
+    errs() << "Failed to open " << filename << "\n";
+    exit(1);
+
+  }
+
+  std::string line;
+  while(std::getline(ifs, line)) {
+
+    std::istringstream istr(line);
+    std::string name;
+    if(!(istr >> name) || name[0] == '#')
+      continue;
+
+    for(std::vector<SpecialisationConfig>::iterator it = batchConfigs.begin(),
+	  itend = batchConfigs.end(); it != itend; ++it) {
+
+      if(it->name == name) {
+	errs() << "Duplicate batch configuration " << name << "\n";
+	exit(1);
+      }
+
+    }
+
+    batchConfigs.push_back(SpecialisationConfig());
+    SpecialisationConfig& Config = batchConfigs.back();
+    Config.name = name;
+
+    std::string setting;
+    while(istr >> setting) {
+
+      size_t eqIdx = setting.find('=');
+      std::string key = setting.substr(0, eqIdx);
+      std::string value = eqIdx == std::string::npos ? std::string() : setting.substr(eqIdx + 1);
+
+      if(value.empty()) {
+	errs() << "Batch configuration " << name << ": expected key=value, not " << setting << "\n";
+	exit(1);
+      }
+
+      if(key == "spec-env")
+	Config.env = value;
+      else if(key == "spec-argv")
+	Config.argv = value;
+      else if(key == "spec-param")
+	Config.params.push_back(value);
+      else {
+	errs() << "Batch configuration " << name << ": unknown setting " << key << "\n";
+	exit(1);
+      }
+
+    }
+
+  }
+
+  if(batchConfigs.empty()) {
+
+    errs() << "No configurations found in " << filename << "\n";
+    exit(1);
+
+  }
+
+}
+
+void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstants, uint32_t& argvIdxOut) {
+
+  this->statsFile = StatsFile;
+  this->mallocAlignment = MallocAlignment;
+  this->maxContexts = MaxContexts;
+  
+  // Command-line specialisations apply to every configuration in a batch.
+  SpecialisationConfig Config;
+  Config.env = EnvFileAndIdx;
+  Config.argv = ArgvFileAndIdxs;
+  Config.params.insert(Config.params.end(), SpecialiseParams.begin(), SpecialiseParams.end());
+  parseSpecialisationArgs(F, Config, argConstants, argvIdxOut);
+
+  if(BatchConfigFile != "")
+    parseBatchConfig(BatchConfigFile);
+
   for(cl::list<std::string>::const_iterator ArgI = AlwaysInlineFunctions.begin(), ArgE = AlwaysInlineFunctions.end(); ArgI != ArgE; ++ArgI) {
 
     Function* AlwaysF = F.getParent()->getFunction(*ArgI);
@@ -828,6 +973,21 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  for(cl::list<std::string>::const_iterator ArgI = LoopPeelBudgets.begin(), ArgE = LoopPeelBudgets.end(); ArgI != ArgE; ++ArgI) {
+
+    Function* LF;
+    BasicBlock* HBB;
+    uint64_t Count;
+    
+    parseFBI("llpe-peel-budget-loop", *ArgI, *(F.getParent()), LF, HBB, Count);
+
+    loopPeelBudgets[std::make_pair(LF, HBB)] = Count;
+
+  }
+
+  this->peelBudget = PeelBudget;
+  this->totalPeelBudget = TotalPeelBudget;
+
   for(cl::list<std::string>::const_iterator ArgI = SpecialLocations.begin(), ArgE = SpecialLocations.end(); ArgI != ArgE; ++ArgI) {
 
     std::istringstream istr(*ArgI);
@@ -995,28 +1155,30 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
       exit(1);
     }
 
-    std::vector<GlobalVariable*>& thisDomain = lockDomains[CI];
-
-    std::string globals(*it, pos);
+    parseYieldDomain("llpe-lock-domain", std::string(*it, pos), *(F.getParent()), lockDomains[CI], heapObjectsBySite);
 
-    std::istringstream istr(globals);
-    while(!istr.eof()) {
-      
-      std::string thisGlobal;
-      std::getline(istr, thisGlobal, ',');
-      if(thisGlobal.empty())
-	continue;
-      GlobalVariable* GV = F.getParent()->getGlobalVariable(thisGlobal, true);
-      if(!GV) {
+  }
 
-	errs() << "Global not found: " << thisGlobal << "\n";
-	exit(1);
+  for(cl::list<std::string>::iterator it = YieldDomains.begin(),
+	itend = YieldDomains.end(); it != itend; ++it) {
 
-      }
-      thisDomain.push_back(GV);
+    size_t pos = it->find(',');
+    if(pos == std::string::npos) {
+      errs() << "llpe-yield-domain: usage: yieldf,object1,...,objectn\n";
+      exit(1);
+    }
 
+    std::string fName(*it, 0, pos);
+    Function* YieldF = F.getParent()->getFunction(fName);
+    if(!YieldF) {
+      errs() << "-llpe-yield-domain: no such function " << fName << "\n";
+      exit(1);
     }
 
+    // Declaring a domain implies the function is a yield point.
+    yieldFunctions.insert(YieldF);
+    parseYieldDomain("llpe-yield-domain", std::string(*it, pos + 1), *(F.getParent()), yieldDomains[YieldF], heapObjectsBySite);
+
   }
 
   for(cl::list<std::string>::iterator it = PessimisticLocks.begin(),
@@ -1147,7 +1309,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
       }
 
       uint32_t reallocPtrIdx = getInteger(reallocPtrIdxStr, "llpe-allocator-fn sixth param");
-      uint32_t reallocSizeIdx = getInteger(reallocPtrIdxStr, "llpe-allocator-fn seventh param");
+      uint32_t reallocSizeIdx = getInteger(reallocSizeIdxStr, "llpe-allocator-fn seventh param");
       reallocatorFunctions[reallocF] = ReallocatorFn(reallocPtrIdx, reallocSizeIdx);
       SpecialFunctionMap[reallocF] = SF_REALLOC;
 
@@ -1155,6 +1317,49 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  for(cl::list<std::string>::iterator it = ArenaAllocators.begin(),
+	itend = ArenaAllocators.end(); it != itend; ++it) {
+
+    std::string fName, sizeIdxStr, arenaIdxStr, resetName, resetIdxStr;
+
+    std::istringstream istr(*it);
+    std::getline(istr, fName, ',');
+    std::getline(istr, sizeIdxStr, ',');
+    std::getline(istr, arenaIdxStr, ',');
+    std::getline(istr, resetName, ',');
+    std::getline(istr, resetIdxStr, ',');
+
+    Function* allocF = F.getParent()->getFunction(fName);
+    if(!allocF) {
+
+      errs() << "-llpe-arena-allocator-fn: usage: allocf,sizearg,arenaarg[,resetf,resetarenaarg]\n";
+      exit(1);
+
+    }
+
+    AllocatorFn AF = AllocatorFn::getVariableSize(getInteger(sizeIdxStr, "llpe-arena-allocator-fn second param"));
+    AF.arenaArg = getInteger(arenaIdxStr, "llpe-arena-allocator-fn third param");
+    allocatorFunctions[allocF] = AF;
+    SpecialFunctionMap[allocF] = SF_MALLOC;
+
+    if(!resetName.empty()) {
+
+      Function* resetF = F.getParent()->getFunction(resetName);
+      if(!resetF) {
+
+	errs() << "-llpe-arena-allocator-fn: bad reset function " << resetName << "\n";
+	exit(1);
+
+      }
+
+      uint32_t resetArg = getInteger(resetIdxStr, "llpe-arena-allocator-fn fifth param");
+      deallocatorFunctions[resetF] = DeallocatorFn(resetArg, true);
+      SpecialFunctionMap[resetF] = SF_FREE;
+
+    }
+
+  }
+
   for(cl::list<std::string>::iterator it = NeverInline.begin(), itend = NeverInline.end(); it != itend; ++it) {
 
     Function* IgnoreF = F.getParent()->getFunction(*it);
@@ -1183,6 +1388,9 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  if(!ProfileFile.empty())
+    loadBlockProfile(*F.getParent(), ProfileFile);
+
   if(Function* libcMalloc = F.getParent()->getFunction("malloc"))
     allocatorFunctions[libcMalloc] = AllocatorFn::getVariableSize(0);
   if(Function* libcFree = F.getParent()->getFunction("free"))
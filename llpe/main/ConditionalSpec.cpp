@@ -20,6 +20,14 @@ using namespace llvm;
 
 extern cl::opt<bool> VerboseNames;
 
+// Check each path condition with its own test-and-branch, rather than merging memory conditions
+// on the same object and string conditions into combined tests.
+static cl::opt<bool> NoMergePathConditions("llpe-no-merge-path-conditions");
+
+// Give every failing context a private unspecialised clone of its function, even when a call
+// to the original function would do.
+static cl::opt<bool> NoSharedFallback("llpe-no-shared-fallback");
+
 // Functions relating to conditional specialisation
 // (that is, situations where the specialiser assumes some condition, specialises according to it,
 //  and at commit time must synthesise duplicate successor blocks: specialised, and unmodified).
@@ -56,6 +64,16 @@ void IntegrationAttempt::checkTargetStack(ShadowInstruction* SI, InlineAttempt*
 // this path" or because a runtime check needs to branch here on failure.
 void InlineAttempt::markBlockAndSuccsReachableUnspecialised(uint32_t idx, uint32_t instIdx) {
 
+  // Note whether we might need to resume unspecialised execution with state other than our arguments.
+  if(idx != 0 || instIdx != 0)
+    failsMidFunction = true;
+
+  markBlockAndSuccsReachableUnspecialised2(idx, instIdx);
+
+}
+
+void InlineAttempt::markBlockAndSuccsReachableUnspecialised2(uint32_t idx, uint32_t instIdx) {
+
   release_assert(getBBInvar(idx)->insts.size() > instIdx);
 
   if(pass->omitChecks)
@@ -74,7 +92,7 @@ void InlineAttempt::markBlockAndSuccsReachableUnspecialised(uint32_t idx, uint32
   // Mark all successors reachable too.
   ShadowBBInvar* BBI = getBBInvar(idx);
   for(uint32_t i = 0, ilim = BBI->succIdxs.size(); i != ilim; ++i)
-    markBlockAndSuccsReachableUnspecialised(BBI->succIdxs[i], 0);  
+    markBlockAndSuccsReachableUnspecialised2(BBI->succIdxs[i], 0);  
 
 }
 
@@ -525,11 +543,27 @@ bool InlineAttempt::hasFailedReturnPath() {
 
 void IntegrationAttempt::initFailedBlockCommit() {}
 
+// If the only way into unspecialised code is at the very top of the function, before anything has
+// executed, then the unspecialised path is just a call to the original function with our arguments.
+// That function body is shared by every context that fails this way, where otherwise each would
+// get its own clone. We need our own residual function for this, so that its arguments are the
+// call's real arguments and we can return directly; the root function is left alone since its
+// original gets replaced by the specialised version at the end of commit.
+bool InlineAttempt::canUseSharedFallback() {
+
+  return blocksReachableOnFailure && !failsMidFunction && !NoSharedFallback &&
+    commitsOutOfLine() && !isRootMainCall() && !F.isVarArg() && 
+    &F != &pass->RootIA->F;
+
+}
+
 void InlineAttempt::initFailedBlockCommit() {
 
   if(pass->omitChecks)
     release_assert(!blocksReachableOnFailure);
 
+  usingSharedFallback = canUseSharedFallback();
+
   // We won't need PHIForwards or ForwardingPHIs until the instruction commit phase;
   // they will remain 0-sized and unallocated until then.
   // failedBlockMap only needs to hold a little more than one entry per failed block here.
@@ -576,10 +610,94 @@ struct matchesFromIdx {
 
 };
 
-static uint32_t countPathConditionsIn(BasicBlock* BB, uint32_t stackIdx, std::vector<PathCondition>& Conds) {
+// Size in bytes of an integer-memory condition that can be merged with others testing
+// the same object, or 0 if it must be tested alone (pointers, FP and aggregate values).
+static uint64_t mergeableIntmemSize(PathCondition& C) {
+
+  ConstantInt* CI = dyn_cast<ConstantInt>(C.u.val);
+  if(!CI)
+    return 0;
+
+  unsigned bits = CI->getType()->getBitWidth();
+  if(bits % 8)
+    return 0;
+
+  return bits / 8;
+
+}
+
+static bool sameConditionObject(PathCondition& C1, PathCondition& C2) {
+
+  return C1.instStackIdx == C2.instStackIdx && C1.instBB == C2.instBB && C1.instIdx == C2.instIdx;
+
+}
+
+static bool lowerOffset(const PathCondition* C1, const PathCondition* C2) {
+
+  return C1->offset < C2->offset;
+
+}
+
+// Divide the conditions of type Ty that apply at the start of BB into groups that will be checked
+// by a single test-and-branch each. Integer-memory conditions on the same object share a group
+// (sorted by offset), and all string conditions share one; other conditions are tested alone.
+static void groupPathConditions(std::vector<PathCondition>& Conds, PathConditionTypes Ty, BasicBlock* BB, uint32_t stackIdx, std::vector<PathConditionGroup>& Groups) {
 
   matchesFromIdx Pred(BB, stackIdx);
-  return std::count_if(Conds.begin(), Conds.end(), Pred);
+  uint32_t firstGroup = Groups.size();
+
+  for(std::vector<PathCondition>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it) {
+
+    if(!Pred(*it))
+      continue;
+
+    PathConditionGroup* addTo = 0;
+
+    if(!NoMergePathConditions) {
+
+      if(Ty == PathConditionTypeString) {
+
+	if(Groups.size() != firstGroup)
+	  addTo = &Groups.back();
+
+      }
+      else if(Ty == PathConditionTypeIntmem && mergeableIntmemSize(*it)) {
+
+	for(uint32_t i = firstGroup, ilim = Groups.size(); i != ilim && !addTo; ++i) {
+
+	  PathCondition& GroupHead = *Groups[i].front();
+	  if(mergeableIntmemSize(GroupHead) && sameConditionObject(GroupHead, *it))
+	    addTo = &Groups[i];
+
+	}
+
+      }
+
+    }
+
+    if(!addTo) {
+      Groups.push_back(PathConditionGroup());
+      addTo = &Groups.back();
+    }
+
+    addTo->push_back(&*it);
+
+  }
+
+  if(Ty == PathConditionTypeIntmem) {
+
+    for(uint32_t i = firstGroup, ilim = Groups.size(); i != ilim; ++i)
+      std::stable_sort(Groups[i].begin(), Groups[i].end(), lowerOffset);
+
+  }
+
+}
+
+static uint32_t countPathConditionsIn(BasicBlock* BB, uint32_t stackIdx, std::vector<PathCondition>& Conds, PathConditionTypes Ty) {
+
+  std::vector<PathConditionGroup> Groups;
+  groupPathConditions(Conds, Ty, BB, stackIdx, Groups);
+  return Groups.size();
 
 }
 
@@ -587,9 +705,9 @@ static uint32_t countPathConditionsAtBlockStartIn(ShadowBBInvar* BB, uint32_t st
 
   BasicBlock* B = BB->BB;
 
-  uint32_t nPCs = countPathConditionsIn(B, stackIdx, PCs.IntPathConditions) +
-    countPathConditionsIn(B, stackIdx, PCs.StringPathConditions) +
-    countPathConditionsIn(B, stackIdx, PCs.IntmemPathConditions);
+  uint32_t nPCs = countPathConditionsIn(B, stackIdx, PCs.IntPathConditions, PathConditionTypeInt) +
+    countPathConditionsIn(B, stackIdx, PCs.StringPathConditions, PathConditionTypeString) +
+    countPathConditionsIn(B, stackIdx, PCs.IntmemPathConditions, PathConditionTypeIntmem);
 
   for(std::vector<PathFunc>::iterator it = PCs.FuncPathConditions.begin(),
 	itend = PCs.FuncPathConditions.end(); it != itend; ++it) {
@@ -603,7 +721,8 @@ static uint32_t countPathConditionsAtBlockStartIn(ShadowBBInvar* BB, uint32_t st
   
 }
 
-// Returns the number of path conditions that will be checked /before the start of BB/.
+// Returns the number of path condition tests that will be emitted /before the start of BB/,
+// each of which gets its own check block. Merged conditions (see groupPathConditions) count once.
 // This does not include conditions listed in AsDefIntPathConditions which are checked
 // as the instruction becomes defined (hence the name), in the midst of the block.
 uint32_t LLPEAnalysisPass::countPathConditionsAtBlockStart(ShadowBBInvar* BB, IntegrationAttempt* IA) {
@@ -657,41 +776,67 @@ ShadowValue IntegrationAttempt::getPathConditionSV(PathCondition& Cond) {
 
 }
 
-// Generate a check that verifies a user assumption, branching to unspecialised code if it fails.
-// emitBlockIt points to the CommittedBlock where the test code should be emitted. We should move it
-// to point at the next block as a side-effect.
-void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
+// Get a pointer to the memory tested by Cond, plus extra bytes. The result is an i8* if any offset
+// is applied, or otherwise has the type of the tested value.
+static Value* getPathConditionPtr(Value* testRoot, uint64_t offset, BasicBlock* emitBlock) {
 
-  if((stackIdx != UINT_MAX && stackIdx != Cond.fromStackIdx) || BB->invar->BB != Cond.fromBB)
-    return;
+  if(!offset)
+    return testRoot;
 
-  CommittedBlock& emitCB = *(emitBlockIt++);
-  BasicBlock* emitBlock = emitCB.specBlock;
+  LLVMContext& LLC = emitBlock->getContext();
+  Type* Int8Ptr = Type::getInt8PtrTy(LLC);
 
-  Instruction* resultInst = 0;
-  Value* testRoot = getCommittedValue(getPathConditionSV(Cond));
+  if(testRoot->getType() != Int8Ptr) {
+    release_assert(CastInst::isCastable(testRoot->getType(), Int8Ptr));
+    Instruction::CastOps Op = CastInst::getCastOpcode(testRoot, false, Int8Ptr, false);
+    testRoot = CastInst::Create(Op, testRoot, Int8Ptr, VerboseNames ? "testcast" : "", emitBlock);
+  }
 
-  LLVMContext& LLC = BB->invar->BB->getContext();
+  Value* offConst = ConstantInt::get(Type::getInt64Ty(LLC), offset);
+
+  return GetElementPtrInst::Create(testRoot, ArrayRef<Value*>(&offConst, 1), "", emitBlock);
+
+}
+
+// Emit a strcmp of runtime string Str against constant string Expected, returning a boolean
+// that is true if they are equal.
+Instruction* llvm::emitStringEqualityTest(Value* Str, Constant* Expected, BasicBlock* emitBlock) {
+
+  LLVMContext& LLC = emitBlock->getContext();
   Type* Int8Ptr = Type::getInt8PtrTy(LLC);
+  Type* IntTy = Type::getInt32Ty(LLC);
+  Type* StrcmpArgTys[2] = { Int8Ptr, Int8Ptr };
+  FunctionType* StrcmpType = FunctionType::get(IntTy, ArrayRef<Type*>(StrcmpArgTys, 2), false);
 
-  switch(Ty) {
+  Function* StrcmpFun = getGlobalModule()->getFunction("strcmp");
+  if(!StrcmpFun)
+    StrcmpFun = cast<Function>(getGlobalModule()->getOrInsertFunction("strcmp", StrcmpType));
+      
+  if(Str->getType() != Int8Ptr) {
+    Instruction::CastOps Op = CastInst::getCastOpcode(Str, false, Int8Ptr, false);
+    Str = CastInst::Create(Op, Str, Int8Ptr, VerboseNames ? "testcast" : "", emitBlock);
+  }
+      
+  Value* ExpectedCast = ConstantExpr::getBitCast(Expected, Int8Ptr);
+	
+  Value* StrcmpArgs[2] = { ExpectedCast, Str };
+  CallInst* CmpCall = CallInst::Create(StrcmpFun, ArrayRef<Value*>(StrcmpArgs, 2), VerboseNames ? "assume_test" : "", emitBlock);
+  CmpCall->setCallingConv(StrcmpFun->getCallingConv());
+  return new ICmpInst(*emitBlock, CmpInst::ICMP_EQ, CmpCall, Constant::getNullValue(CmpCall->getType()), "");
 
-  case PathConditionTypeIntmem:
-  case PathConditionTypeString:
+}
 
-    if(Cond.offset) {
+// Emit code testing Cond in isolation, returning a boolean indicating whether it holds.
+Instruction* IntegrationAttempt::emitPathConditionTest(PathCondition& Cond, PathConditionTypes Ty, BasicBlock* emitBlock) {
 
-      if(testRoot->getType() != Int8Ptr) {
-	release_assert(CastInst::isCastable(testRoot->getType(), Int8Ptr));
-	Instruction::CastOps Op = CastInst::getCastOpcode(testRoot, false, Int8Ptr, false);
-	testRoot = CastInst::Create(Op, testRoot, Int8Ptr, VerboseNames ? "testcast" : "", emitBlock);
-      }
+  Value* testRoot = getCommittedValue(getPathConditionSV(Cond));
 
-      Value* offConst = ConstantInt::get(Type::getInt64Ty(LLC), Cond.offset);
+  switch(Ty) {
 
-      testRoot = GetElementPtrInst::Create(testRoot, ArrayRef<Value*>(&offConst, 1), "", emitBlock);
+  case PathConditionTypeIntmem:
+  case PathConditionTypeString:
 
-    }
+    testRoot = getPathConditionPtr(testRoot, Cond.offset, emitBlock);
 
   default:
     break;
@@ -716,45 +861,135 @@ void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditi
     if(testRoot->getType() != Cond.u.val->getType())
       testRoot = new SExtInst(testRoot, Cond.u.val->getType(), "", emitBlock);
 
-    resultInst = emitCompositeCheck(testRoot, Cond.u.val, emitBlock);
-    break;
+    return emitCompositeCheck(testRoot, Cond.u.val, emitBlock);
 
   case PathConditionTypeString:
 
-    {
+    return emitStringEqualityTest(testRoot, Cond.u.val, emitBlock);
 
-      Type* IntTy = Type::getInt32Ty(LLC);
-      Type* StrcmpArgTys[2] = { Int8Ptr, Int8Ptr };
-      FunctionType* StrcmpType = FunctionType::get(IntTy, ArrayRef<Type*>(StrcmpArgTys, 2), false);
+  default:
+    
+    release_assert(0 && "Bad path condition type");
+    llvm_unreachable("Bad path condition type");
 
-      Function* StrcmpFun = getGlobalModule()->getFunction("strcmp");
-      if(!StrcmpFun)
-	StrcmpFun = cast<Function>(getGlobalModule()->getOrInsertFunction("strcmp", StrcmpType));
-      
-      if(testRoot->getType() != Int8Ptr) {
-	Instruction::CastOps Op = CastInst::getCastOpcode(testRoot, false, Int8Ptr, false);
-	testRoot = CastInst::Create(Op, testRoot, Int8Ptr, VerboseNames ? "testcast" : "", emitBlock);
+  }
+
+}
+
+// Emit a single test for a run of integer-memory conditions covering contiguous bytes of the same object:
+// one wide load and compare for runs of up to 8 bytes, or a memcmp against a constant global otherwise.
+Instruction* IntegrationAttempt::emitIntmemRunTest(PathCondition** begin, PathCondition** end, BasicBlock* emitBlock) {
+
+  if(end - begin == 1)
+    return emitPathConditionTest(**begin, PathConditionTypeIntmem, emitBlock);
+
+  LLVMContext& LLC = emitBlock->getContext();
+  Type* Int8Ptr = Type::getInt8PtrTy(LLC);
+  Type* Int32 = Type::getInt32Ty(LLC);
+  Type* Int64 = Type::getInt64Ty(LLC);
+
+  // Gather the expected bytes in memory order.
+  SmallVector<uint8_t, 16> bytes;
+  for(PathCondition** it = begin; it != end; ++it) {
+
+    const APInt& val = cast<ConstantInt>((*it)->u.val)->getValue();
+    uint64_t size = mergeableIntmemSize(**it);
+    for(uint64_t i = 0; i != size; ++i) {
+      uint64_t shift = GlobalTD->isLittleEndian() ? i : (size - i) - 1;
+      bytes.push_back((uint8_t)val.lshr(shift * 8).getLoBits(8).getZExtValue());
+    }
+
+  }
+
+  Value* testPtr = getPathConditionPtr(getCommittedValue(getPathConditionSV(**begin)), (*begin)->offset, emitBlock);
+  uint64_t nBytes = bytes.size();
+
+  if(nBytes == 2 || nBytes == 4 || nBytes == 8) {
+
+    APInt expected(nBytes * 8, 0);
+    for(uint64_t i = 0; i != nBytes; ++i) {
+      uint64_t shift = GlobalTD->isLittleEndian() ? i : (nBytes - i) - 1;
+      expected |= APInt(nBytes * 8, bytes[i]).shl(shift * 8);
+    }
+
+    Type* WideTy = Type::getIntNTy(LLC, nBytes * 8);
+    Type* WidePtrTy = PointerType::getUnqual(WideTy);
+    if(testPtr->getType() != WidePtrTy)
+      testPtr = new BitCastInst(testPtr, WidePtrTy, "", emitBlock);
+
+    // The conditions may not be naturally aligned for the wider type.
+    Value* Loaded = new LoadInst(testPtr, "", false, 1, emitBlock);
+    return new ICmpInst(*emitBlock, CmpInst::ICMP_EQ, Loaded, ConstantInt::get(LLC, expected), VerboseNames ? "check" : "");
+
+  }
+
+  std::vector<Constant*> constBytes;
+  for(uint64_t i = 0; i != nBytes; ++i)
+    constBytes.push_back(ConstantInt::get(Type::getInt8Ty(LLC), bytes[i]));
+
+  ArrayType* ArrType = ArrayType::get(Type::getInt8Ty(LLC), nBytes);
+  Constant* ByteArray = ConstantArray::get(ArrType, constBytes);
+  Constant* ExpectedGV = new GlobalVariable(*getGlobalModule(), ArrType, true, GlobalValue::InternalLinkage, ByteArray, "");
+  ExpectedGV = ConstantExpr::getBitCast(ExpectedGV, Int8Ptr);
+
+  if(testPtr->getType() != Int8Ptr)
+    testPtr = new BitCastInst(testPtr, Int8Ptr, VerboseNames ? "testcast" : "", emitBlock);
+
+  Constant* MemcmpFun = getGlobalModule()->getOrInsertFunction("memcmp", Int32, Int8Ptr, Int8Ptr, Int64, (Type*)0);
+  Value* MemcmpArgs[3] = { testPtr, ExpectedGV, ConstantInt::get(Int64, nBytes) };
+  CallInst* CmpCall = CallInst::Create(MemcmpFun, ArrayRef<Value*>(MemcmpArgs, 3), VerboseNames ? "assume_test" : "", emitBlock);
+  return new ICmpInst(*emitBlock, CmpInst::ICMP_EQ, CmpCall, Constant::getNullValue(Int32), "");
+
+}
+
+// Generate a check that verifies a group of user assumptions, branching to unspecialised code if any fails.
+// emitBlockIt points to the CommittedBlock where the test code should be emitted. We should move it
+// to point at the next block as a side-effect.
+void IntegrationAttempt::emitPathConditionCheck(PathConditionGroup& Group, PathConditionTypes Ty, ShadowBB* BB, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
+
+  CommittedBlock& emitCB = *(emitBlockIt++);
+  BasicBlock* emitBlock = emitCB.specBlock;
+
+  Instruction* resultInst = 0;
+
+  if(Ty == PathConditionTypeIntmem) {
+
+    // Conditions are sorted by offset; test each run of contiguous, mergeable conditions at once.
+    for(PathCondition** runStart = Group.begin(), **groupEnd = Group.end(); runStart != groupEnd;) {
+
+      PathCondition** runEnd = runStart + 1;
+      uint64_t nextOffset = (*runStart)->offset + mergeableIntmemSize(**runStart);
+      while(runEnd != groupEnd && mergeableIntmemSize(**runStart) && (*runEnd)->offset == nextOffset) {
+	nextOffset += mergeableIntmemSize(**runEnd);
+	++runEnd;
       }
-      
-      Value* CondCast = ConstantExpr::getBitCast(Cond.u.val, Int8Ptr);
-	
-      Value* StrcmpArgs[2] = { CondCast, testRoot };
-      CallInst* CmpCall = CallInst::Create(StrcmpFun, ArrayRef<Value*>(StrcmpArgs, 2), VerboseNames ? "assume_test" : "", emitBlock);
-      CmpCall->setCallingConv(StrcmpFun->getCallingConv());
-      resultInst = new ICmpInst(*emitBlock, CmpInst::ICMP_EQ, CmpCall, Constant::getNullValue(CmpCall->getType()), "");
 
-      break;
+      Instruction* runResult = emitIntmemRunTest(runStart, runEnd, emitBlock);
+      if(resultInst)
+	resultInst = BinaryOperator::CreateAnd(resultInst, runResult, "", emitBlock);
+      else
+	resultInst = runResult;
+
+      runStart = runEnd;
 
     }
 
-  default:
-    
-    release_assert(0 && "Bad path condition type");
-    llvm_unreachable("Bad path condition type");
+  }
+  else {
+
+    for(PathConditionGroup::iterator it = Group.begin(), itend = Group.end(); it != itend; ++it) {
+
+      Instruction* condResult = emitPathConditionTest(**it, Ty, emitBlock);
+      if(resultInst)
+	resultInst = BinaryOperator::CreateAnd(resultInst, condResult, "", emitBlock);
+      else
+	resultInst = condResult;
+
+    }
 
   }
 
-  // resultInst is a boolean indicating if the path condition matched.
+  // resultInst is a boolean indicating if the path conditions matched.
   // Branch to the next specialised block on pass, or the first non-specialised block otherwise.
 
   // If breakBlock != specBlock then we should emit a diagnostic message that is printed when breaking
@@ -768,7 +1003,11 @@ void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditi
     {
       raw_string_ostream RSO(msg);
       RSO << "Failed path condition ";
-      printPathCondition(Cond, Ty, BB, RSO, /* HTML escaped = */ false);
+      for(PathConditionGroup::iterator it = Group.begin(), itend = Group.end(); it != itend; ++it) {
+	if(it != Group.begin())
+	  RSO << " or ";
+	printPathCondition(**it, Ty, BB, RSO, /* HTML escaped = */ false);
+      }
       RSO << " in block " << BB->invar->BB->getName() << " / " << BB->IA->SeqNumber << "\n";
     }
 
@@ -787,8 +1026,11 @@ void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditi
 
 void IntegrationAttempt::emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
 
-  for(std::vector<PathCondition>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it)
-    emitPathConditionCheck(*it, Ty, BB, stackIdx, emitBlockIt);
+  std::vector<PathConditionGroup> Groups;
+  groupPathConditions(Conds, Ty, BB->invar->BB, stackIdx, Groups);
+
+  for(std::vector<PathConditionGroup>::iterator it = Groups.begin(), itend = Groups.end(); it != itend; ++it)
+    emitPathConditionCheck(*it, Ty, BB, emitBlockIt);
 
 }
 
@@ -2108,7 +2350,7 @@ void IntegrationAttempt::commitSimpleFailedBlock(uint32_t i) { }
 
 void InlineAttempt::commitSimpleFailedBlock(uint32_t i) {
 
-  if(failedBlocks.empty() || failedBlocks[i].empty())
+  if(failedBlocks.empty() || failedBlocks[i].empty() || usingSharedFallback)
     return;
 
   release_assert(failedBlocks[i].size() == 1 && "commitSimpleFailedBlock with a split block?");
@@ -2230,11 +2472,64 @@ BasicBlock* IntegrationAttempt::CloneBasicBlockFrom(const BasicBlock* BB,
 // or adjust the top-of-block PHI yet.
 void IntegrationAttempt::createFailedBlock(uint32_t idx) {}
 
+// Create the block all failing checks branch to when using a shared fallback (see canUseSharedFallback):
+// it calls the original function and returns its result, flagged as having left specialised code.
+void InlineAttempt::createSharedFallbackBlock() {
+
+  std::string Name;
+  if(VerboseNames)
+    Name = getCommittedBlockPrefix() + "fallback";
+  BasicBlock* FallbackBB = createBasicBlock(F.getContext(), Name, CommitF, false, true);
+
+  std::vector<Value*> Args;
+  for(Function::arg_iterator it = CommitF->arg_begin(), itend = CommitF->arg_end(); it != itend; ++it)
+    Args.push_back(it);
+
+  CallInst* FallbackCall = CallInst::Create(&F, Args, "", FallbackBB);
+  FallbackCall->setCallingConv(F.getCallingConv());
+  FallbackCall->setAttributes(F.getAttributes());
+
+  Type* RetTy = F.getFunctionType()->getReturnType();
+  Value* Ret;
+
+  if(CommitF->getFunctionType()->getReturnType() == RetTy) {
+
+    // No failed return flag: the original function cannot return from unspecialised code.
+    Ret = RetTy->isVoidTy() ? 0 : FallbackCall;
+
+  }
+  else {
+
+    Value* FailFlag = ConstantInt::getFalse(F.getContext());
+
+    if(RetTy->isVoidTy())
+      Ret = FailFlag;
+    else {
+
+      StructType* retType = cast<StructType>(CommitF->getFunctionType()->getReturnType());
+      Constant* aggTemplate = ConstantStruct::get(retType, UndefValue::get(RetTy), FailFlag, NULL);
+      Ret = InsertValueInst::Create(aggTemplate, FallbackCall, 0, VerboseNames ? "fail_ret" : "", FallbackBB);
+
+    }
+
+  }
+
+  ReturnInst::Create(F.getContext(), Ret, FallbackBB);
+  failedBlocks[0].push_back(std::make_pair(FallbackBB, 0));
+
+}
+
 void InlineAttempt::createFailedBlock(uint32_t idx) {
 
   if(!blocksReachableOnFailure)
     return;
 
+  if(usingSharedFallback) {
+    if(idx == 0)
+      createSharedFallbackBlock();
+    return;
+  }
+
   SmallDenseMap<uint32_t, uint32_t, 8>::iterator it = blocksReachableOnFailure->find(idx);
   if(it == blocksReachableOnFailure->end())
     return;
@@ -2505,7 +2800,7 @@ void IntegrationAttempt::populateFailedBlock(uint32_t idx) { }
 
 void InlineAttempt::populateFailedBlock(uint32_t idx) {
   
-  if(failedBlocks.empty() || failedBlocks[idx].empty())
+  if(failedBlocks.empty() || failedBlocks[idx].empty() || usingSharedFallback)
     return;
 
   ShadowBBInvar* BBI = getBBInvar(idx);
@@ -106,15 +106,8 @@ bool PeelIteration::stackIncludesCallTo(Function* FCalled) {
 
 bool InlineAttempt::stackIncludesCallTo(Function* FCalled) {
 
-  if((&F) == FCalled)
-    return true;
-  else if(Callers.empty())
-    return false;
-  
-  IntegrationAttempt* Parent = getUniqueParent();
-  release_assert(Parent && "Call to stackIncludesCallTo whilst shared?");
-  
-  return Parent->stackIncludesCallTo(FCalled);
+  release_assert((Callers.empty() || getUniqueParent()) && "Call to stackIncludesCallTo whilst shared?");
+  return stackFunctions.contains(FCalled);
 
 }
 
@@ -319,6 +312,7 @@ PeelIteration* PeelAttempt::getOrCreateIteration(unsigned iter) {
 
   PeelIteration* NewIter = new PeelIteration(pass, parent, this, F, iter, nesting_depth);
   Iterations.push_back(NewIter);
+  ++pass->livePeelIterations;
     
   return NewIter;
 
@@ -389,6 +383,16 @@ PeelIteration* PeelIteration::getOrCreateNextIteration() {
       
   }
 
+  // Out of budget? Stop here; the loop will be treated as not terminating and so get a
+  // general loop body analysis, and our caller will throw away the iterations made so far.
+  if(pass->peelBudgetExceeded(&F, getBBInvar(parentPA->L->headerIdx)->BB, this->iterationCount + 1)) {
+
+    LPDEBUG("Peeling budget exhausted for loop " << getLName() << "\n");
+    parentPA->overBudget = true;
+    return 0;
+
+  }
+
   iterStatus = IterationStatusNonFinal;
   LPDEBUG("Loop known to iterate: creating next iteration\n");
   return parentPA->getOrCreateIteration(this->iterationCount + 1);
@@ -437,6 +441,20 @@ PeelAttempt* IntegrationAttempt::getOrCreatePeelAttempt(const ShadowLoopInvar* N
 
 }
 
+// Throw away a loop specialisation that we gave up on, along with all its iterations and their children,
+// as if we had never tried to peel the loop. The caller will analyse the general loop body instead.
+void IntegrationAttempt::discardPeelAttempt(PeelAttempt* LPA) {
+
+  LPDEBUG("Discarding " << LPA->Iterations.size() << " peeled iterations of loop " << LPA->getLName() << "\n");
+
+  for(uint32_t i = 0, ilim = LPA->Iterations.size(); i != ilim; ++i)
+    LPA->Iterations[i]->discardUncommitted();
+
+  peelChildren.erase(LPA->L);
+  delete LPA;
+
+}
+
 // Functions that drop store references that were retained so that loop fixed points could be
 // found. Exiting edges keep references in case this is the last iteration; the latch edge
 // keeps a reference in case we have to iterate again; when it becomes clear which is the case
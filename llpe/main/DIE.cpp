@@ -334,8 +334,11 @@ void PeelIteration::visitVariant(ShadowInstructionInvar* VI, DIVisitor& Visitor)
 // exploring nested loops recursively.
 void PeelAttempt::visitVariant(ShadowInstructionInvar* VI, DIVisitor& Visitor) {
 
-  if(!isTerminated())
+  if(!isTerminated()) {
     Visitor.notifyUsersMissed();
+    if(!Visitor.shouldContinue())
+      return;
+  }
 
   // Is this a header PHI? If so, this definition-from-outside can only matter for the preheader edge.
   if(VI->parent->naturalScope == L && VI->parent->idx == L->headerIdx && isa<PHINode>(VI->I)) {
@@ -345,7 +348,8 @@ void PeelAttempt::visitVariant(ShadowInstructionInvar* VI, DIVisitor& Visitor) {
 
   }
 
-  for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), itend = Iterations.end(); it != itend; ++it) {
+  for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), itend = Iterations.end(); 
+      it != itend && Visitor.shouldContinue(); ++it) {
 
     if(VI->parent->outerScope == L) {
       Visitor.visit((*it)->getInst(VI), *it, VI->parent->idx, VI->idx);
@@ -669,6 +673,157 @@ bool IntegrationAttempt::valueIsDead(ShadowValue V) {
 
 }
 
+// The sweep below visits contexts in reverse topological order, so ordinarily every user
+// of a value has had its dieStatus settled by the time the value itself is examined, and each
+// value is examined exactly once. The exception is a shared context: it is swept when we meet
+// its first caller, at which point its other callers are still presumed alive, so its return
+// values (and transitively their operands) may die later on. Rather than re-sweep the whole
+// context per caller, we queue the values whose users have since died and re-examine only those.
+// Users reached around an unpeeled loop's backedge are not revisited, so values kept alive only
+// by them stay alive.
+
+// V was just found dead: queue any values that might now be dead in turn.
+static void queueDIEOperands(ShadowValue V) {
+
+  if(ShadowArg* SA = V.getArg()) {
+
+    // Callers' argument operands may only have been alive due to this argument.
+    uint32_t argNo = SA->invar->A->getArgNo();
+    InlineAttempt* IA = SA->IA;
+    for(SmallVector<ShadowInstruction*, 1>::iterator it = IA->Callers.begin(),
+	  itend = IA->Callers.end(); it != itend; ++it) {
+
+      if(argNo >= (*it)->getNumArgOperands())
+	continue;
+
+      ShadowValue Op = (*it)->getCallArgOperand(argNo);
+      if(Op.isInst() || Op.isArg())
+	GlobalIHP->DIEWorklist.push_back(Op);
+
+    }
+
+    return;
+
+  }
+
+  ShadowInstruction* SI = V.getInst();
+
+  if(inst_is<CallInst>(SI) || inst_is<InvokeInst>(SI)) {
+
+    // A call's arguments' liveness depends on the callee's formal arguments, not the call,
+    // but its callee's return values may now be unused.
+    if(InlineAttempt* IA = SI->parent->IA->getInlineAttempt(SI))
+      IA->queueDIEReturns();
+    return;
+
+  }
+
+  for(uint32_t i = 0, ilim = SI->getNumOperands(); i != ilim; ++i) {
+
+    ShadowValue Op = SI->getOperand(i);
+    if(Op.isInst() || Op.isArg())
+      GlobalIHP->DIEWorklist.push_back(Op);
+
+  }
+
+}
+
+// Re-examine queued values, queueing in turn the operands of any we kill.
+// Values belonging to contexts not swept in this run are left for their own run.
+static void drainDIEWorklist() {
+
+  std::vector<ShadowValue>& DIEWorklist = GlobalIHP->DIEWorklist;
+
+  while(!DIEWorklist.empty()) {
+
+    ShadowValue V = DIEWorklist.back();
+    DIEWorklist.pop_back();
+
+    IntegrationAttempt* Ctx = V.getCtx();
+    InlineAttempt* Root = Ctx->getFunctionRoot();
+    if(Root->DIEGeneration != GlobalIHP->DIEGeneration || Root->isCommitted())
+      continue;
+
+    bool killed;
+    if(ShadowInstruction* SI = V.getInst())
+      killed = Ctx->tryKillInst(SI);
+    else
+      killed = Root->tryKillArg(V.getArg());
+
+    if(killed)
+      queueDIEOperands(V);
+
+  }
+
+}
+
+// Our callers may all be dead now; if so queue our return instructions.
+void InlineAttempt::queueDIEReturns() {
+
+  if(DIEGeneration != pass->DIEGeneration || isCommitted() || !isOwnCallUnused())
+    return;
+
+  for(uint32_t i = 0; i < nBBs; ++i) {
+
+    ShadowBB* BB = BBs[i];
+    if(!BB || BB->insts.empty())
+      continue;
+
+    ShadowInstruction* Term = &(BB->insts.back());
+    if(inst_is<ReturnInst>(Term))
+      pass->DIEWorklist.push_back(ShadowValue(Term));
+
+  }
+
+}
+
+// Entry point: sweep this context and its children, then settle anything queued meanwhile.
+void InlineAttempt::runDIEFromRoot() {
+
+  ++pass->DIEGeneration;
+  runDIE();
+  drainDIEWorklist();
+
+}
+
+// Tag SI dead if it is a candidate for elimination and has no live users. Returns true if newly killed.
+bool IntegrationAttempt::tryKillInst(ShadowInstruction* SI) {
+
+  if(!shouldDIE(SI))
+    return false;
+
+  if(willBeDeleted(ShadowValue(SI)))
+    return false;
+
+  if((!inst_is<CallInst>(SI)) && (!inst_is<InvokeInst>(SI)) && SI->invar->I->mayHaveSideEffects())
+    return false;
+
+  if(!valueIsDead(ShadowValue(SI)))
+    return false;
+
+  SI->dieStatus |= INSTSTATUS_DEAD;
+  return true;
+
+}
+
+// As above, for formal arguments.
+bool InlineAttempt::tryKillArg(ShadowArg* SA) {
+
+  // Don't eliminate the root function's arguments
+  if(Callers.empty())
+    return false;
+
+  if(willBeReplacedWithConstantOrDeleted(ShadowValue(SA)))
+    return false;
+
+  if(!valueIsDead(ShadowValue(SA)))
+    return false;
+
+  SA->dieStatus |= INSTSTATUS_DEAD;
+  return true;
+
+}
+
 // Try to kill all instructions in this context, and if appropriate, arguments.
 // Everything should be killed in reverse topological order.
 void InlineAttempt::runDIE() {
@@ -676,24 +831,17 @@ void InlineAttempt::runDIE() {
   if(isCommitted())
     return;
 
+  // Already swept this run (we're shared, and this is a later caller)?
+  if(DIEGeneration == pass->DIEGeneration)
+    return;
+  DIEGeneration = pass->DIEGeneration;
+
   // First try to kill our instructions:
   IntegrationAttempt::runDIE();
-
-  // Don't eliminate 
-  if(Callers.empty())
-    return;
   
   // And then our formal arguments:
-  for(uint32_t i = 0; i < F.arg_size(); ++i) {
-    ShadowArg* SA = &(argShadows[i]);
-    if(willBeReplacedWithConstantOrDeleted(ShadowValue(SA)))
-      continue;
-    if(Callers.empty() && SA->invar->A->hasNoAliasAttr())
-      continue;
-    if(valueIsDead(ShadowValue(SA))) {
-      SA->dieStatus |= INSTSTATUS_DEAD;
-    }
-  }
+  for(uint32_t i = 0; i < F.arg_size(); ++i)
+    tryKillArg(&(argShadows[i]));
 
 }
 
@@ -733,33 +881,22 @@ void IntegrationAttempt::runDIE() {
 
       ShadowInstruction* SI = &(BB->insts[j-1]);
 
-      if(!shouldDIE(SI))
-	continue;
-
-      bool delOrConst = willBeDeleted(ShadowValue(SI));
+      bool killed = tryKillInst(SI);
 
-      if(inst_is<CallInst>(SI) || inst_is<InvokeInst>(SI)) {
+      if(InlineAttempt* IA = getInlineAttempt(SI)) {
 
-	if((!delOrConst) && valueIsDead(ShadowValue(SI)))
-	  SI->dieStatus |= INSTSTATUS_DEAD; 
-
-	if(InlineAttempt* IA = getInlineAttempt(SI)) {
+	if(IA->DIEGeneration != pass->DIEGeneration) {
 
 	  IA->runDIE();
 
 	}
+	else if(killed) {
 
-      }
-      else {
-
-	if(delOrConst)
-	  continue;
-
-	if(SI->invar->I->mayHaveSideEffects())
-	  continue;
+	  // Shared callee already swept: only its return values can have changed.
+	  IA->queueDIEReturns();
+	  drainDIEWorklist();
 
-	if(valueIsDead(ShadowValue(SI)))
-	  SI->dieStatus |= INSTSTATUS_DEAD;
+	}
 
       }
 
@@ -63,7 +63,7 @@ TrackedStore::TrackedStore(ShadowInstruction* _I, uint64_t ob) : I(_I), isCommit
 
 TrackedStore::~TrackedStore() {
 
-  if(!isCommitted)
+  if((!isCommitted) && I)
     GlobalIHP->trackedStores.erase(I);
 
   // Just deletes the array, not the instructions
@@ -152,8 +152,10 @@ void llvm::DeleteDeadInstruction(Instruction *I) {
 // Tag an instruction dead, or if already synthesised, delete the emitted instructions.
 void TrackedStore::kill() {
 
-  if(!isCommitted)
-    DSEInstructionDead(I);
+  if(!isCommitted) {
+    if(I)
+      DSEInstructionDead(I);
+  }
   else {
     release_assert(committedInsts && "Should have a committed instructions");
     for(uint32_t i = 0, ilim = nCommittedInsts; i != ilim; ++i) {
@@ -189,6 +191,16 @@ void TrackedStore::derefBytes(uint64_t nBytes) {
 
 }
 
+// The store's context is being thrown away uncommitted. DSE maps may still hold
+// references, so keep the record alive until they drop it, but forget the instruction.
+void TrackedStore::discard() {
+
+  release_assert(!isCommitted);
+  GlobalIHP->trackedStores.erase(I);
+  I = 0;
+
+}
+
 static DSEMapTy::Allocator DSEMapAllocator;
 static DSEMapTy DSEEmptyMap(DSEMapAllocator);
 DSEMapPointer llvm::DSEEmptyMapPtr(&DSEEmptyMap, 0);
@@ -210,11 +222,20 @@ TrackedAlloc::TrackedAlloc(ShadowInstruction* _SI) : SI(_SI), isCommitted(false)
 
 TrackedAlloc::~TrackedAlloc() {
 
-  if(!isCommitted)
+  if((!isCommitted) && SI)
     GlobalIHP->trackedAllocs.erase(SI);
 
 }
 
+// As TrackedStore::discard.
+void TrackedAlloc::discard() {
+
+  release_assert(!isCommitted);
+  GlobalIHP->trackedAllocs.erase(SI);
+  SI = 0;
+
+}
+
 
 bool TrackedAlloc::dropReference() {
 
@@ -224,7 +245,7 @@ bool TrackedAlloc::dropReference() {
 
     ret = true;
     
-    if((!isNeeded) && (!isCommitted))
+    if((!isNeeded) && (!isCommitted) && SI)
       DSEInstructionDead(SI);
 
     delete this;
@@ -930,7 +951,8 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 	if(findit->second == SF_FREE) {
 
 	  // Release the map and a tracked alloc reference for this location:
-	  ShadowValue PtrOp = I->getCallArgOperand(0);
+	  DeallocatorFn& De = pass->deallocatorFunctions[F];
+	  ShadowValue PtrOp = I->getCallArgOperand(De.arg);
 	  ShadowValue Ptr;
 	  int64_t Offset;
 	  if(!getBaseAndConstantOffset(PtrOp, Ptr, Offset))
@@ -939,6 +961,24 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 	  if(Ptr.isNullPointer())
 	    return;
 
+	  if(De.resetsArena) {
+
+	    // Arena reset: release every object allocated from it instead.
+	    DenseMap<ShadowValue, std::vector<uint32_t> >::iterator arenait = pass->arenaObjects.find(Ptr);
+	    if(arenait == pass->arenaObjects.end())
+	      return;
+
+	    for(std::vector<uint32_t>::iterator it = arenait->second.begin(),
+		  itend = arenait->second.end(); it != itend; ++it) {
+
+	      BB->getWritableDSEStore(ShadowValue::getPtrIdx(-1, *it))->release();
+
+	    }
+
+	    return;
+
+	  }
+
 	  DSEMapPointer* store = BB->getWritableDSEStore(Ptr);
 
 	  store->release();
@@ -1068,10 +1108,30 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 
 }
 
+// Reaching a path condition check, unspecialised code might use any value in memory.
+static void DSEWalkPathConditions(ShadowBB* BB) {
+
+  if((!GlobalIHP->omitChecks) && GlobalIHP->countPathConditionsAtBlockStart(BB->invar, BB->IA)) {
+
+    setAllNeededTop(BB->dseStore);
+    BB->dseStore = BB->dseStore->getEmptyMap();
+
+  }
+
+}
+
 // Try to kill all stores in this context. Generally DSE processes an instruction at a time,
 // but this recursive-descent path is used when analysing unbounded loops and recursion.
 void InlineAttempt::tryKillStores(bool commitDisabledHere, bool disableWrites) {
 
+  initDSEEntryStore();
+  tryKillStoresInLoop(0, commitDisabledHere, disableWrites);
+
+}
+
+// Prepare the entry block's DSE store, which the caller has passed in.
+void InlineAttempt::initDSEEntryStore() {
+
   if(isRootMainCall())
     BBs[0]->dseStore = new DSELocalStore(0);
 
@@ -1080,8 +1140,6 @@ void InlineAttempt::tryKillStores(bool commitDisabledHere, bool disableWrites) {
     BBs[0]->dseStore->pushStackFrame(this);
   }
 
-  tryKillStoresInLoop(0, commitDisabledHere, disableWrites);
-
 }
 
 void IntegrationAttempt::tryKillStoresInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool disableWrites) {
@@ -1169,13 +1227,7 @@ void IntegrationAttempt::tryKillStoresInLoop(const ShadowLoopInvar* L, bool comm
 
     }
 
-    if((!pass->omitChecks) && pass->countPathConditionsAtBlockStart(BB->invar, BB->IA)) {
-      
-      // Reaches a path condition check, where unspecialised code might use this value.
-      setAllNeededTop(BB->dseStore);
-      BB->dseStore = BB->dseStore->getEmptyMap();
-      
-    }
+    DSEWalkPathConditions(BB);
 
     bool brokeOnUnreachableCall = false;
 
@@ -1196,46 +1248,235 @@ void IntegrationAttempt::tryKillStoresInLoop(const ShadowLoopInvar* L, bool comm
 
     }
 
-    // Give a store copy to each successor block that needs it. If latchToHeader is true,
-    // ignore branches to outside the current loop; otherwise ignore any latch->header edge.
+    DSEPassStoreToSuccessors(BB, L, latchToHeader);
 
-    for(uint32_t i = 0; i < BB->invar->succIdxs.size(); ++i) {
+  }
 
-      if(!BB->succsAlive[i])
-	continue;
+}
+
+// Give a store copy to each successor block that needs it. If latchToHeader is true,
+// ignore branches to outside the current loop; otherwise ignore any latch->header edge.
+void IntegrationAttempt::DSEPassStoreToSuccessors(ShadowBB* BB, const ShadowLoopInvar* L, bool latchToHeader) {
+
+  for(uint32_t i = 0; i < BB->invar->succIdxs.size(); ++i) {
+
+    if(!BB->succsAlive[i])
+      continue;
       
-      ShadowBBInvar* SuccBBI = getBBInvar(BB->invar->succIdxs[i]);
-      if(L) {
+    ShadowBBInvar* SuccBBI = getBBInvar(BB->invar->succIdxs[i]);
+    if(L) {
+
+      if(L != this->L && latchToHeader && !L->contains(SuccBBI->naturalScope))
+	continue;
+      else if(L != this->L && (!latchToHeader) && SuccBBI->idx == L->headerIdx) {
+	release_assert(BB->invar->idx == L->latchIdx);
+	continue;
+      }
+
+    }
+
+    // Create a store reference for each live successor
+    ++BB->dseStore->refCount;
+
+  }
+
+  // Drop stack allocations here.
+
+  if(BB->invar->succIdxs.size() == 0) {
+
+    if(invarInfo->frameSize != -1) {
+      BB->dseStore = BB->dseStore->getWritableFrameList();
+      BB->dseStore->popStackFrame();
+    }
+
+  }
+
+  // Drop the reference belonging to this block.
+
+  if(!isa<ReturnInst>(BB->invar->BB->getTerminator()))
+    SAFE_DROP_REF(BB->dseStore);
+
+}
+
+// The tentative-loads and DSE passes over an unbounded loop or recursive function walk the same
+// context tree in the same order, so where possible do both in a single walk, keeping the two
+// block-local stores side by side. DSE consults each load's final check status, so only walks
+// that follow the last TL pass over an instruction can be shared.
+
+void InlineAttempt::findTentativeLoadsAndKillStores(bool commitDisabledHere, bool secondPass) {
+
+  initTLEntryStore();
+  initDSEEntryStore();
+  findTentativeLoadsAndKillStoresInLoop(0, commitDisabledHere, secondPass, false, false, false);
+
+}
+
+// Equivalent to findTentativeLoadsInUnboundedLoop followed by tryKillStoresInUnboundedLoop.
+void IntegrationAttempt::findTentativeLoadsAndKillStoresInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool secondPass, bool disableWrites) {
+
+  ShadowBB* BB = getBB(UL->headerIdx);
+
+  // Give header its stores:
+  BB->tlStore = getBB(UL->preheaderIdx)->tlStore;
+  BB->dseStore = getBB(UL->preheaderIdx)->dseStore;
+
+  if(edgeIsDead(getBBInvar(UL->latchIdx), getBBInvar(UL->headerIdx))) {
+
+    // One pass of each will do.
+    findTentativeLoadsAndKillStoresInLoop(UL, commitDisabledHere, secondPass, false, disableWrites, false);
+    return;
+
+  }
+
+  // The TL latch-to-header pass must be complete before DSE sees any of the loop.
+  if(!secondPass) {
+    findTentativeLoadsInLoop(UL, commitDisabledHere, false, true);
+    BB->tlStore = getBB(UL->latchIdx)->tlStore;
+  }
+
+  if(disableWrites) {
+
+    findTentativeLoadsAndKillStoresInLoop(UL, commitDisabledHere, true, false, true, false);
+
+  }
+  else {
+
+    // Final TL pass alongside DSE's latch-to-header pass, then DSE alone marks writers
+    // needed if the loop iterates (see tryKillStoresInUnboundedLoop).
+    findTentativeLoadsAndKillStoresInLoop(UL, commitDisabledHere, true, false, false, true);
+    BB->dseStore = getBB(UL->latchIdx)->dseStore;
+    tryKillStoresInLoop(UL, commitDisabledHere, /*disableWrites=*/true, /*latchToHeader=*/false);
+
+  }
+
+}
+
+// Walk loop L performing findTentativeLoadsInLoop(L, commitDisabledHere, secondPass, TLLatchToHeader)
+// and tryKillStoresInLoop(L, commitDisabledHere, disableWrites, DSELatchToHeader) together.
+void IntegrationAttempt::findTentativeLoadsAndKillStoresInLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool secondPass, bool TLLatchToHeader, bool disableWrites, bool DSELatchToHeader) {
+
+  DSEProgress();
+
+  uint32_t startIdx;
+  if(L)
+    startIdx = L->headerIdx;
+  else
+    startIdx = 0;
+
+  for(uint32_t i = startIdx, ilim = nBBs + BBsOffset; i != ilim && ((!L) || L->contains(getBBInvar(i)->naturalScope)); ++i) {
+
+    ShadowBB* BB = getBB(i);
+    if(!BB)
+      continue;
+
+    if(BB->invar->naturalScope != L) {
+
+      const ShadowLoopInvar* NewLInfo = BB->invar->naturalScope;
+
+      PeelAttempt* LPA;
+      if((LPA = getPeelAttempt(BB->invar->naturalScope)) && LPA->isTerminated()) {
+
+	ShadowBB* PreheaderBB = getBB(NewLInfo->preheaderIdx);
+	LPA->Iterations[0]->BBs[0]->tlStore = PreheaderBB->tlStore;
+	LPA->Iterations[0]->BBs[0]->dseStore = PreheaderBB->dseStore;
+	bool commitDisabled = commitDisabledHere || !LPA->isEnabled();
+	uint32_t latchIdx = NewLInfo->latchIdx;
+
+	for(uint32_t j = 0, jlim = LPA->Iterations.size(); j != jlim; ++j) {
+
+	  LPA->Iterations[j]->findTentativeLoadsAndKillStoresInLoop(BB->invar->naturalScope, commitDisabled, secondPass, false, disableWrites, false);
+	  if(j + 1 != jlim) {
+	    ShadowBB* LatchBB = LPA->Iterations[j]->getBB(latchIdx);
+	    LPA->Iterations[j + 1]->BBs[0]->tlStore = LatchBB->tlStore;
+	    LPA->Iterations[j + 1]->BBs[0]->dseStore = LatchBB->dseStore;
+	  }
 
-	if(L != this->L && latchToHeader && !L->contains(SuccBBI->naturalScope))
-	  continue;
-	else if(L != this->L && (!latchToHeader) && SuccBBI->idx == L->headerIdx) {
-	  release_assert(BB->invar->idx == L->latchIdx);
-	  continue;
 	}
+	
+      }
+      else {
+
+	findTentativeLoadsAndKillStoresInUnboundedLoop(BB->invar->naturalScope, commitDisabledHere || (LPA && !LPA->isEnabled()), secondPass, disableWrites);
 
       }
 
-      // Create a store reference for each live successor
-      ++BB->dseStore->refCount;
+      while(i != ilim && BB->invar->naturalScope->contains(getBBInvar(i)->naturalScope))
+	++i;
+      --i;
+      continue;
+
+    }
 
+    if(i != startIdx) {
+      doTLStoreMerge(BB);
+      doDSEStoreMerge(BB);
     }
 
-    // Drop stack allocations here.
+    TLWalkPathConditions(BB, !commitDisabledHere, secondPass);
+    DSEWalkPathConditions(BB);
+
+    // A call that never returns ends the walk of this block for each store.
+    bool TLBroke = false, DSEBroke = false;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim && !(TLBroke && DSEBroke); ++j) {
 
-    if(BB->invar->succIdxs.size() == 0) {
+      ShadowInstruction* SI = &BB->insts[j];
+      InlineAttempt* IA = getInlineAttempt(SI);
 
-      if(invarInfo->frameSize != -1) {
-	BB->dseStore = BB->dseStore->getWritableFrameList();
-	BB->dseStore->popStackFrame();
+      if(!TLBroke)
+	TLAnalyseInstruction(*SI, commitDisabledHere, secondPass, false);
+
+      if(!IA) {
+	if(!DSEBroke)
+	  DSEAnalyseInstruction(SI, commitDisabledHere, disableWrites, true, DSEBroke);
+	continue;
       }
 
+      // The DSE check for a disabled child's return value depends on its TL results, so
+      // walk that child for TL first and then separately for DSE, as the unfused passes would.
+      // DSE doesn't enter calls when it is only marking writers needed.
+      bool fuseCall = IA->isEnabled() && !(TLBroke || DSEBroke || disableWrites);
+
+      if(fuseCall) {
+
+	DSEAnalyseInstruction(SI, commitDisabledHere, disableWrites, false, DSEBroke);
+	IA->BBs[0]->tlStore = BB->tlStore;
+	IA->BBs[0]->dseStore = BB->dseStore;
+	IA->findTentativeLoadsAndKillStores(commitDisabledHere, secondPass);
+	doTLCallMerge(BB, IA);
+	doDSECallMerge(BB, IA);
+
+      }
+      else {
+
+	if(!TLBroke) {
+	  IA->BBs[0]->tlStore = BB->tlStore;
+	  IA->findTentativeLoads(commitDisabledHere || !IA->isEnabled(), secondPass);
+	  doTLCallMerge(BB, IA);
+	}
+
+	if(!DSEBroke)
+	  DSEAnalyseInstruction(SI, commitDisabledHere, disableWrites, true, DSEBroke);
+
+      }
+
+      if(!BB->tlStore)
+	TLBroke = true;
+      if(!BB->dseStore)
+	DSEBroke = true;
+
     }
 
-    // Drop the reference belonging to this block.
+    // Blocks without a store end in a never-returns call and so have no successors.
+    if(BB->tlStore)
+      TLPassStoreToSuccessors(BB, L, TLLatchToHeader);
+    else
+      release_assert(TLBroke);
 
-    if(!isa<ReturnInst>(BB->invar->BB->getTerminator()))
-      SAFE_DROP_REF(BB->dseStore);
+    if(BB->dseStore)
+      DSEPassStoreToSuccessors(BB, L, DSELatchToHeader);
+    else
+      release_assert(DSEBroke);
 
   }
 
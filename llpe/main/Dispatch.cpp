@@ -0,0 +1,243 @@
+//===-- Dispatch.cpp ------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+#define DEBUG_TYPE "llpe-dispatch"
+
+using namespace llvm;
+
+// After a batch of specialisations (-llpe-batch-config), optionally replace the root function with a
+// dispatcher that checks at runtime which configuration's assumptions about the root's arguments hold,
+// and calls that configuration's specialised root, or the original root if none match.
+// Path conditions are common to the whole batch and are checked within each specialisation as usual.
+
+static cl::opt<bool> BatchDispatch("llpe-batch-dispatch");
+
+// Record what Config's specialisation assumes: its root argument values and the argv strings that
+// loadArgv wrote for it.
+void LLPEAnalysisPass::noteBatchAssumptions(SpecialisationConfig& Config, std::vector<Constant*>& argConstants, uint32_t argvIdx) {
+
+  Config.argConstants = argConstants;
+  Config.argvIdx = argvIdx;
+
+  for(std::vector<Instruction*>::iterator it = rootArgvInsts.begin(), itend = rootArgvInsts.end(); it != itend; ++it) {
+
+    StoreInst* SI = dyn_cast<StoreInst>(*it);
+    if((!SI) || isa<ConstantPointerNull>(SI->getValueOperand()))
+      continue;
+
+    GetElementPtrInst* GEP = cast<GetElementPtrInst>(SI->getPointerOperand());
+    uint64_t idx = cast<ConstantInt>(GEP->getOperand(1))->getZExtValue();
+    Config.argvStrings.push_back(std::make_pair(idx, cast<Constant>(SI->getValueOperand())));
+
+  }
+
+}
+
+// Strings and environments given as specialisation parameters are pointers to the start of
+// a constant global: a string, or an array of string pointers.
+static GlobalVariable* getAssumedArray(Constant* C) {
+
+  ConstantExpr* CE = dyn_cast<ConstantExpr>(C);
+  if((!CE) || CE->getOpcode() != Instruction::GetElementPtr)
+    return 0;
+
+  GlobalVariable* GV = dyn_cast<GlobalVariable>(CE->getOperand(0));
+  if((!GV) || (!GV->isConstant()) || !GV->hasInitializer())
+    return 0;
+
+  return GV;
+
+}
+
+// Can we check at runtime that an argument of type ArgTy has the value C?
+static bool isTestableAssumption(Type* ArgTy, Constant* C) {
+
+  if(C->getType() != ArgTy)
+    return false;
+
+  if(isa<ConstantInt>(C) || isa<Function>(C) || C->isNullValue())
+    return true;
+
+  GlobalVariable* GV = getAssumedArray(C);
+  if(!GV)
+    return false;
+
+  if(ConstantDataArray* CDA = dyn_cast<ConstantDataArray>(GV->getInitializer()))
+    return CDA->isCString();
+
+  return isa<ConstantArray>(GV->getInitializer());
+
+}
+
+// Tests are emitted as a chain of blocks: end BB with a branch on Cond to a fresh block
+// (which becomes the new BB) or to FailBB.
+static void emitDispatchTest(Value* Cond, BasicBlock*& BB, BasicBlock* FailBB) {
+
+  BasicBlock* Next = BasicBlock::Create(BB->getContext(), "", BB->getParent(), FailBB);
+  BranchInst::Create(Next, FailBB, Cond, BB);
+  BB = Next;
+
+}
+
+// Emit a check that Arg == C, where isTestableAssumption(C).
+static void emitArgTest(Value* Arg, Constant* C, BasicBlock*& BB, BasicBlock* FailBB) {
+
+  if(isa<ConstantInt>(C) || isa<Function>(C) || C->isNullValue()) {
+
+    emitDispatchTest(new ICmpInst(*BB, CmpInst::ICMP_EQ, Arg, C, ""), BB, FailBB);
+    return;
+
+  }
+
+  GlobalVariable* GV = getAssumedArray(C);
+
+  if(isa<ConstantDataArray>(GV->getInitializer())) {
+
+    emitDispatchTest(new ICmpInst(*BB, CmpInst::ICMP_NE, Arg, Constant::getNullValue(Arg->getType()), ""), BB, FailBB);
+    emitDispatchTest(emitStringEqualityTest(Arg, C, BB), BB, FailBB);
+    return;
+
+  }
+
+  // An environment: every string must match, then the array must end where it did
+  // during specialisation.
+  emitDispatchTest(new ICmpInst(*BB, CmpInst::ICMP_NE, Arg, Constant::getNullValue(Arg->getType()), ""), BB, FailBB);
+
+  ConstantArray* CA = cast<ConstantArray>(GV->getInitializer());
+  Type* Int64 = Type::getInt64Ty(BB->getContext());
+
+  for(uint32_t i = 0, ilim = CA->getNumOperands(); i != ilim; ++i) {
+
+    Constant* Expected = CA->getOperand(i);
+    Value* EltPtr = GetElementPtrInst::Create(Arg, ConstantInt::get(Int64, i), "", BB);
+    Value* Elt = new LoadInst(EltPtr, "", BB);
+
+    if(Expected->isNullValue()) {
+      emitDispatchTest(new ICmpInst(*BB, CmpInst::ICMP_EQ, Elt, Expected, ""), BB, FailBB);
+      break;
+    }
+
+    emitDispatchTest(new ICmpInst(*BB, CmpInst::ICMP_NE, Elt, Constant::getNullValue(Elt->getType()), ""), BB, FailBB);
+    emitDispatchTest(emitStringEqualityTest(Elt, Expected, BB), BB, FailBB);
+
+  }
+
+}
+
+// Finish BB with a tail call to Callee passing Args, returning its result.
+static void emitDispatchCall(Function* Callee, std::vector<Value*>& Args, BasicBlock* BB) {
+
+  CallInst* CI = CallInst::Create(Callee, Args, "", BB);
+  CI->setCallingConv(Callee->getCallingConv());
+  CI->setAttributes(Callee->getAttributes());
+  CI->setTailCall();
+
+  if(CI->getType()->isVoidTy())
+    ReturnInst::Create(BB->getContext(), BB);
+  else
+    ReturnInst::Create(BB->getContext(), CI, BB);
+
+}
+
+void LLPEAnalysisPass::emitBatchDispatcher() {
+
+  if(!BatchDispatch)
+    return;
+
+  Function* RootF = &RootIA->F;
+  if(RootF->isVarArg()) {
+
+    errs() << "Can't build a dispatcher for vararg function " << RootF->getName() << "\n";
+    return;
+
+  }
+
+  LLVMContext& LLC = RootF->getContext();
+
+  Function* DispatchF = Function::Create(RootF->getFunctionType(), RootF->getLinkage(), "", RootF->getParent());
+  DispatchF->setAttributes(RootF->getAttributes());
+  DispatchF->setCallingConv(RootF->getCallingConv());
+
+  // Callers of the root, including recursive calls from specialised code, now go through the
+  // dispatcher. Do this before the fallback call to the original is created.
+  RootF->replaceAllUsesWith(DispatchF);
+
+  std::vector<Value*> Args;
+  for(Function::arg_iterator it = DispatchF->arg_begin(), itend = DispatchF->arg_end(); it != itend; ++it)
+    Args.push_back(it);
+
+  BasicBlock* FailBB = BasicBlock::Create(LLC, "dispatch_original", DispatchF);
+  emitDispatchCall(RootF, Args, FailBB);
+
+  // Build each configuration's checks back to front, so that each knows where to go on failure.
+  // Configurations are thus tried in the order given.
+  uint32_t dispatched = 0;
+
+  for(uint32_t i = batchConfigs.size(); i != 0; --i) {
+
+    SpecialisationConfig& Config = batchConfigs[i - 1];
+
+    bool testable = true;
+    for(uint32_t j = 0, jlim = Config.argConstants.size(); j != jlim && testable; ++j) {
+      if(Config.argConstants[j] && !isTestableAssumption(Args[j]->getType(), Config.argConstants[j]))
+	testable = false;
+    }
+
+    if(!testable) {
+
+      errs() << "Dispatcher: can't check the assumptions of configuration " << Config.name << ", omitting it\n";
+      continue;
+
+    }
+
+    BasicBlock* CheckBB = BasicBlock::Create(LLC, "dispatch_" + Config.name, DispatchF, DispatchF->begin());
+    BasicBlock* BB = CheckBB;
+
+    for(uint32_t j = 0, jlim = Config.argConstants.size(); j != jlim; ++j) {
+      if(Config.argConstants[j])
+	emitArgTest(Args[j], Config.argConstants[j], BB, FailBB);
+    }
+
+    // argc has been checked above, so these argv entries exist.
+    Type* Int64 = Type::getInt64Ty(LLC);
+    for(std::vector<std::pair<uint64_t, Constant*> >::iterator it = Config.argvStrings.begin(),
+	  itend = Config.argvStrings.end(); it != itend; ++it) {
+
+      Value* ArgPtr = GetElementPtrInst::Create(Args[Config.argvIdx], ConstantInt::get(Int64, it->first), "", BB);
+      Value* Arg = new LoadInst(ArgPtr, "", BB);
+      emitDispatchTest(emitStringEqualityTest(Arg, it->second, BB), BB, FailBB);
+
+    }
+
+    emitDispatchCall(batchRoots[i - 1], Args, BB);
+    FailBB = CheckBB;
+    ++dispatched;
+
+  }
+
+  // Take over the root's name, as a single specialisation would.
+  std::string oldFName;
+  {
+    raw_string_ostream RSO(oldFName);
+    RSO << RootF->getName() << ".old";
+  }
+
+  DispatchF->takeName(RootF);
+  RootF->setName(oldFName);
+
+  errs() << "Dispatcher " << DispatchF->getName() << " selects among " << dispatched << " of " << batchConfigs.size() << " specialisations\n";
+
+}
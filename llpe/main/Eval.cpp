@@ -838,6 +838,17 @@ bool IntegrationAttempt::tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValS
 
   if(isIDOrConst(op0) && isIDOrConst(op1) && op0 != op1) {
 
+    // A heap pointer can still equal a constant address at runtime if its allocation failed
+    // (e.g. mmap returning MAP_FAILED), so check it as for the null tests above.
+    if(comparingHeapPointer && !(op0UGO && op1UGO) && needsRuntimeCheck && !pass->omitMallocChecks) {
+
+      ShadowValue& heapOp = op0UGO ? op0 : op1;
+
+      if(!heapPointerAlreadyTested(heapOp, SI))
+	(*needsRuntimeCheck) = RUNTIME_CHECK_AS_EXPECTED;
+
+    }
+
     // This works regardless of the pointers' offset values.
 
     if(CmpI->getPredicate() == CmpInst::ICMP_EQ) {
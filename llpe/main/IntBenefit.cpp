@@ -9,15 +9,24 @@
 
 #include "llvm/Analysis/LLPE.h"
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
 
 using namespace llvm;
 
+// Cap on the number of instructions (including unspecialised clones for failed checks) that
+// committed specialised code may contain. 0 means no limit.
+static cl::opt<unsigned> SizeBudget("llpe-size-budget", cl::init(0));
+
 const uint32_t eliminatedInstructionPoints = 2;
 const uint32_t extraInstructionPoints = 1;
 
@@ -186,6 +195,112 @@ void IntegrationAttempt::findResidualFunctions(DenseSet<Function*>& ElimFunction
 
 }
 
+// Load a block execution profile. Each line has the form function,block,count, where block
+// is either a block name or #N giving the Nth block of the function (for unnamed blocks).
+// Counts for the same block are summed, so profiles from several runs may be concatenated.
+void LLPEAnalysisPass::loadBlockProfile(Module& M, std::string& path) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
+  if(std::error_code ec = MB.getError()) {
+
+    errs() << "Failed to load profile from " << path << ": " << ec.message() << "\n";
+    exit(1);
+
+  }
+
+  StringRef Remaining = (*MB)->getBuffer();
+  Function* lastF = 0;
+  StringMap<BasicBlock*> blocksByName;
+  std::vector<BasicBlock*> blocksByIdx;
+
+  while(!Remaining.empty()) {
+
+    std::pair<StringRef, StringRef> LineSplit = Remaining.split('\n');
+    StringRef Line = LineSplit.first.trim();
+    Remaining = LineSplit.second;
+
+    if(Line.empty() || Line[0] == '#')
+      continue;
+
+    std::pair<StringRef, StringRef> FSplit = Line.split(',');
+    std::pair<StringRef, StringRef> BBSplit = FSplit.second.split(',');
+    uint64_t count;
+
+    if(BBSplit.second.empty() || BBSplit.second.getAsInteger(10, count)) {
+
+      errs() << "-llpe-profile: bad line " << Line << " (expected function,block,count)\n";
+      exit(1);
+
+    }
+
+    Function* F = M.getFunction(FSplit.first);
+    if(!F) {
+
+      errs() << "-llpe-profile: no such function " << FSplit.first << "\n";
+      exit(1);
+
+    }
+
+    if(F != lastF) {
+
+      blocksByName.clear();
+      blocksByIdx.clear();
+      for(Function::iterator it = F->begin(), itend = F->end(); it != itend; ++it) {
+	if(it->hasName())
+	  blocksByName[it->getName()] = it;
+	blocksByIdx.push_back(it);
+      }
+      lastF = F;
+
+    }
+
+    BasicBlock* BB = 0;
+    uint64_t blockIdx;
+
+    if(BBSplit.first.startswith("#") && !BBSplit.first.substr(1).getAsInteger(10, blockIdx)) {
+
+      if(blockIdx < blocksByIdx.size())
+	BB = blocksByIdx[blockIdx];
+
+    }
+    else {
+
+      StringMap<BasicBlock*>::iterator findit = blocksByName.find(BBSplit.first);
+      if(findit != blocksByName.end())
+	BB = findit->second;
+
+    }
+
+    if(!BB) {
+
+      errs() << "-llpe-profile: no such block " << BBSplit.first << " in " << F->getName() << "\n";
+      exit(1);
+
+    }
+
+    blockProfile[BB] += count;
+    profiledFunctions.insert(F);
+
+  }
+
+}
+
+// How many times BBI is expected to run each time this context is entered, according to the profile:
+// relative to the function entry for a call, or to the loop header for an iteration.
+// Blocks missing from a profiled function never ran and so get weight zero.
+double IntegrationAttempt::getProfileWeight(ShadowBBInvar* BBI) {
+
+  if(!pass->profiledFunctions.count(&F))
+    return 1.0;
+
+  uint64_t refCount = pass->blockProfile.lookup(getEntryBlock());
+  if(!refCount)
+    return 0.0;
+
+  return ((double)pass->blockProfile.lookup(BBI->BB)) / refCount;
+
+}
+
 // Determine (roughly) whether it will be profitable to specialise this context.
 void PeelAttempt::findProfitableIntegration() {
 
@@ -210,6 +325,16 @@ void PeelAttempt::findProfitableIntegration() {
 
 }
 
+// Rerolling a run of identical committed iterations into a counted loop saves all but one
+// copy of the body, but costs the loop overhead on every iteration at runtime.
+bool PeelAttempt::rerollIsProfitable(uint32_t runLength, uint32_t bodyInsts, uint32_t overheadInsts) {
+
+  int64_t savedInstPoints = extraInstructionPoints * ((int64_t)(runLength - 1) * bodyInsts - overheadInsts);
+  int64_t overheadPoints = eliminatedInstructionPoints * ((int64_t)runLength * overheadInsts);
+  return savedInstPoints > overheadPoints;
+
+}
+
 void IntegrationAttempt::findProfitableIntegration() {
 
   if(integrationGoodnessValid)
@@ -253,7 +378,7 @@ void IntegrationAttempt::findProfitableIntegration() {
 
   // 2. Points for instructions which *would* be performed but are eliminated.
   // This differs from the elimdInstructions value in that dead blocks are not counted
-  // since they wouldn't get run at all.
+  // since they wouldn't get run at all. With a profile, blocks that rarely run earn little.
 
   int64_t timeBonus = 0;
 
@@ -277,14 +402,22 @@ void IntegrationAttempt::findProfitableIntegration() {
 
     if(L == BBL) {
 
+      uint32_t elimInstructions = 0;
+
       for(uint32_t j = 0; j < BB->insts.size(); ++j) {
 
 	ShadowInstruction* I = &(BB->insts[j]);
-	if(willBeReplacedOrDeleted(ShadowValue(I))) {
-	  totalIntegrationGoodness += eliminatedInstructionPoints;
-	  timeBonus += eliminatedInstructionPoints;
-	}
+	if(willBeReplacedOrDeleted(ShadowValue(I)))
+	  ++elimInstructions;
+
+      }
 
+      // Weight by how often this block really runs, if we have a profile.
+      // Without one the weight is exactly 1.
+      if(elimInstructions) {
+	int64_t blockBonus = (int64_t)((eliminatedInstructionPoints * elimInstructions * getProfileWeight(BB->invar)) + 0.5);
+	totalIntegrationGoodness += blockBonus;
+	timeBonus += blockBonus;
       }
 
     }
@@ -320,6 +453,265 @@ void InlineAttempt::findProfitableIntegration() {
 
 }
 
+// Code-size budget. Contexts are committed bottom-up as their analysis completes, so the budget is
+// enforced incrementally: when a context is finalised we predict how much new code committing it will emit
+// (child calls already committed were charged when they were finalised), and if that won't fit in what
+// remains of the budget, disable the least profitable uncommitted loops and calls beneath it (ranked by
+// benefit per instruction), and finally the context itself. Child code discarded that way is refunded.
+
+static uint64_t sizeBudgetUsed = 0;
+
+// Each specialisation in a batch gets a budget of its own.
+void llvm::resetSizeBudget() {
+
+  sizeBudgetUsed = 0;
+
+}
+
+struct llvm::SizeBudgetCandidate {
+
+  InlineAttempt* IA;
+  PeelAttempt* PA;
+  // Index of the nearest enclosing candidate, or -1.
+  int32_t parentIdx;
+  double score;
+  bool disabled;
+
+SizeBudgetCandidate(InlineAttempt* _IA, PeelAttempt* _PA, int32_t pi, double sc) : 
+  IA(_IA), PA(_PA), parentIdx(pi), score(sc), disabled(false) {}
+
+};
+
+static bool lowerBenefitDensity(const std::pair<double, uint32_t>& A, const std::pair<double, uint32_t>& B) {
+
+  return A.first < B.first;
+
+}
+
+static double benefitDensity(int64_t goodness, uint64_t size) {
+
+  return ((double)goodness) / (size ? size : 1);
+
+}
+
+// Predict the instructions committing this context will emit, not counting child calls that have already been
+// committed. Loops that won't be peeled are emitted as they are.
+uint64_t IntegrationAttempt::predictCommitSize() {
+
+  int64_t ownSize = ((int64_t)getTotalInstructions()) - ((int64_t)getElimdInstructions());
+  uint64_t size = ownSize > 0 ? ownSize : 0;
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* PA = it->second;
+
+    if(PA->isEnabled() && PA->isTerminated()) {
+      for(std::vector<PeelIteration*>::iterator iterit = PA->Iterations.begin(),
+	    iteritend = PA->Iterations.end(); iterit != iteritend; ++iterit)
+	size += (*iterit)->predictCommitSize();
+    }
+    else {
+      size += PA->Iterations[0]->getTotalInstructionsIncludingLoops();
+    }
+
+  }
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    if(it->second->isEnabled() && !it->second->isCommitted())
+      size += it->second->predictCommitSize();
+
+  }
+
+  return size;
+
+}
+
+// Add the unspecialised clones created for failing checks.
+uint64_t InlineAttempt::predictCommitSize() {
+
+  uint64_t size = IntegrationAttempt::predictCommitSize();
+
+  if(blocksReachableOnFailure && !pass->omitChecks) {
+
+    for(SmallDenseMap<uint32_t, uint32_t, 8>::iterator it = blocksReachableOnFailure->begin(),
+	  itend = blocksReachableOnFailure->end(); it != itend; ++it)
+      size += getBBInvar(it->first)->insts.size() - it->second;
+
+  }
+
+  return size;
+
+}
+
+// Sum the charges of the nearest already-committed child calls: all of them, or only those that will
+// still be used given the current enabled / disabled decisions.
+uint64_t IntegrationAttempt::getCommittedChildCharge(bool onlyEnabled) {
+
+  uint64_t charge = 0;
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* PA = it->second;
+    if(onlyEnabled && !(PA->isEnabled() && PA->isTerminated()))
+      continue;
+
+    for(std::vector<PeelIteration*>::iterator iterit = PA->Iterations.begin(),
+	  iteritend = PA->Iterations.end(); iterit != iteritend; ++iterit)
+      charge += (*iterit)->getCommittedChildCharge(onlyEnabled);
+
+  }
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    InlineAttempt* Child = it->second;
+    if(onlyEnabled && !Child->isEnabled())
+      continue;
+
+    if(Child->isCommitted())
+      charge += Child->chargedSize;
+    else
+      charge += Child->getCommittedChildCharge(onlyEnabled);
+
+  }
+
+  return charge;
+
+}
+
+// Gather uncommitted, enabled loops and calls beneath this context that could be disabled to save space.
+void IntegrationAttempt::collectSizeBudgetCandidates(std::vector<SizeBudgetCandidate>& Cands, int32_t parentIdx) {
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* PA = it->second;
+    if(!(PA->isEnabled() && PA->isTerminated()))
+      continue;
+
+    uint64_t size = 0;
+    for(std::vector<PeelIteration*>::iterator iterit = PA->Iterations.begin(),
+	  iteritend = PA->Iterations.end(); iterit != iteritend; ++iterit)
+      size += (*iterit)->predictCommitSize();
+
+    int32_t thisIdx = Cands.size();
+    Cands.push_back(SizeBudgetCandidate(0, PA, parentIdx, benefitDensity(PA->totalIntegrationGoodness, size)));
+
+    for(std::vector<PeelIteration*>::iterator iterit = PA->Iterations.begin(),
+	  iteritend = PA->Iterations.end(); iterit != iteritend; ++iterit)
+      (*iterit)->collectSizeBudgetCandidates(Cands, thisIdx);
+
+  }
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    InlineAttempt* Child = it->second;
+    if((!Child->isEnabled()) || Child->isCommitted() || Child->isShared() || Child->isPathCondition)
+      continue;
+
+    int32_t thisIdx = Cands.size();
+    Cands.push_back(SizeBudgetCandidate(Child, 0, parentIdx, 
+					benefitDensity(Child->totalIntegrationGoodness, Child->predictCommitSize())));
+    Child->collectSizeBudgetCandidates(Cands, thisIdx);
+
+  }
+
+}
+
+void InlineAttempt::enforceSizeBudget() {
+
+  if(!SizeBudget)
+    return;
+
+  // Charges for committed children, whether or not we end up using them.
+  uint64_t childCharges = getCommittedChildCharge(false);
+
+  if(isEnabled()) {
+
+    uint64_t available = SizeBudget > sizeBudgetUsed ? SizeBudget - sizeBudgetUsed : 0;
+    uint64_t needed = predictCommitSize();
+
+    if(needed > available) {
+
+      std::vector<SizeBudgetCandidate> Cands;
+      collectSizeBudgetCandidates(Cands, -1);
+
+      std::vector<std::pair<double, uint32_t> > Order;
+      for(uint32_t i = 0, ilim = Cands.size(); i != ilim; ++i)
+	Order.push_back(std::make_pair(Cands[i].score, i));
+      std::stable_sort(Order.begin(), Order.end(), lowerBenefitDensity);
+
+      for(std::vector<std::pair<double, uint32_t> >::iterator it = Order.begin(), itend = Order.end();
+	  it != itend && needed > available; ++it) {
+
+	SizeBudgetCandidate& C = Cands[it->second];
+
+	// Already gone with an enclosing loop or call?
+	bool ancestorDisabled = false;
+	for(int32_t p = C.parentIdx; p != -1 && !ancestorDisabled; p = Cands[p].parentIdx)
+	  ancestorDisabled = Cands[p].disabled;
+	if(ancestorDisabled)
+	  continue;
+
+	// Contexts leading to a checked read must stay, as in findProfitableIntegration:
+	// later reads may rely on their checks.
+	if(C.PA) {
+
+	  bool checkedReads = false;
+	  for(std::vector<PeelIteration*>::iterator iterit = C.PA->Iterations.begin(),
+		iteritend = C.PA->Iterations.end(); iterit != iteritend && !checkedReads; ++iterit)
+	    checkedReads = (*iterit)->containsCheckedReads;
+
+	  if(checkedReads)
+	    continue;
+
+	}
+	else if(C.IA->containsCheckedReads)
+	  continue;
+
+	if(C.PA)
+	  C.PA->setEnabled(false, true);
+	else
+	  C.IA->setEnabled(false, true);
+	C.disabled = true;
+
+	needed = predictCommitSize();
+
+      }
+
+      if(needed > available) {
+
+	if(isRootMainCall())
+	  errs() << "Warning: specialised root function exceeds size budget (" << needed << " instructions)\n";
+	else if(containsCheckedReads)
+	  errs() << "Warning: " << getShortHeader() << " exceeds size budget (" << needed << " instructions) but leads to checked reads\n";
+	else
+	  setEnabled(false, true);
+
+      }
+
+    }
+
+  }
+
+  if(isEnabled()) {
+
+    chargedSize = predictCommitSize() + getCommittedChildCharge(true);
+    sizeBudgetUsed += chargedSize;
+
+  }
+  else {
+
+    chargedSize = 0;
+
+  }
+
+  sizeBudgetUsed -= std::min(sizeBudgetUsed, childCharges);
+
+}
+
 // Does this instruction count for accounting / performance measurement? Essentially: can this possibly be improved?
 bool llvm::instructionCounts(Instruction* I) {
 
@@ -8,9 +8,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Analysis/LLPE.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 
 #include <openssl/sha.h>
+#include <fstream>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -22,6 +24,12 @@ using namespace llvm;
 // Functions to write a summary of the files consumed in this specialisation,
 // for consumption by the LLIO watch daemon (lliowd).
 
+// -llpe-file-deps additionally records which contexts' analysis read each file, together with its SHA-1.
+// Given that record from an earlier run as -llpe-file-deps-baseline, we report up front which files
+// have changed and so which contexts (and, implicitly, every context enclosing them) are out of date.
+static cl::opt<std::string> FileDepsFile("llpe-file-deps", cl::init(""));
+static cl::opt<std::string> FileDepsBaseline("llpe-file-deps-baseline", cl::init(""));
+
 // Compute SHA-1 hash of Filename:
 
 static bool getFileSha1(std::string& Filename, unsigned char* hash) {
@@ -77,6 +85,27 @@ static bool getFileSha1(std::string& Filename, unsigned char* hash) {
 
 }
 
+// Get the SHA-1 of Filename as a hex string.
+
+static bool getFileSha1Hex(std::string& Filename, std::string& Out) {
+
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  if(!getFileSha1(Filename, hash))
+    return false;
+
+  raw_string_ostream RSO(Out);
+  for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+
+    if(hash[i]/16 == 0)
+      RSO << '0';
+    RSO.write_hex(hash[i]);
+
+  }
+
+  return true;
+
+}
+
 // Get modification time of filename.
 
 static time_t getFileMtime(std::string& filename) {
@@ -141,23 +170,158 @@ void LLPEAnalysisPass::writeLliowdConfig() {
 
     Out << "\t" << printPath << " " << getFileMtime(*it) << " ";
 
-    unsigned char hash[SHA_DIGEST_LENGTH];
+    std::string hash;
+    if(getFileSha1Hex(*it, hash))
+      Out << hash << "\n";
+
+  }
+
+}
+
+// Describe where this context sits in the tree, in terms that don't depend on the order
+// contexts were created, so that runs can be compared.
+
+static void printCallSite(ShadowInstruction* SI, raw_ostream& OS) {
+
+  ShadowBBInvar* BBI = SI->parent->invar;
+  if(BBI->BB->hasName())
+    OS << BBI->BB->getName();
+  else
+    OS << "#" << BBI->idx;
+  OS << ":" << SI->invar->idx;
+
+}
+
+void InlineAttempt::printContextPath(raw_ostream& OS) {
+
+  if(Callers.empty()) {
+    OS << F.getName();
+    return;
+  }
+
+  // Shared contexts are described by their first caller.
+  Callers[0]->parent->IA->printContextPath(OS);
+  OS << " / ";
+  printCallSite(Callers[0], OS);
+  OS << " " << F.getName();
+
+}
+
+void PeelIteration::printContextPath(raw_ostream& OS) {
+
+  parent->printContextPath(OS);
+  OS << " / loop " << getLName() << " iteration " << iterationCount;
+
+}
+
+// Note that IA's analysis depends on the contents of Filename.
+void llvm::noteFileReader(std::string& Filename, IntegrationAttempt* IA) {
+
+  if(FileDepsFile.empty())
+    return;
 
-    if(getFileSha1(*it, hash)) {
+  std::string path;
+  {
+    raw_string_ostream RSO(path);
+    IA->printContextPath(RSO);
+  }
+
+  GlobalIHP->fileReaders[Filename].insert(path);
+
+}
+
+// Write the file-dependency record: a line per file giving its path and SHA-1, tab-separated,
+// followed by a tab-indented line per context that read it.
+void LLPEAnalysisPass::writeFileDeps() {
+
+  if(FileDepsFile.empty())
+    return;
+
+  std::error_code error;
+  raw_fd_ostream Out(FileDepsFile.c_str(), error, sys::fs::F_None);
+  if(error) {
+
+    errs() << "Failed to open " << FileDepsFile << ": " << error.message() << "\n";
+    return;
+
+  }
+
+  for(std::map<std::string, std::set<std::string> >::iterator it = fileReaders.begin(),
+	itend = fileReaders.end(); it != itend; ++it) {
+
+    std::string name = it->first;
+    std::string hash;
+    if(!getFileSha1Hex(name, hash))
+      hash = "-";
+
+    Out << it->first << "\t" << hash << "\n";
+
+    for(std::set<std::string>::iterator cit = it->second.begin(), citend = it->second.end(); cit != citend; ++cit)
+      Out << "\t" << *cit << "\n";
+
+  }
+
+}
+
+// Compare the files named in a previous run's record against their current contents and report
+// the contexts whose results are stale.
+void LLPEAnalysisPass::checkFileDepsBaseline() {
+
+  if(FileDepsBaseline.empty())
+    return;
+
+  std::ifstream ifs(FileDepsBaseline.c_str());
+  if(!ifs.good()) {
+
+    errs() << "Failed to open " << FileDepsBaseline << "\n";
+    return;
+
+  }
+
+  uint32_t changedFiles = 0, staleContexts = 0;
+  bool fileChanged = false;
+  std::string line;
+
+  while(std::getline(ifs, line)) {
 
-      for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+    if(line.empty())
+      continue;
 
-	if(hash[i]/16 == 0)
-	  Out << '0';
-	Out.write_hex(hash[i]);
+    if(line[0] == '\t') {
 
+      if(fileChanged) {
+	errs() << "  " << line.substr(1) << "\n";
+	++staleContexts;
       }
+      continue;
 
-      Out << "\n";
+    }
+
+    size_t tabIdx = line.rfind('\t');
+    if(tabIdx == std::string::npos) {
+
+      errs() << "Malformed line in " << FileDepsBaseline << ": " << line << "\n";
+      return;
+
+    }
+
+    std::string name = line.substr(0, tabIdx);
+    std::string oldHash = line.substr(tabIdx + 1);
+    std::string newHash;
+    if(!getFileSha1Hex(name, newHash))
+      newHash = "-";
 
+    fileChanged = newHash != oldHash;
+    if(fileChanged) {
+      errs() << "Changed since " << FileDepsBaseline << ": " << name << ", read by:\n";
+      ++changedFiles;
     }
 
   }
 
-}
+  if(!changedFiles)
+    errs() << "No file read by the specialisation in " << FileDepsBaseline << " has changed\n";
+  else
+    errs() << changedFiles << " changed files affect " << staleContexts << " contexts\n";
 
+}
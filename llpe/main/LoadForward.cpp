@@ -29,6 +29,7 @@
 #include "llvm/Support/Debug.h"
 
 #include <memory>
+#include <unistd.h>
 
 using namespace llvm;
 
@@ -2406,6 +2407,13 @@ AllocData& llvm::addHeapAlloc(ShadowInstruction* SI) {
   uint32_t allocIdx = GlobalIHP->heap.size();
   GlobalIHP->heap.push_back(AllocData());
   GlobalIHP->heap.back().allocIdx = allocIdx;
+
+  // Yield domains may need to find this object again by its allocation site.
+  DenseMap<Instruction*, std::vector<uint32_t> >::iterator findit = 
+    GlobalIHP->heapObjectsBySite.find(SI->invar->I);
+  if(findit != GlobalIHP->heapObjectsBySite.end())
+    findit->second.push_back(allocIdx);
+
   return GlobalIHP->heap.back();
 
 }
@@ -2430,6 +2438,15 @@ static void executeMallocInst2(ShadowInstruction* SI, AllocatorFn& param) {
 
   AllocData& AD = addHeapAlloc(SI);
   executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, GlobalIHP->heap.size() - 1);
+
+  // Note arena membership so that resetting the arena can release this object.
+  if(param.arenaArg != UINT_MAX) {
+
+    std::pair<ValSetType, ImprovedVal> Arena;
+    if(tryGetUniqueIV(SI->getCallArgOperand(param.arenaArg), Arena) && Arena.first == ValSetTypePB)
+      GlobalIHP->arenaObjects[Arena.second.V].push_back(GlobalIHP->heap.size() - 1);
+
+  }
   
 }
 
@@ -2440,10 +2457,43 @@ void llvm::executeMallocLikeInst(ShadowInstruction* SI) {
 
 }
 
+// Release every object allocated from the arena SI resets. Objects from an arena
+// we couldn't identify at allocation time are left alone, as if never freed.
+static void executeArenaReset(ShadowInstruction* SI, DeallocatorFn& De) {
+
+  std::pair<ValSetType, ImprovedVal> Arena;
+  if((!tryGetUniqueIV(SI->getCallArgOperand(De.arg), Arena)) || Arena.first != ValSetTypePB)
+    return;
+
+  DenseMap<ShadowValue, std::vector<uint32_t> >::iterator findit = GlobalIHP->arenaObjects.find(Arena.second.V);
+  if(findit == GlobalIHP->arenaObjects.end())
+    return;
+
+  ImprovedValSetSingle TagIVS;
+  TagIVS.SetType = ValSetTypeDeallocated;
+
+  // Don't forget the objects: in the loop analyser this reset may run again against
+  // a store in which they are still live.
+  for(std::vector<uint32_t>::iterator it = findit->second.begin(), itend = findit->second.end(); it != itend; ++it) {
+
+    ShadowValue Obj = ShadowValue::getPtrIdx(-1, *it);
+    ImprovedValSetSingle ObjIVS;
+    ObjIVS.set(ImprovedVal(Obj, 0), ValSetTypePB);
+    executeWriteInst(0, ObjIVS, TagIVS, SI->parent->getAllocSize(Obj), SI);
+
+  }
+
+}
+
 void llvm::executeFreeInst(ShadowInstruction* SI, Function* FreeF) {
 
   DeallocatorFn& De = GlobalIHP->deallocatorFunctions[FreeF];
 
+  if(De.resetsArena) {
+    executeArenaReset(SI, De);
+    return;
+  }
+
   ShadowInstruction* FreedPtr = SI->getCallArgOperand(De.arg).getInst();
   if(!FreedPtr)
     return;
@@ -2733,6 +2783,70 @@ void llvm::executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uin
 
 }
 
+// mmap call SI maps a file read-only: model it as a heap allocation whose initial contents are
+// FileBytes, so that loads from the mapping resolve like any other load from a known object.
+void llvm::executeMmapInst(ShadowInstruction* SI, Constant* FileBytes) {
+
+  Type* MapType = FileBytes->getType();
+  uint64_t Size = GlobalAA->getTypeStoreSize(MapType);
+
+  ImprovedValSetSingle* OldIVS = dyn_cast_or_null<ImprovedValSetSingle>(SI->i.PB);
+  if(OldIVS && OldIVS->SetType == ValSetTypePB) {
+
+    // Mapped again in a loop or recursive call: as for malloc, the object now stands for all of them.
+    // Every mapping holds the same bytes, so it is still safe to write them below.
+    markVagueAllocation(SI);
+
+  }
+  else {
+
+    if(SI->i.PB)
+      deleteIV(SI->i.PB);
+    SI->i.PB = 0;
+
+    SI->parent->IA->noteMalloc(SI);
+
+    AllocData& AD = addHeapAlloc(SI);
+    executeAllocInst(SI, AD, MapType, Size, -1, AD.allocIdx);
+
+  }
+
+  ImprovedValSetSingle WriteIVS(ImprovedVal(FileBytes, 0), ValSetTypeScalar);
+  executeWriteInst(0, *cast<ImprovedValSetSingle>(SI->i.PB), WriteIVS, Size, SI);
+
+}
+
+// munmap call SI: if it releases the whole of a known object (i.e. one mapped by executeMmapInst)
+// then mark it deallocated as free would. Return true if we did so.
+bool llvm::executeMunmapInst(ShadowInstruction* SI) {
+
+  ImprovedValSetSingle MappedIVS;
+  if(!getImprovedValSetSingle(SI->getCallArgOperand(0), MappedIVS))
+    return false;
+
+  if(MappedIVS.isWhollyUnknown() || MappedIVS.SetType != ValSetTypePB ||
+     MappedIVS.Values.size() != 1 || MappedIVS.Values[0].Offset != 0)
+    return false;
+
+  uint64_t UnmapSize;
+  if(!tryGetConstantIntReplacement(SI->getCallArgOperand(1), UnmapSize))
+    return false;
+
+  // The kernel unmaps whole pages, so the lengths need only agree up to page granularity.
+  uint64_t MapSize = SI->parent->getAllocSize(MappedIVS.Values[0].V);
+  uint64_t PageSize = getpagesize();
+  if(MapSize == ULONG_MAX ||
+     (UnmapSize + PageSize - 1) / PageSize != (MapSize + PageSize - 1) / PageSize)
+    return false;
+
+  ImprovedValSetSingle TagIVS;
+  TagIVS.SetType = ValSetTypeDeallocated;
+
+  executeWriteInst(0, MappedIVS, TagIVS, MapSize, SI);
+  return true;
+
+}
+
 DenseMap<Function*, specialfunctions> llvm::SpecialFunctionMap;
 
 void llvm::initSpecialFunctionsMap(Module& M) {
@@ -3026,8 +3140,21 @@ bool llvm::clobberSyscallModLocations(Function* F, ShadowInstruction* SI) {
 	Details[i].Location->getLocation(ShadowValue(SI), ClobberV, ClobberSize);
       }
       else {
+	// A model for a vararg function may name arguments this call doesn't pass:
+	// fall back to clobbering everything.
+	if(Details[i].Location->argIndex >= SI->getNumArgOperands() ||
+	   (Details[i].Location->sizeArgMultiplier && Details[i].Location->sizeArgIndex >= SI->getNumArgOperands()))
+	  return false;
 	ClobberV = SI->getCallArgOperand(Details[i].Location->argIndex);
-	ClobberSize = Details[i].Location->argSize;
+	if(Details[i].Location->sizeArgMultiplier) {
+	  if(tryGetConstantInt(SI->getCallArgOperand(Details[i].Location->sizeArgIndex), ClobberSize))
+	    ClobberSize *= Details[i].Location->sizeArgMultiplier;
+	  else
+	    ClobberSize = AliasAnalysis::UnknownSize;
+	}
+	else {
+	  ClobberSize = Details[i].Location->argSize;
+	}
       }
 
       if(ClobberV.isInval())
@@ -3050,19 +3177,33 @@ bool llvm::clobberSyscallModLocations(Function* F, ShadowInstruction* SI) {
       // Optimistic locks have no effect here and are accounted for in the
       // tentative loads phase.
 
-      SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4>::iterator findit =
-	GlobalIHP->lockDomains.find(CI);
-      if(findit != GlobalIHP->lockDomains.end()) {
+      if(YieldDomain* Domain = GlobalIHP->getYieldDomain(CI, F)) {
 
 	ImprovedValSetSingle OD(ValSetTypeUnknown, true);
+	std::vector<ShadowValue> ClobberObjects;
 
-	for(std::vector<GlobalVariable*>::iterator it = findit->second.begin(),
-	      itend = findit->second.end(); it != itend; ++it) {
+	for(std::vector<GlobalVariable*>::iterator it = Domain->globals.begin(),
+	      itend = Domain->globals.end(); it != itend; ++it) {
 
 	  ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(*it)];
-	  ShadowValue ClobberV(SGV);
+	  ClobberObjects.push_back(ShadowValue(SGV));
+
+	}
+
+	for(SmallPtrSet<Instruction*, 4>::iterator it = Domain->allocSites.begin(),
+	      itend = Domain->allocSites.end(); it != itend; ++it) {
+
+	  std::vector<uint32_t>& Objects = GlobalIHP->heapObjectsBySite[*it];
+	  for(std::vector<uint32_t>::iterator objit = Objects.begin(), objitend = Objects.end(); objit != objitend; ++objit)
+	    ClobberObjects.push_back(ShadowValue::getPtrIdx(-1, *objit));
+
+	}
+
+	for(std::vector<ShadowValue>::iterator it = ClobberObjects.begin(),
+	      itend = ClobberObjects.end(); it != itend; ++it) {
+
 	  ImprovedValSetSingle ClobberIVS;
-	  ClobberIVS.set(ImprovedVal(ClobberV, LLONG_MAX), ValSetTypePB);
+	  ClobberIVS.set(ImprovedVal(*it, LLONG_MAX), ValSetTypePB);
 	  executeWriteInst(0, ClobberIVS, OD, AliasAnalysis::UnknownSize, SI);
 
 	}
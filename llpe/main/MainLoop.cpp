@@ -475,6 +475,14 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
 
 	LPA->releaseCommittedChildren();
 
+	// Gave up peeling because of the iteration budget? Free the iterations rather than
+	// keep them alongside the general loop analysis. Shared function instances might be
+	// referenced from elsewhere, so in that case the iterations are kept.
+	if(LPA->overBudget && !pass->enableSharing) {
+	  discardPeelAttempt(LPA);
+	  LPA = 0;
+	}
+
       }
 
     }
@@ -489,8 +497,7 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
 	// Run other passes over the whole loop
 	gatherIndirectUsersInLoop(BBL);
 	
-	findTentativeLoadsInUnboundedLoop(BBL, /* commit disabled here = */ false, /* second pass = */ false);
-	tryKillStoresInUnboundedLoop(BBL, /* commit disabled here = */ false, /* disable writes = */ false);
+	findTentativeLoadsAndKillStoresInUnboundedLoop(BBL, /* commit disabled here = */ false, /* second pass = */ false, /* disable writes = */ false);
 
       }
 	
@@ -11,14 +11,25 @@
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/ADT/Hashing.h"
 
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 
+#include <algorithm>
+#include <map>
+
 using namespace llvm;
 
 static cl::opt<bool> SkipPostCommit("int-skip-post-commit");
+static cl::opt<bool> KeepRedundantChecks("llpe-keep-redundant-checks");
+static cl::opt<bool> NoMergeFunctions("llpe-no-merge-functions");
 
 // These optimisations fold a committed residual-code function into a neater form.
 // We do this as we go because in certain cases it can dramatically reduce the amount
@@ -175,6 +186,156 @@ template<class T, class Callback> void postCommitOptimiseBlocks(T itstart, T ite
 
 }
 
+// Elimination of redundant runtime checks. Path conditions, as-expected checks and thread-interference
+// checks all commit to a conditional branch whose true edge continues in specialised code. When the
+// same condition was already tested on the way to a later check (for example, an invariant value
+// checked in every unrolled iteration of a request loop, or a value checked before a call and again
+// by the callee's path conditions) the later test can only pass, so its branch is made unconditional.
+// Removing edges never changes which blocks dominate which, so the dominator tree computed up-front
+// stays usable while we rewrite branches.
+
+// A leaf condition is identified by its operands and predicate, so that structurally identical
+// tests on the same values match even though they were synthesised separately.
+typedef std::pair<Value*, std::pair<Value*, unsigned> > CheckKey;
+
+static CheckKey getCheckKey(Value* V) {
+
+  if(CmpInst* CI = dyn_cast<CmpInst>(V))
+    return std::make_pair(CI->getOperand(0), std::make_pair(CI->getOperand(1), (unsigned)CI->getPredicate()));
+  else
+    return std::make_pair(V, std::make_pair((Value*)0, (unsigned)CmpInst::BAD_ICMP_PREDICATE));
+
+}
+
+struct KnownChecks {
+
+  DenseMap<CheckKey, uint32_t> known;
+  std::vector<CheckKey> log;
+
+  void learn(Value* V) {
+
+    CheckKey Key = getCheckKey(V);
+    ++known[Key];
+    log.push_back(Key);
+
+    // Both halves of a passed conjunction hold too.
+    if(BinaryOperator* BO = dyn_cast<BinaryOperator>(V)) {
+      if(BO->getOpcode() == Instruction::And) {
+	learn(BO->getOperand(0));
+	learn(BO->getOperand(1));
+      }
+    }
+
+  }
+
+  bool isKnown(Value* V) {
+
+    DenseMap<CheckKey, uint32_t>::iterator findit = known.find(getCheckKey(V));
+    if(findit != known.end() && findit->second)
+      return true;
+
+    if(BinaryOperator* BO = dyn_cast<BinaryOperator>(V)) {
+      if(BO->getOpcode() == Instruction::And)
+	return isKnown(BO->getOperand(0)) && isKnown(BO->getOperand(1));
+      if(BO->getOpcode() == Instruction::Or)
+	return isKnown(BO->getOperand(0)) || isKnown(BO->getOperand(1));
+    }
+
+    return false;
+
+  }
+
+  void rollback(uint32_t logSize) {
+
+    while(log.size() != logSize) {
+      --known[log.back()];
+      log.pop_back();
+    }
+
+  }
+
+};
+
+// Learn from the edge that enters BB (if it is the true edge of its only predecessor's test),
+// then drop BB's own test if it is implied.
+static bool elimRedundantCheckIn(BasicBlock* BB, KnownChecks& Known) {
+
+  if(BasicBlock* Pred = BB->getSinglePredecessor()) {
+
+    BranchInst* PredBI = dyn_cast<BranchInst>(Pred->getTerminator());
+    if(PredBI && PredBI->isConditional() && PredBI->getSuccessor(0) == BB && PredBI->getSuccessor(1) != BB)
+      Known.learn(PredBI->getCondition());
+
+  }
+
+  BranchInst* BI = dyn_cast<BranchInst>(BB->getTerminator());
+  if((!BI) || (!BI->isConditional()) || BI->getSuccessor(0) == BI->getSuccessor(1))
+    return false;
+
+  if(!Known.isKnown(BI->getCondition()))
+    return false;
+
+  BasicBlock* PassBB = BI->getSuccessor(0);
+  BI->getSuccessor(1)->removePredecessor(BB);
+  BranchInst::Create(PassBB, BI);
+  BI->eraseFromParent();
+
+  return true;
+
+}
+
+static uint32_t elimRedundantChecks(Function* F) {
+
+  // Contexts that are not yet fully committed may leave blocks unterminated.
+  for(Function::iterator it = F->begin(), itend = F->end(); it != itend; ++it) {
+    if(!it->getTerminator())
+      return 0;
+  }
+
+  DominatorTree DT;
+  DT.recalculate(*F);
+
+  KnownChecks Known;
+  uint32_t removed = 0;
+
+  // Walk the dominator tree depth-first, without recursion as residual functions can be very deep.
+  std::vector<std::pair<DomTreeNode*, uint32_t> > Stack;
+  std::vector<uint32_t> LogSizes;
+  Stack.push_back(std::make_pair(DT.getRootNode(), 0));
+
+  while(!Stack.empty()) {
+
+    DomTreeNode* Node = Stack.back().first;
+    uint32_t nextChild = Stack.back().second;
+
+    if(nextChild == 0) {
+
+      LogSizes.push_back(Known.log.size());
+      if(elimRedundantCheckIn(Node->getBlock(), Known))
+	++removed;
+
+    }
+
+    if(nextChild == Node->getNumChildren()) {
+
+      Known.rollback(LogSizes.back());
+      LogSizes.pop_back();
+      Stack.pop_back();
+
+    }
+    else {
+
+      ++Stack.back().second;
+      Stack.push_back(std::make_pair(Node->getChildren()[nextChild], 0));
+
+    }
+
+  }
+
+  return removed;
+
+}
+
 // Helpers that keep either a committed function or basic block list that hasn't
 // yet been inserted into a function having the right entry block.
 
@@ -240,6 +401,204 @@ struct DerefAdaptor {
 
 };
 
+// Cleanup of patterns that commit leaves behind and that downstream 'opt' would otherwise have to chew through:
+// path-condition and other check branches whose condition became constant, phis that forward a single value
+// (typically merging specialised and failed paths where one side went away), small memcpys from the
+// constant globals that stand in for file contents, and blocks that are no longer reachable.
+
+// Replace memcpys of 1, 2, 4 or 8 bytes from a constant global (as emitted for read() calls)
+// with a store of the equivalent integer.
+static uint32_t foldSmallConstantMemcpys(Function* F) {
+
+  std::vector<MemCpyInst*> Memcpys;
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II) {
+      if(MemCpyInst* MCI = dyn_cast<MemCpyInst>(II))
+	Memcpys.push_back(MCI);
+    }
+  }
+
+  uint32_t folded = 0;
+
+  for(std::vector<MemCpyInst*>::iterator it = Memcpys.begin(), itend = Memcpys.end(); it != itend; ++it) {
+
+    MemCpyInst* MCI = *it;
+    ConstantInt* Len = dyn_cast<ConstantInt>(MCI->getLength());
+    Constant* Src = dyn_cast<Constant>(MCI->getRawSource());
+    if((!Len) || (!Src) || MCI->isVolatile())
+      continue;
+
+    uint64_t Size = Len->getLimitedValue();
+    if(Size != 1 && Size != 2 && Size != 4 && Size != 8)
+      continue;
+
+    // The source may point partway into a file-contents global.
+    GlobalVariable* GV = dyn_cast<GlobalVariable>(Src->stripInBoundsConstantOffsets());
+    if((!GV) || (!GV->isConstant()) || (!GV->hasDefinitiveInitializer()))
+      continue;
+
+    Type* IntTy = Type::getIntNTy(F->getContext(), Size * 8);
+    Constant* Val = ConstantFoldLoadFromConstPtr(ConstantExpr::getBitCast(Src, PointerType::getUnqual(IntTy)), GlobalTD);
+    if(!Val)
+      continue;
+
+    Value* Dest = MCI->getRawDest();
+    Type* DestTy = PointerType::get(IntTy, cast<PointerType>(Dest->getType())->getAddressSpace());
+    Value* DestCast = new BitCastInst(Dest, DestTy, "", MCI);
+    StoreInst* SI = new StoreInst(Val, DestCast, false, MCI->getAlignment(), MCI);
+
+    // Tracked stores refer to the memcpy by WeakVH; let them follow it to the store.
+    MCI->replaceAllUsesWith(SI);
+    DeleteDeadInstruction(MCI);
+    ++folded;
+
+  }
+
+  return folded;
+
+}
+
+static bool isPendingPatchTargetOrUser(Instruction* I) {
+
+  DenseSet<Instruction*>& Pending = GlobalIHP->pendingPatchTargets;
+  if(Pending.empty())
+    return false;
+
+  if(Pending.count(I))
+    return true;
+
+  for(uint32_t i = 0, ilim = I->getNumOperands(); i != ilim; ++i) {
+    if(Instruction* OpI = dyn_cast<Instruction>(I->getOperand(i))) {
+      if(Pending.count(OpI))
+	return true;
+    }
+  }
+
+  return false;
+
+}
+
+// Simplify instructions (including forwarding phis) and fold terminators whose conditions are now known.
+// Returns true if anything changed.
+static bool simplifyResidualInstructions(Function* F) {
+
+  bool changed = false;
+
+  DominatorTree DT;
+  DT.recalculate(*F);
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE;) {
+
+      Instruction* I = II++;
+
+      if(I->mayHaveSideEffects() || GlobalIHP->committedHeapAllocations.count(I) || GlobalIHP->committedFDs.count(I))
+	continue;
+
+      // Placeholders still awaiting patchReferences must survive until fixNonLocalUses fills them in,
+      // and their users mustn't be folded on the strength of the placeholder's undef arms.
+      if(isPendingPatchTargetOrUser(I))
+	continue;
+
+      if(Value* V = SimplifyInstruction(I, GlobalTD, GlobalTLI, &DT)) {
+
+	I->replaceAllUsesWith(V);
+	I->eraseFromParent();
+	changed = true;
+
+      }
+
+    }
+
+  }
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    // Leave dead conditions for the trivially-dead sweep, which knows not to delete committed allocations.
+    if(ConstantFoldTerminator(BI, false, GlobalTLI))
+      changed = true;
+
+  }
+
+  return changed;
+
+}
+
+// Delete blocks no longer reachable from the entry block, keeping firstFailedBlock pointing
+// at the first surviving failed block.
+static uint32_t removeUnreachableResidualBlocks(Function* F, Function::iterator& firstFailedBlock) {
+
+  SmallPtrSet<BasicBlock*, 32> Reachable;
+  std::vector<BasicBlock*> Worklist;
+  Worklist.push_back(&F->getEntryBlock());
+  Reachable.insert(&F->getEntryBlock());
+
+  while(!Worklist.empty()) {
+
+    BasicBlock* BB = Worklist.back();
+    Worklist.pop_back();
+
+    TerminatorInst* TI = BB->getTerminator();
+    for(uint32_t i = 0, ilim = TI->getNumSuccessors(); i != ilim; ++i) {
+      if(Reachable.insert(TI->getSuccessor(i)))
+	Worklist.push_back(TI->getSuccessor(i));
+    }
+
+  }
+
+  std::vector<BasicBlock*> Dead;
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+    if(!Reachable.count(BI))
+      Dead.push_back(BI);
+  }
+
+  if(Dead.empty())
+    return 0;
+
+  for(std::vector<BasicBlock*>::iterator it = Dead.begin(), itend = Dead.end(); it != itend; ++it) {
+
+    BasicBlock* BB = *it;
+    TerminatorInst* TI = BB->getTerminator();
+    for(uint32_t i = 0, ilim = TI->getNumSuccessors(); i != ilim; ++i) {
+      if(Reachable.count(TI->getSuccessor(i)))
+	TI->getSuccessor(i)->removePredecessor(BB);
+    }
+
+    unregisterCommittedAllocations(BB);
+    BB->dropAllReferences();
+
+  }
+
+  while(firstFailedBlock != F->end() && !Reachable.count(firstFailedBlock))
+    ++firstFailedBlock;
+
+  for(std::vector<BasicBlock*>::iterator it = Dead.begin(), itend = Dead.end(); it != itend; ++it)
+    (*it)->eraseFromParent();
+
+  return Dead.size();
+
+}
+
+static void simplifyResidualFunction(Function* F, Function::iterator& firstFailedBlock) {
+
+  // Contexts that are not yet fully committed may leave blocks unterminated.
+  for(Function::iterator it = F->begin(), itend = F->end(); it != itend; ++it) {
+    if(!it->getTerminator())
+      return;
+  }
+
+  foldSmallConstantMemcpys(F);
+
+  // Drop unreachable blocks before each round, as instruction simplification
+  // can misbehave on the self-referential code they may contain.
+  do {
+    removeUnreachableResidualBlocks(F, firstFailedBlock);
+  } while(simplifyResidualInstructions(F));
+
+}
+
 // Main post-commit optimisation entry point. I'm not totally certain, but I think optimising a basic-block list that
 // hasn't been inserted into a residual function yet has been disabled because some LLVM core functions fail if
 // BB->getParent() is null. Such blocks will be treated once they've been assigned a final function; trying to do them
@@ -251,7 +610,15 @@ void InlineAttempt::postCommitOptimise() {
     return;
 
   if(CommitF) {
+
+    if(!KeepRedundantChecks)
+      elimRedundantChecks(CommitF);
     
+    // Only clean up whole functions: if we share our parent's function its other blocks
+    // aren't yet linked up, so they'd look unreachable.
+    if(commitsOutOfLine())
+      simplifyResidualFunction(CommitF, firstFailedBlock);
+
     PCOFunctionCB CB;
     postCommitOptimiseBlocks(CommitF->begin(), CommitF->end(), CB, firstFailedBlock);
 
@@ -293,3 +660,175 @@ void InlineAttempt::postCommitOptimise() {
   }
    
 }
+
+// Merging of identical residual functions. Without function sharing, a function specialised the same way
+// in several call contexts is committed once per context; if those copies were split off into their own
+// residual functions they can be spotted and all callers pointed at a single copy.
+
+// Hash only the shape of a function (types and opcodes), not its operands, so that functions which only
+// differ in which of two identical callees they use land in the same bucket and can be merged on a later round.
+static hash_code hashFunctionShape(Function* F) {
+
+  hash_code H = hash_combine(F->getFunctionType(), F->size());
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    H = hash_combine(H, BI->size());
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II)
+      H = hash_combine(H, II->getOpcode(), II->getType(), II->getNumOperands());
+
+  }
+
+  return H;
+
+}
+
+// Return true if A and B are structurally identical: instructions match pairwise, and each operand
+// is either the corresponding local value (argument, block or instruction) or exactly the same
+// global, constant or other non-local value.
+static bool functionsIdentical(Function* A, Function* B) {
+
+  if(A->getFunctionType() != B->getFunctionType() ||
+     A->getAttributes() != B->getAttributes() ||
+     A->getCallingConv() != B->getCallingConv() ||
+     A->getAlignment() != B->getAlignment() ||
+     A->hasGC() != B->hasGC() || (A->hasGC() && A->getGC() != B->getGC()) ||
+     A->getSection() != B->getSection() ||
+     A->size() != B->size())
+    return false;
+
+  DenseMap<Value*, Value*> LocalMap;
+  LocalMap[A] = B;
+
+  for(Function::arg_iterator AI = A->arg_begin(), AE = A->arg_end(), BI = B->arg_begin(); AI != AE; ++AI, ++BI)
+    LocalMap[AI] = BI;
+
+  // Map all blocks and instructions first, as operands may refer forwards.
+  for(Function::iterator ABI = A->begin(), ABE = A->end(), BBI = B->begin(); ABI != ABE; ++ABI, ++BBI) {
+
+    if(ABI->size() != BBI->size())
+      return false;
+
+    LocalMap[ABI] = BBI;
+
+    for(BasicBlock::iterator AII = ABI->begin(), AIE = ABI->end(), BII = BBI->begin(); AII != AIE; ++AII, ++BII)
+      LocalMap[AII] = BII;
+
+  }
+
+  for(Function::iterator ABI = A->begin(), ABE = A->end(), BBI = B->begin(); ABI != ABE; ++ABI, ++BBI) {
+
+    for(BasicBlock::iterator AII = ABI->begin(), AIE = ABI->end(), BII = BBI->begin(); AII != AIE; ++AII, ++BII) {
+
+      Instruction* AInst = AII;
+      Instruction* BInst = BII;
+
+      if(!AInst->isSameOperationAs(BInst))
+	return false;
+
+      for(uint32_t i = 0, ilim = AInst->getNumOperands(); i != ilim; ++i) {
+
+	Value* AOp = AInst->getOperand(i);
+	Value* BOp = BInst->getOperand(i);
+
+	DenseMap<Value*, Value*>::iterator findit = LocalMap.find(AOp);
+	if(findit != LocalMap.end()) {
+	  if(findit->second != BOp)
+	    return false;
+	}
+	else if(AOp != BOp)
+	  return false;
+
+      }
+
+      // Phi incoming blocks are not ordinary operands.
+      if(PHINode* APN = dyn_cast<PHINode>(AInst)) {
+
+	PHINode* BPN = cast<PHINode>(BInst);
+	for(uint32_t i = 0, ilim = APN->getNumIncomingValues(); i != ilim; ++i) {
+	  if(LocalMap[APN->getIncomingBlock(i)] != BPN->getIncomingBlock(i))
+	    return false;
+	}
+
+      }
+
+    }
+
+  }
+
+  return true;
+
+}
+
+// Merge structurally identical residual functions, redirecting callers of the duplicates to a single
+// survivor. Only internal functions are candidates; the specialised root function keeps its identity.
+// Repeat until nothing changes, since merging callees may make their callers identical.
+void LLPEAnalysisPass::mergeIdenticalCommitFunctions() {
+
+  if(NoMergeFunctions || SkipPostCommit)
+    return;
+
+  uint32_t merged = 0;
+  bool changed = true;
+
+  while(changed) {
+
+    changed = false;
+
+    std::map<size_t, std::vector<Function*> > Buckets;
+
+    for(SmallVector<Function*, 4>::iterator it = commitFunctions.begin(),
+	  itend = commitFunctions.end(); it != itend; ++it) {
+
+      Function* F = *it;
+      if(F == RootIA->CommitF || !F->hasLocalLinkage() || F->isDeclaration())
+	continue;
+
+      Buckets[hashFunctionShape(F)].push_back(F);
+
+    }
+
+    SmallPtrSet<Function*, 8> Dead;
+
+    for(std::map<size_t, std::vector<Function*> >::iterator it = Buckets.begin(),
+	  itend = Buckets.end(); it != itend; ++it) {
+
+      std::vector<Function*>& Fs = it->second;
+
+      for(uint32_t i = 0, ilim = Fs.size(); i != ilim; ++i) {
+
+	if(Dead.count(Fs[i]))
+	  continue;
+
+	for(uint32_t j = i + 1; j != ilim; ++j) {
+
+	  if(Dead.count(Fs[j]) || !functionsIdentical(Fs[i], Fs[j]))
+	    continue;
+
+	  Fs[j]->replaceAllUsesWith(Fs[i]);
+	  Dead.insert(Fs[j]);
+
+	}
+
+      }
+
+    }
+
+    for(SmallPtrSet<Function*, 8>::iterator it = Dead.begin(), itend = Dead.end(); it != itend; ++it) {
+
+      Function* F = *it;
+      unregisterCommittedAllocations(F);
+      commitFunctions.erase(std::find(commitFunctions.begin(), commitFunctions.end(), F));
+      F->dropAllReferences();
+      F->eraseFromParent();
+      ++merged;
+      changed = true;
+
+    }
+
+  }
+
+  if(merged)
+    errs() << "Merged " << merged << " identical residual functions\n";
+
+}
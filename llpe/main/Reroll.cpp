@@ -0,0 +1,930 @@
+//===-- Reroll.cpp --------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Commit-time loop rerolling. A completely peeled loop frequently produces long runs
+// of iterations whose residual code is identical but for which iteration it refers to:
+// iteration k uses values computed by iteration k - 1, constants that step by a fixed
+// amount each time round, and branches on to the header of iteration k + 1.
+// Where the benefit model agrees that the code saved outweighs the cost of the loop
+// overhead, keep only the first iteration of such a run and wrap it in a counted loop.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+
+using namespace llvm;
+
+static cl::opt<bool> NoReroll("llpe-no-reroll");
+extern cl::opt<bool> VerboseNames;
+
+namespace {
+
+  // How an operand varies over the iterations of a run:
+  enum RerollSlotKind {
+
+    RSK_LOCAL,       // Refers to the same iteration's block or instruction at 'pos'
+    RSK_INVARIANT,   // The same value 'V', defined outside the run, throughout
+    RSK_CARRIED,     // 'V' in the first iteration, then the previous iteration's value at 'pos'
+    RSK_NEXT,        // The next iteration's header; 'V' (outside the run) for the last iteration
+    RSK_STRIDED,     // ConstantInt 'V', increasing by 'step' each iteration
+    RSK_STRIDED_GEP  // Constant GEP 'V' whose index operand 'gepOp' increases by 'step'
+
+  };
+
+  struct RerollSlot {
+
+    RerollSlotKind kind;
+    Value* V;
+    uint32_t pos;
+    ConstantInt* step;
+    uint32_t gepOp;
+
+  RerollSlot() : kind(RSK_INVARIANT), V(0), pos(0), step(0), gepOp(0) {}
+
+  };
+
+  // The committed code for one iteration, in the order it was created.
+  // Blocks are numbered 0 .. blocks.size() - 1 and instructions from blocks.size() onwards.
+  struct RerollIter {
+
+    std::vector<BasicBlock*> blocks;
+    std::vector<Instruction*> insts;
+
+    Value* getAt(uint32_t pos) {
+      if(pos < blocks.size())
+	return blocks[pos];
+      return insts[pos - blocks.size()];
+    }
+
+  };
+
+  struct RerollInstSlots {
+
+    SmallVector<RerollSlot, 4> ops;
+    SmallVector<RerollSlot, 2> incomingBlocks; // PHIs only
+
+  };
+
+  typedef DenseMap<Value*, std::pair<uint32_t, uint32_t> > RerollPosMap;
+
+  struct RerollRun {
+
+    std::vector<RerollIter>& Iters;
+    RerollPosMap& Positions;
+    uint32_t first;
+    uint32_t last;
+
+  RerollRun(std::vector<RerollIter>& I, RerollPosMap& P, uint32_t f, uint32_t l) : Iters(I), Positions(P), first(f), last(l) {}
+
+    bool lookup(Value* V, uint32_t& iter, uint32_t& pos) {
+
+      RerollPosMap::iterator findit = Positions.find(V);
+      if(findit == Positions.end())
+	return false;
+      iter = findit->second.first;
+      pos = findit->second.second;
+      return true;
+
+    }
+
+    bool inRun(Value* V) {
+
+      uint32_t iter, pos;
+      return lookup(V, iter, pos) && iter >= first && iter <= last;
+
+    }
+
+    bool isAt(Value* V, uint32_t iter, uint32_t pos) {
+
+      uint32_t foundIter, foundPos;
+      return lookup(V, foundIter, foundPos) && foundIter == iter && foundPos == pos;
+
+    }
+
+  };
+
+}
+
+// Collect the committed blocks and instructions of iteration It, or return false if it
+// can't take part in rerolling: it must have no specialised children committed within
+// it, no break blocks (which are placed with the failed blocks rather than alongside
+// the specialised code), and define no allocations or FDs, whose committed values
+// other contexts may still refer to.
+static bool getRerollView(PeelIteration* It, Function* CF, RerollIter& Out) {
+
+  if(!It->BBs[0])
+    return false;
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = It->peelChildren.begin(),
+	itend = It->peelChildren.end(); it != itend; ++it) {
+
+    if(it->second->isEnabled() && it->second->isTerminated())
+      return false;
+
+  }
+
+  for(uint32_t i = 0; i < It->nBBs; ++i) {
+
+    ShadowBB* BB = It->BBs[i];
+    if(!BB)
+      continue;
+
+    if(BB->committedBlocks.empty())
+      return false;
+
+    for(SmallVector<CommittedBlock, 1>::iterator it = BB->committedBlocks.begin(),
+	  itend = BB->committedBlocks.end(); it != itend; ++it) {
+
+      if(it->specBlock != it->breakBlock || it->specBlock->getParent() != CF)
+	return false;
+      Out.blocks.push_back(it->specBlock);
+
+    }
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      InlineAttempt* IA = It->getInlineAttempt(&BB->insts[j]);
+      if(IA && IA->isEnabled() && !IA->commitsOutOfLine())
+	return false;
+
+    }
+
+  }
+
+  for(std::vector<BasicBlock*>::iterator it = Out.blocks.begin(), itend = Out.blocks.end(); it != itend; ++it) {
+
+    if(!(*it)->getTerminator())
+      return false;
+
+    for(BasicBlock::iterator BI = (*it)->begin(), BE = (*it)->end(); BI != BE; ++BI) {
+
+      Instruction* I = BI;
+      if(isa<AllocaInst>(I) ||
+	 GlobalIHP->committedHeapAllocations.count(I) ||
+	 GlobalIHP->committedFDs.count(I) ||
+	 GlobalIHP->pendingPatchTargets.count(I))
+	return false;
+      Out.insts.push_back(I);
+
+    }
+
+  }
+
+  return true;
+
+}
+
+static bool rerollStructureMatches(RerollIter& A, RerollIter& B) {
+
+  if(A.blocks.size() != B.blocks.size() || A.insts.size() != B.insts.size())
+    return false;
+
+  for(uint32_t i = 0, ilim = A.blocks.size(); i != ilim; ++i) {
+    if(A.blocks[i]->size() != B.blocks[i]->size())
+      return false;
+  }
+
+  for(uint32_t i = 0, ilim = A.insts.size(); i != ilim; ++i) {
+    if(!A.insts[i]->isSameOperationAs(B.insts[i]))
+      return false;
+  }
+
+  return true;
+
+}
+
+static bool getIntStride(ArrayRef<Value*> Vals, ConstantInt*& Step) {
+
+  ConstantInt* C0 = dyn_cast<ConstantInt>(Vals[0]);
+  ConstantInt* C1 = dyn_cast<ConstantInt>(Vals[1]);
+  if(!(C0 && C1 && C0->getType() == C1->getType()))
+    return false;
+
+  APInt StepVal = C1->getValue() - C0->getValue();
+  if(!StepVal)
+    return false;
+
+  APInt Expect = C1->getValue();
+  for(uint32_t k = 2, klim = Vals.size(); k != klim; ++k) {
+
+    Expect += StepVal;
+    ConstantInt* Ck = dyn_cast<ConstantInt>(Vals[k]);
+    if((!Ck) || Ck->getType() != C0->getType() || Ck->getValue() != Expect)
+      return false;
+
+  }
+
+  Step = ConstantInt::get(C0->getContext(), StepVal);
+  return true;
+
+}
+
+// Vals gives an operand's value in each iteration of the run, in order.
+static bool classifyRerollSlot(RerollRun& R, ArrayRef<Value*> Vals, RerollSlot& Out) {
+
+  uint32_t n = Vals.size();
+  uint32_t iter, pos;
+
+  bool allSame = true;
+  for(uint32_t k = 1; k != n && allSame; ++k)
+    allSame = Vals[k] == Vals[0];
+
+  if(allSame) {
+
+    // Every iteration referring to one iteration's value can't be expressed in a loop.
+    if(R.inRun(Vals[0]))
+      return false;
+    Out.kind = RSK_INVARIANT;
+    Out.V = Vals[0];
+    return true;
+
+  }
+
+  if(R.lookup(Vals[0], iter, pos) && iter == R.first) {
+
+    bool isLocal = true;
+    for(uint32_t k = 1; k != n && isLocal; ++k)
+      isLocal = R.isAt(Vals[k], R.first + k, pos);
+
+    if(isLocal) {
+      Out.kind = RSK_LOCAL;
+      Out.pos = pos;
+      return true;
+    }
+
+  }
+
+  if((!R.inRun(Vals[0])) && R.lookup(Vals[1], iter, pos) && iter == R.first) {
+
+    bool isCarried = true;
+    for(uint32_t k = 2; k != n && isCarried; ++k)
+      isCarried = R.isAt(Vals[k], R.first + k - 1, pos);
+
+    if(isCarried) {
+      Out.kind = RSK_CARRIED;
+      Out.V = Vals[0];
+      Out.pos = pos;
+      return true;
+    }
+
+  }
+
+  if(isa<BasicBlock>(Vals[n - 1]) && !R.inRun(Vals[n - 1])) {
+
+    bool isNext = true;
+    for(uint32_t k = 0; k != n - 1 && isNext; ++k)
+      isNext = R.isAt(Vals[k], R.first + k + 1, 0);
+
+    if(isNext) {
+      Out.kind = RSK_NEXT;
+      Out.V = Vals[n - 1];
+      return true;
+    }
+
+  }
+
+  if(getIntStride(Vals, Out.step)) {
+
+    Out.kind = RSK_STRIDED;
+    Out.V = Vals[0];
+    return true;
+
+  }
+
+  // Constant GEPs that differ only in one strided index, e.g. &a[0], &a[1], ...
+  ConstantExpr* CE0 = dyn_cast<ConstantExpr>(Vals[0]);
+  if(!(CE0 && CE0->getOpcode() == Instruction::GetElementPtr))
+    return false;
+
+  for(uint32_t k = 1; k != n; ++k) {
+
+    ConstantExpr* CEk = dyn_cast<ConstantExpr>(Vals[k]);
+    if((!CEk) || CEk->getOpcode() != Instruction::GetElementPtr ||
+       CEk->getNumOperands() != CE0->getNumOperands() ||
+       cast<GEPOperator>(CEk)->isInBounds() != cast<GEPOperator>(CE0)->isInBounds())
+      return false;
+
+  }
+
+  uint32_t varyingOp = 0;
+  for(uint32_t i = 0, ilim = CE0->getNumOperands(); i != ilim; ++i) {
+
+    bool same = true;
+    for(uint32_t k = 1; k != n && same; ++k)
+      same = cast<ConstantExpr>(Vals[k])->getOperand(i) == CE0->getOperand(i);
+
+    if(same)
+      continue;
+    if(i == 0 || varyingOp)
+      return false;
+    varyingOp = i;
+
+  }
+
+  if(!varyingOp)
+    return false;
+
+  SmallVector<Value*, 8> Idxs;
+  for(uint32_t k = 0; k != n; ++k)
+    Idxs.push_back(cast<ConstantExpr>(Vals[k])->getOperand(varyingOp));
+
+  if(!getIntStride(Idxs, Out.step))
+    return false;
+
+  Out.kind = RSK_STRIDED_GEP;
+  Out.V = CE0;
+  Out.gepOp = varyingOp;
+  return true;
+
+}
+
+namespace {
+
+  // Builds the loop around the first iteration of a run, creating induction variables
+  // and carried-value PHIs in its header as they're needed.
+  struct RerollBuilder {
+
+    RerollIter& A;
+    BasicBlock* Header;
+    BasicBlock* Latch;
+    SmallVector<BasicBlock*, 4> Preheaders;
+
+    struct IV {
+      ConstantInt* start;
+      ConstantInt* step;
+      PHINode* phi;
+      Instruction* next;
+    };
+
+    std::vector<IV> IVs;
+    DenseMap<std::pair<Value*, uint32_t>, PHINode*> CarriedPHIs;
+
+  RerollBuilder(RerollIter& _A, BasicBlock* _Latch) : A(_A), Header(_A.blocks[0]), Latch(_Latch),
+      Preheaders(pred_begin(Header), pred_end(Header)) {}
+
+    PHINode* createHeaderPHI(Type* Ty, Value* entryVal) {
+
+      PHINode* PN = PHINode::Create(Ty, Preheaders.size() + 1, "", Header->begin());
+      for(SmallVector<BasicBlock*, 4>::iterator it = Preheaders.begin(), itend = Preheaders.end(); it != itend; ++it)
+	PN->addIncoming(entryVal, *it);
+      return PN;
+
+    }
+
+    IV& getIV(ConstantInt* start, ConstantInt* step) {
+
+      for(std::vector<IV>::iterator it = IVs.begin(), itend = IVs.end(); it != itend; ++it) {
+	if(it->start == start && it->step == step)
+	  return *it;
+      }
+
+      IV NewIV;
+      NewIV.start = start;
+      NewIV.step = step;
+      NewIV.phi = createHeaderPHI(start->getType(), start);
+      NewIV.next = BinaryOperator::CreateAdd(NewIV.phi, step, "", Latch);
+      NewIV.phi->addIncoming(NewIV.next, Latch);
+      IVs.push_back(NewIV);
+      return IVs.back();
+
+    }
+
+    Value* getCarried(Value* init, uint32_t pos) {
+
+      PHINode*& PN = CarriedPHIs[std::make_pair(init, pos)];
+      if(!PN) {
+	Value* V = A.getAt(pos);
+	PN = createHeaderPHI(V->getType(), init);
+	PN->addIncoming(V, Latch);
+      }
+      return PN;
+
+    }
+
+    Instruction* createGEP(RerollSlot& S, Value* Idx, Instruction* insertBefore, BasicBlock* insertAtEnd) {
+
+      ConstantExpr* CE = cast<ConstantExpr>(S.V);
+      SmallVector<Value*, 4> Idxs;
+      for(uint32_t i = 1, ilim = CE->getNumOperands(); i != ilim; ++i)
+	Idxs.push_back(i == S.gepOp ? Idx : CE->getOperand(i));
+
+      GetElementPtrInst* GEP;
+      if(insertBefore)
+	GEP = GetElementPtrInst::Create(CE->getOperand(0), Idxs, "", insertBefore);
+      else
+	GEP = GetElementPtrInst::Create(CE->getOperand(0), Idxs, "", insertAtEnd);
+      GEP->setIsInBounds(cast<GEPOperator>(CE)->isInBounds());
+      return GEP;
+
+    }
+
+    // Get a value usable anywhere in the loop body equal to S in the current iteration.
+    Value* materialise(RerollSlot& S) {
+
+      switch(S.kind) {
+      case RSK_LOCAL:
+	return A.getAt(S.pos);
+      case RSK_INVARIANT:
+	return S.V;
+      case RSK_CARRIED:
+	return getCarried(S.V, S.pos);
+      case RSK_STRIDED:
+	return getIV(cast<ConstantInt>(S.V), S.step).phi;
+      case RSK_STRIDED_GEP:
+	{
+	  ConstantInt* start = cast<ConstantInt>(cast<ConstantExpr>(S.V)->getOperand(S.gepOp));
+	  PHINode* Idx = getIV(start, S.step).phi;
+	  return createGEP(S, Idx, Header->getFirstNonPHI(), 0);
+	}
+      default:
+	release_assert(0 && "Can't materialise a next-iteration slot");
+	return 0;
+      }
+
+    }
+
+    // Get a value available in the latch equal to S in the next iteration.
+    Value* materialiseNext(RerollSlot& S) {
+
+      switch(S.kind) {
+      case RSK_INVARIANT:
+	return S.V;
+      case RSK_CARRIED:
+	return A.getAt(S.pos);
+      case RSK_STRIDED:
+	return getIV(cast<ConstantInt>(S.V), S.step).next;
+      case RSK_STRIDED_GEP:
+	{
+	  ConstantInt* start = cast<ConstantInt>(cast<ConstantExpr>(S.V)->getOperand(S.gepOp));
+	  Instruction* Idx = getIV(start, S.step).next;
+	  return createGEP(S, Idx, 0, Latch);
+	}
+      default:
+	release_assert(0 && "Bad slot for a loop-carried value");
+	return 0;
+      }
+
+    }
+
+  };
+
+  struct MergedPHI {
+
+    PHINode* PN;
+    uint32_t pos;
+    RerollSlot slot;
+
+  };
+
+}
+
+// Try to replace iterations [first, last] with a loop around iteration 'first'.
+// Returns true if the code was changed.
+static bool tryRerollRun(PeelAttempt* PA, std::vector<RerollIter>& Iters, RerollPosMap& Positions, uint32_t first, uint32_t last) {
+
+  RerollRun R(Iters, Positions, first, last);
+  RerollIter& A = Iters[first];
+  uint32_t nBlocks = A.blocks.size();
+  uint32_t nIters = (last - first) + 1;
+
+  // Classify every operand of the run's instructions, including PHI incoming blocks.
+  std::vector<RerollInstSlots> Slots(A.insts.size());
+  SmallVector<Value*, 16> Vals;
+  int64_t nextInst = -1;
+  uint32_t nNewValues = 0;
+
+  for(uint32_t j = 0, jlim = A.insts.size(); j != jlim; ++j) {
+
+    Instruction* I = A.insts[j];
+    bool isTerm = isa<TerminatorInst>(I);
+
+    for(uint32_t o = 0, olim = I->getNumOperands(); o != olim; ++o) {
+
+      Vals.clear();
+      for(uint32_t k = first; k <= last; ++k)
+	Vals.push_back(Iters[k].insts[j]->getOperand(o));
+
+      RerollSlot S;
+      if(!classifyRerollSlot(R, Vals, S))
+	return false;
+
+      if(S.kind == RSK_NEXT) {
+
+	// Only a single back edge is supported.
+	if(nextInst != -1 || !isTerm)
+	  return false;
+	nextInst = j;
+
+      }
+      else if(isa<BasicBlock>(I->getOperand(o))) {
+
+	// Successors must be within the same iteration, but not its header, or outside the run.
+	if(S.kind == RSK_LOCAL ? S.pos == 0 : S.kind != RSK_INVARIANT)
+	  return false;
+
+      }
+      else if(S.kind != RSK_LOCAL && S.kind != RSK_INVARIANT)
+	++nNewValues;
+
+      Slots[j].ops.push_back(S);
+
+    }
+
+    if(PHINode* PN = dyn_cast<PHINode>(I)) {
+
+      for(uint32_t o = 0, olim = PN->getNumIncomingValues(); o != olim; ++o) {
+
+	Vals.clear();
+	for(uint32_t k = first; k <= last; ++k)
+	  Vals.push_back(cast<PHINode>(Iters[k].insts[j])->getIncomingBlock(o));
+
+	RerollSlot S;
+	if(!classifyRerollSlot(R, Vals, S))
+	  return false;
+	if(S.kind != RSK_LOCAL && S.kind != RSK_INVARIANT && S.kind != RSK_CARRIED)
+	  return false;
+
+	Slots[j].incomingBlocks.push_back(S);
+
+      }
+
+    }
+
+  }
+
+  if(nextInst == -1)
+    return false;
+
+  uint32_t iter, latchPos;
+  R.lookup(A.insts[nextInst]->getParent(), iter, latchPos);
+  BasicBlock* Final = 0;
+  for(uint32_t o = 0, olim = Slots[nextInst].ops.size(); o != olim; ++o) {
+    if(Slots[nextInst].ops[o].kind == RSK_NEXT)
+      Final = cast<BasicBlock>(Slots[nextInst].ops[o].V);
+  }
+
+  // A carried incoming block is the header's back edge: it must come from the block that
+  // branches to the next iteration, and the value must be expressible from the latch.
+  for(uint32_t j = 0, jlim = A.insts.size(); j != jlim; ++j) {
+
+    for(uint32_t o = 0, olim = Slots[j].incomingBlocks.size(); o != olim; ++o) {
+
+      if(Slots[j].incomingBlocks[o].kind != RSK_CARRIED)
+	continue;
+      if(Slots[j].incomingBlocks[o].pos != latchPos || A.insts[j]->getParent() != A.blocks[0])
+	return false;
+      if(Slots[j].ops[o].kind == RSK_LOCAL)
+	return false;
+
+    }
+
+  }
+
+  // Only the first header may be entered from outside the run; all other edges into
+  // run blocks have been classified above.
+  for(uint32_t k = first; k <= last; ++k) {
+
+    for(uint32_t b = 0; b != nBlocks; ++b) {
+
+      BasicBlock* BB = Iters[k].blocks[b];
+      for(Value::user_iterator UI = BB->user_begin(), UE = BB->user_end(); UI != UE; ++UI) {
+
+	Instruction* UseI = dyn_cast<Instruction>(*UI);
+	if(!UseI)
+	  return false;
+	if(R.inRun(UseI->getParent()))
+	  continue;
+	if(k == first && b == 0 && isa<TerminatorInst>(UseI))
+	  continue;
+	return false;
+
+      }
+
+    }
+
+  }
+
+  // Uses of the run's values elsewhere: after rerolling, the first iteration's instructions
+  // hold the last iteration's values on exit from the loop.
+  std::vector<std::pair<Use*, uint32_t> > ExitUses;
+
+  for(uint32_t k = first; k <= last; ++k) {
+
+    for(uint32_t j = 0, jlim = A.insts.size(); j != jlim; ++j) {
+
+      Instruction* I = Iters[k].insts[j];
+      for(Value::use_iterator UI = I->use_begin(), UE = I->use_end(); UI != UE; ++UI) {
+
+	Use& U = *UI;
+	Instruction* UseI = dyn_cast<Instruction>(U.getUser());
+	if(!UseI)
+	  return false;
+	if(R.inRun(UseI->getParent()))
+	  continue;
+	if(PHINode* PN = dyn_cast<PHINode>(UseI)) {
+	  if(R.inRun(PN->getIncomingBlock(U)))
+	    continue;
+	}
+	if(k != last)
+	  return false;
+	ExitUses.push_back(std::make_pair(&U, j));
+
+      }
+
+    }
+
+  }
+
+  // PHIs outside the run with incoming edges from it. Edges that leave every iteration from
+  // the same place merge into one; the exit to Final comes from the new latch.
+  SmallPtrSet<BasicBlock*, 8> OutSuccs;
+  for(uint32_t k = first; k <= last; ++k) {
+    for(uint32_t b = 0; b != nBlocks; ++b) {
+      TerminatorInst* TI = Iters[k].blocks[b]->getTerminator();
+      for(uint32_t s = 0, slim = TI->getNumSuccessors(); s != slim; ++s) {
+	if(!R.inRun(TI->getSuccessor(s)))
+	  OutSuccs.insert(TI->getSuccessor(s));
+      }
+    }
+  }
+
+  std::vector<MergedPHI> MergedPHIs;
+  std::vector<PHINode*> FinalPHIs;
+
+  for(SmallPtrSet<BasicBlock*, 8>::iterator it = OutSuccs.begin(), itend = OutSuccs.end(); it != itend; ++it) {
+
+    BasicBlock* S = *it;
+    for(BasicBlock::iterator BI = S->begin(), BE = S->end(); BI != BE && isa<PHINode>(BI); ++BI) {
+
+      PHINode* PN = cast<PHINode>(BI);
+      SmallVector<Value*, 16> PHIVals(nIters, (Value*)0);
+      uint32_t nRunEntries = 0;
+      uint32_t entryIter = 0, entryPos = 0;
+      bool samePos = true;
+
+      for(uint32_t o = 0, olim = PN->getNumIncomingValues(); o != olim; ++o) {
+
+	uint32_t thisIter, thisPos;
+	if(!(R.lookup(PN->getIncomingBlock(o), thisIter, thisPos) && thisIter >= first && thisIter <= last))
+	  continue;
+
+	if(nRunEntries && thisPos != entryPos)
+	  samePos = false;
+	entryIter = thisIter;
+	entryPos = thisPos;
+	++nRunEntries;
+
+	if(PHIVals[thisIter - first])
+	  return false;
+	PHIVals[thisIter - first] = PN->getIncomingValue(o);
+
+      }
+
+      if(S == Final) {
+
+	if(nRunEntries != 1 || entryIter != last || entryPos != latchPos)
+	  return false;
+	uint32_t valIter, valPos;
+	if(R.lookup(PHIVals[nIters - 1], valIter, valPos) && valIter >= first && valIter < last)
+	  return false;
+	FinalPHIs.push_back(PN);
+
+      }
+      else {
+
+	if(nRunEntries != nIters || !samePos)
+	  return false;
+
+	MergedPHI M;
+	M.PN = PN;
+	M.pos = entryPos;
+	if(!classifyRerollSlot(R, PHIVals, M.slot) || M.slot.kind == RSK_NEXT)
+	  return false;
+	if(M.slot.kind != RSK_LOCAL && M.slot.kind != RSK_INVARIANT)
+	  ++nNewValues;
+	MergedPHIs.push_back(M);
+
+      }
+
+    }
+
+  }
+
+  // Latch add, compare and branch plus the counter PHI, and roughly one instruction
+  // per loop-carried value or induction variable.
+  if(!PA->rerollIsProfitable(nIters, A.insts.size(), 4 + nNewValues))
+    return false;
+
+  // Committed to rerolling from here on.
+
+  Function* CF = A.blocks[0]->getParent();
+  LLVMContext& Ctx = CF->getContext();
+  BasicBlock* Latch = PA->Iterations[first]->createBasicBlock(Ctx, VerboseNames ? "reroll.latch" : "", CF, false, false);
+  RerollBuilder Builder(A, Latch);
+  std::vector<std::pair<PHINode*, Value*> > LatchEntries;
+
+  for(uint32_t j = 0, jlim = A.insts.size(); j != jlim; ++j) {
+
+    Instruction* I = A.insts[j];
+    PHINode* PN = dyn_cast<PHINode>(I);
+
+    for(uint32_t o = 0, olim = Slots[j].ops.size(); o != olim; ++o) {
+
+      RerollSlot& S = Slots[j].ops[o];
+
+      if(PN && Slots[j].incomingBlocks[o].kind == RSK_CARRIED) {
+
+	// The entry edge keeps its value; add the back edge.
+	LatchEntries.push_back(std::make_pair(PN, Builder.materialiseNext(S)));
+	continue;
+
+      }
+
+      if(S.kind == RSK_NEXT)
+	I->setOperand(o, Latch);
+      else if(S.kind != RSK_LOCAL && S.kind != RSK_INVARIANT)
+	I->setOperand(o, Builder.materialise(S));
+
+    }
+
+  }
+
+  // Exit uses must be redirected before PHI entries are removed below, which moves Uses about.
+  for(std::vector<std::pair<Use*, uint32_t> >::iterator it = ExitUses.begin(), itend = ExitUses.end(); it != itend; ++it)
+    it->first->set(A.insts[it->second]);
+
+  for(std::vector<MergedPHI>::iterator it = MergedPHIs.begin(), itend = MergedPHIs.end(); it != itend; ++it) {
+
+    Value* V = Builder.materialise(it->slot);
+    for(uint32_t k = first + 1; k <= last; ++k)
+      it->PN->removeIncomingValue(Iters[k].blocks[it->pos], false);
+    it->PN->setIncomingValue(it->PN->getBasicBlockIndex(A.blocks[it->pos]), V);
+
+  }
+
+  for(std::vector<PHINode*>::iterator it = FinalPHIs.begin(), itend = FinalPHIs.end(); it != itend; ++it) {
+
+    PHINode* PN = *it;
+    int idx = PN->getBasicBlockIndex(Iters[last].blocks[latchPos]);
+    Value* V = PN->getIncomingValue(idx);
+    uint32_t valIter, valPos;
+    if(R.lookup(V, valIter, valPos) && valIter >= first && valIter <= last)
+      V = A.getAt(valPos);
+    PN->setIncomingValue(idx, V);
+    PN->setIncomingBlock(idx, Latch);
+
+  }
+
+  Type* CountTy = Type::getInt32Ty(Ctx);
+  PHINode* Counter = Builder.createHeaderPHI(CountTy, ConstantInt::get(CountTy, 0));
+  for(std::vector<std::pair<PHINode*, Value*> >::iterator it = LatchEntries.begin(), itend = LatchEntries.end(); it != itend; ++it)
+    it->first->addIncoming(it->second, Latch);
+
+  Instruction* CounterNext = BinaryOperator::CreateAdd(Counter, ConstantInt::get(CountTy, 1), "", Latch);
+  Counter->addIncoming(CounterNext, Latch);
+  Value* More = new ICmpInst(*Latch, CmpInst::ICMP_ULT, CounterNext, ConstantInt::get(CountTy, nIters));
+  BranchInst::Create(A.blocks[0], Final, More, Latch);
+
+  // Delete the now-redundant iterations. Their stores are now performed by the loop body,
+  // so the copies kept must not be eliminated by DSE later.
+  for(uint32_t k = first; k <= last; ++k) {
+
+    PeelIteration* It = PA->Iterations[k];
+    for(uint32_t i = 0; i < It->nBBs; ++i) {
+
+      ShadowBB* BB = It->BBs[i];
+      if(!BB)
+	continue;
+
+      for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+	ShadowInstruction* SI = &BB->insts[j];
+	DenseMap<ShadowInstruction*, TrackedStore*>::iterator findit = GlobalIHP->trackedStores.find(SI);
+	if(findit != GlobalIHP->trackedStores.end())
+	  findit->second->isNeeded = true;
+	if(k != first)
+	  SI->committedVal = 0;
+
+      }
+
+      if(k != first)
+	BB->committedBlocks.clear();
+
+    }
+
+  }
+
+  for(uint32_t k = first + 1; k <= last; ++k) {
+
+    for(uint32_t b = 0; b != nBlocks; ++b)
+      Positions.erase(Iters[k].blocks[b]);
+    for(uint32_t j = 0, jlim = Iters[k].insts.size(); j != jlim; ++j)
+      Positions.erase(Iters[k].insts[j]);
+
+    for(uint32_t b = 0; b != nBlocks; ++b)
+      Iters[k].blocks[b]->dropAllReferences();
+
+  }
+
+  for(uint32_t k = first + 1; k <= last; ++k) {
+    for(uint32_t b = 0; b != nBlocks; ++b)
+      Iters[k].blocks[b]->eraseFromParent();
+  }
+
+  return true;
+
+}
+
+void PeelAttempt::rerollIterations() {
+
+  Function* CF = parent->getFunctionRoot()->CommitF;
+  uint32_t nIters = Iterations.size();
+  if(nIters < 2)
+    return;
+
+  std::vector<RerollIter> Iters(nIters);
+  std::vector<bool> eligible(nIters);
+  RerollPosMap Positions;
+
+  for(uint32_t i = 0; i != nIters; ++i) {
+
+    eligible[i] = getRerollView(Iterations[i], CF, Iters[i]);
+    if(!eligible[i])
+      continue;
+
+    uint32_t nBlocks = Iters[i].blocks.size();
+    for(uint32_t b = 0; b != nBlocks; ++b)
+      Positions[Iters[i].blocks[b]] = std::make_pair(i, b);
+    for(uint32_t j = 0, jlim = Iters[i].insts.size(); j != jlim; ++j)
+      Positions[Iters[i].insts[j]] = std::make_pair(i, nBlocks + j);
+
+  }
+
+  uint32_t first = 0;
+  while(first + 1 < nIters) {
+
+    if(!eligible[first]) {
+      ++first;
+      continue;
+    }
+
+    uint32_t last = first;
+    while(last + 1 < nIters && eligible[last + 1] && rerollStructureMatches(Iters[first], Iters[last + 1]))
+      ++last;
+
+    // The final iteration of a matching run often differs in how it leaves the loop,
+    // so try again without it before giving up.
+    uint32_t next = last + 1;
+    for(uint32_t tryLast = last; tryLast > first && tryLast + 2 > last; --tryLast) {
+
+      if(tryRerollRun(this, Iters, Positions, first, tryLast)) {
+
+	LPDEBUG("Rerolled iterations " << first << "-" << tryLast << "\n");
+	next = tryLast + 1;
+	break;
+
+      }
+
+    }
+
+    first = next;
+
+  }
+
+}
+
+void IntegrationAttempt::rerollPeeledLoops() {
+
+  if(NoReroll || !getFunctionRoot()->CommitF)
+    return;
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* LPA = it->second;
+    if(!(LPA->isEnabled() && LPA->isTerminated()))
+      continue;
+
+    // Inner loops first: an iteration containing a peeled loop can't itself be rerolled.
+    for(std::vector<PeelIteration*>::iterator iterit = LPA->Iterations.begin(),
+	  iterend = LPA->Iterations.end(); iterit != iterend; ++iterit)
+      (*iterit)->rerollPeeledLoops();
+
+    LPA->rerollIterations();
+
+  }
+
+}
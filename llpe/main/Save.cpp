@@ -28,6 +28,7 @@
 #include "llvm/Support/FileSystem.h"
 #include "llvm/IR/DIBuilder.h"
 
+#include <algorithm>
 #include <unistd.h>
 #include <stdlib.h>
 
@@ -35,6 +36,7 @@ using namespace llvm;
 
 // Name the output basic blocks for easier debugging? Significantly increases output size.
 cl::opt<bool> VerboseNames("int-verbose-names");
+static cl::opt<uint64_t> WholeFileGlobalMax("llpe-whole-file-global-max", cl::init(64 * 1024));
 
 static uint32_t SaveProgressN = 0;
 const uint32_t SaveProgressLimit = 1000;
@@ -1257,25 +1259,74 @@ void IntegrationAttempt::emitTerminator(ShadowBB* BB, ShadowInstruction* I, Basi
 
 }
 
-// Create a constant global containing the bytes read by this ReadFile call.
-static GlobalVariable* getFileBytesGlobal(ReadFile& RF) {
+// Get the constant global holding ByteArray, making one if necessary. Globals are shared between all
+// reads that produced the same bytes.
+static GlobalVariable* getBytesGlobal(Constant* ByteArray) {
+
+  GlobalVariable*& GV = GlobalIHP->fileBytesGlobals[ByteArray];
+  if(!GV) {
+    GV = new GlobalVariable(*getGlobalModule(), ByteArray->getType(), true, GlobalValue::InternalLinkage, ByteArray, "");
+    GV->setUnnamedAddr(true);
+  }
+
+  return GV;
+
+}
+
+static Constant* getFileBytesArray(std::string& name, uint64_t offset, uint64_t size) {
 
   std::vector<Constant*> constBytes;
   std::string errors;
   LLVMContext& Context = GInt8->getContext();
-  if(!getFileBytes(RF.name, RF.incomingOffset, RF.readSize, constBytes, Context, errors)) {
+  if(!getFileBytes(name, offset, size, constBytes, Context, errors)) {
 
-    errs() << "Failed to read file " << RF.name << " in commit\n";
+    errs() << "Failed to read file " << name << " in commit\n";
     exit(1);
 
   }
 
   ArrayType* ArrType = ArrayType::get(IntegerType::get(Context, 8), constBytes.size());
-  Constant* ByteArray = ConstantArray::get(ArrType, constBytes);
+  return ConstantArray::get(ArrType, constBytes);
+
+}
+
+// Get an i8* to constant memory containing the bytes read by this ReadFile call. Reads from a regular
+// file no bigger than -llpe-whole-file-global-max are served from a single global holding the whole file,
+// so that every read of it, overlapping or not, shares the same bytes.
+static Constant* getFileBytesPtr(ReadFile& RF) {
 
-  // Create a const global for the array:
+  GlobalVariable* GV = 0;
+  uint64_t offset = 0;
 
-  return new GlobalVariable(*getGlobalModule(), ArrType, true, GlobalValue::InternalLinkage, ByteArray, "");
+  if(!RF.isFifo) {
+
+    std::map<std::string, GlobalVariable*>::iterator findit = GlobalIHP->wholeFileGlobals.find(RF.name);
+    if(findit != GlobalIHP->wholeFileGlobals.end())
+      GV = findit->second;
+    else {
+
+      uint64_t fileSize;
+      if((!sys::fs::file_size(RF.name, fileSize)) && fileSize <= WholeFileGlobalMax)
+	GV = getBytesGlobal(getFileBytesArray(RF.name, 0, fileSize));
+      GlobalIHP->wholeFileGlobals[RF.name] = GV;
+
+    }
+
+    // The file might have grown since we looked, in which case fall back to a global for this read.
+    if(GV && RF.incomingOffset + RF.readSize > cast<ArrayType>(GV->getType()->getElementType())->getNumElements())
+      GV = 0;
+    else
+      offset = RF.incomingOffset;
+
+  }
+
+  if(!GV) {
+    GV = getBytesGlobal(getFileBytesArray(RF.name, RF.incomingOffset, RF.readSize));
+    offset = 0;
+  }
+
+  Constant* Idxs[2] = { ConstantInt::get(GInt64, 0), ConstantInt::get(GInt64, offset) };
+  return ConstantExpr::getInBoundsGetElementPtr(GV, Idxs, 2);
 
 }
 
@@ -1353,9 +1404,7 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	  if(readBuffer->getType() != GInt8Ptr)
 	    readBuffer = new BitCastInst(readBuffer, GInt8Ptr, VerboseNames ? "readcast" : "", emitBB);
 
-	  Value* checkBuffer = getFileBytesGlobal(it->second);
-	  if(checkBuffer->getType() != GInt8Ptr)
-	    checkBuffer = new BitCastInst(checkBuffer, GInt8Ptr, VerboseNames ? "readcast" : "", emitBB);
+	  Value* checkBuffer = getFileBytesPtr(it->second);
 
 	  Constant* MemcmpSize = ConstantInt::get(GInt64, it->second.readSize);
 
@@ -1452,14 +1501,10 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	 (!(it->second.isFifo && !pass->omitChecks)) && 
 	 !(I->dieStatus & INSTSTATUS_UNUSED_WRITER)) {
 	
-	GlobalVariable *ArrayGlobal = getFileBytesGlobal(it->second);
+	Constant* CopySource = getFileBytesPtr(it->second);
 
 	Type* Int64Ty = IntegerType::get(Context, 64);
 	Type* VoidPtrTy = Type::getInt8PtrTy(Context);
-
-	Constant* ZeroIdx = ConstantInt::get(Int64Ty, 0);
-	Constant* Idxs[2] = {ZeroIdx, ZeroIdx};
-	Constant* CopySource = ConstantExpr::getGetElementPtr(ArrayGlobal, Idxs, 2);
       
 	Constant* MemcpySize = ConstantInt::get(Int64Ty, it->second.readSize);
 
@@ -1517,14 +1562,17 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 
   Function* CalledF = getCalledFunction(I);
 
-  // Check whether it's valid to assume stat returns zero for the given file:
+  // Check whether it's valid to assume stat returns zero for the given file,
+  // or that an mmap'd file has the contents we saw:
+
+  bool isMmap = CalledF && (CalledF->getName() == "mmap" || CalledF->getName() == "mmap64");
   
   if((!pass->omitChecks) && I->needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD && 
-     (CalledF->getName() == "stat" || CalledF->getName() == "fstat")) {
+     (CalledF->getName() == "stat" || CalledF->getName() == "fstat" || isMmap)) {
 
     LLVMContext& Context = emitBB->getContext();
 
-    // Emit an lliowd_ok check, and if it fails branch to the real stat instruction.
+    // Emit an lliowd_ok check, and if it fails branch to the real stat or mmap instruction.
     Type* Int32Ty = IntegerType::get(Context, 32);
     Constant* CheckFn = F.getParent()->getOrInsertFunction("lliowd_ok", Int32Ty, NULL);
     Value* CheckResult = CallInst::Create(CheckFn, ArrayRef<Value*>(), VerboseNames ? "readcheck" : "", emitBB);
@@ -1540,7 +1588,7 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
       std::string message;
       {
 	raw_string_ostream RSO(message);
-	RSO << "Denied permission to use specialised files on (f)stat in " << emitBB->getName() << "\n";
+	RSO << "Denied permission to use specialised files on " << CalledF->getName() << " in " << emitBB->getName() << "\n";
       }
 
       emitRuntimePrint(emitBBIter->breakBlock, message, 0);
@@ -1558,6 +1606,10 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
     release_assert(successTarget && failTarget && CheckTest);
     BranchInst::Create(failTarget, successTarget, CheckTest, emitBB);
 
+    // The mapping itself is still made for real; specialised code may use it.
+    if(isMmap)
+      emitInst(BB, I, successTarget);
+
     return true;
     
   }
@@ -2972,7 +3024,7 @@ void IntegrationAttempt::commitInstructions() {
 
 // Remove any references to BB's instructions as committed versions of heap objects
 // or file descriptors.
-static void unregisterCommittedAllocations(BasicBlock* BB) {
+void llvm::unregisterCommittedAllocations(BasicBlock* BB) {
 
   for(BasicBlock::iterator BI = BB->begin(), BE = BB->end(); BI != BE; ++BI) {
 
@@ -3003,7 +3055,7 @@ static void unregisterCommittedAllocations(BasicBlock* BB) {
 
 // Remove any references to F's instructions as committed versions of heap objects
 // or file descriptors.
-static void unregisterCommittedAllocations(Function* F) {
+void llvm::unregisterCommittedAllocations(Function* F) {
 
   for(Function::iterator it = F->begin(), itend = F->end(); it != itend; ++it)
     unregisterCommittedAllocations(it);
@@ -3021,6 +3073,10 @@ static void releaseCC(std::vector<Function*>& CommitFunctions, std::vector<Basic
 
     // This (and children) already in a function: kill it.
     unregisterCommittedAllocations(CF);
+    SmallVector<Function*, 4>::iterator findit = 
+      std::find(GlobalIHP->commitFunctions.begin(), GlobalIHP->commitFunctions.end(), CF);
+    if(findit != GlobalIHP->commitFunctions.end())
+      GlobalIHP->commitFunctions.erase(findit);
     CF->dropAllReferences();
     CF->eraseFromParent();
 
@@ -3152,6 +3208,103 @@ void IntegrationAttempt::markAllocationsAndFDsCommitted() {
 
 }
 
+// This context and its children are being thrown away without being committed:
+// invalidate the heap objects and FDs they created so that nothing refers to
+// their soon-to-be-freed instructions, noting the heap indices forgotten.
+void IntegrationAttempt::forgetAllocationsAndFDs(DenseSet<uint32_t>& forgottenHeapObjects) {
+
+  for(IAIterator it = child_calls_begin(this),
+	itend = child_calls_end(this); it != itend; ++it)
+    it->second->forgetAllocationsAndFDs(forgottenHeapObjects);
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i)
+      it->second->Iterations[i]->forgetAllocationsAndFDs(forgottenHeapObjects);
+
+  }
+
+  for(uint32_t i = BBsOffset, ilim = BBsOffset + nBBs; i != ilim; ++i) {
+
+    ShadowBB* BB = getBB(i);
+    if(!BB)
+      continue;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction& SI = BB->insts[j];
+      ShadowValue Base;
+
+      if(getBaseObject(ShadowValue(&SI), Base) && Base.isPtrIdx() && Base.getFrameNo() == -1) {
+
+	AllocData* AD = getAllocData(Base);
+	if(AD->allocValue == ShadowValue(&SI)) {
+	  // Any code committed for a child call here has already been released.
+	  AD->isCommitted = true;
+	  AD->committedVal = 0;
+	  AD->allocValue = ShadowValue();
+	  forgottenHeapObjects.insert((uint32_t)AD->allocIdx);
+	}
+
+      }
+      else if(SI.i.PB && isa<ImprovedValSetSingle>(SI.i.PB)) {
+
+	ImprovedValSetSingle* IVS = cast<ImprovedValSetSingle>(SI.i.PB);
+	if(IVS->Values.size() == 1 && IVS->SetType == ValSetTypeFD) {
+
+	  FDGlobalState& FDGS = pass->fds[IVS->Values[0].V.getFd()];
+	  if(FDGS.SI == &SI) {
+	    FDGS.SI = 0;
+	    FDGS.isCommitted = true;
+	    FDGS.CommittedVal = 0;
+	  }
+
+	}
+
+      }
+
+    }
+
+  }
+
+}
+
+static void eraseForgottenHeapObjects(std::vector<uint32_t>& Objects, DenseSet<uint32_t>& Forgotten) {
+
+  uint32_t out = 0;
+  for(uint32_t i = 0, ilim = Objects.size(); i != ilim; ++i) {
+    if(!Forgotten.count(Objects[i]))
+      Objects[out++] = Objects[i];
+  }
+  Objects.resize(out);
+
+}
+
+// Free an uncommitted context (a peel iteration we gave up on) along with its children.
+// Unlike releaseMemoryPostCommit this leaves no heap, arena or allocation-site records
+// pointing at its instructions.
+void IntegrationAttempt::discardUncommitted() {
+
+  DenseSet<uint32_t> forgottenHeapObjects;
+  forgetAllocationsAndFDs(forgottenHeapObjects);
+
+  if(!forgottenHeapObjects.empty()) {
+
+    for(DenseMap<ShadowValue, std::vector<uint32_t> >::iterator it = pass->arenaObjects.begin(),
+	  itend = pass->arenaObjects.end(); it != itend; ++it)
+      eraseForgottenHeapObjects(it->second, forgottenHeapObjects);
+
+    for(DenseMap<Instruction*, std::vector<uint32_t> >::iterator it = pass->heapObjectsBySite.begin(),
+	  itend = pass->heapObjectsBySite.end(); it != itend; ++it)
+      eraseForgottenHeapObjects(it->second, forgottenHeapObjects);
+
+  }
+
+  releaseContextMemory(true);
+
+}
+
 // Release copies of the heap state that were taken in case this
 // function needed to be re-analysed to find a general case solution
 // in the context of some enclosing loop.
@@ -3170,9 +3323,22 @@ void InlineAttempt::releaseBackupStores() {
 // which our caller will delete.
 void IntegrationAttempt::releaseMemoryPostCommit() {
 
+  releaseContextMemory(false);
+
+}
+
+// Common implementation of releaseMemoryPostCommit and discardUncommitted. If discarding,
+// the context was never committed, so its tracked stores and allocations are
+// disowned rather than marked committed.
+void IntegrationAttempt::releaseContextMemory(bool discarding) {
+
   if(commitState == COMMIT_FREED)
     return;
 
+  // A freed iteration no longer counts against the peel budget.
+  if(L)
+    --pass->livePeelIterations;
+
   // For the time being, retain all data if the user will inspect it.
   if(IHPSaveDOTFiles) {
     commitState = COMMIT_FREED;
@@ -3182,7 +3348,7 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
   for(IAIterator it = child_calls_begin(this),
 	itend = child_calls_end(this); it != itend; ++it) {
 
-    it->second->releaseMemoryPostCommit();
+    it->second->releaseContextMemory(discarding);
     // IAs may only be referenced from us at present
     it->second->dropReferenceFrom(it->first);
 
@@ -3193,7 +3359,7 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
 
     for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i) {
 
-      it->second->Iterations[i]->releaseMemoryPostCommit();
+      it->second->Iterations[i]->releaseContextMemory(discarding);
 
     }
 
@@ -3218,16 +3384,24 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
 	{
 	  DenseMap<ShadowInstruction*, TrackedStore*>::iterator findit = pass->trackedStores.find(SI);
 	  if(findit != pass->trackedStores.end()) {
-	    findit->second->isCommitted = true;
-	    pass->trackedStores.erase(findit);
+	    if(discarding)
+	      findit->second->discard();
+	    else {
+	      findit->second->isCommitted = true;
+	      pass->trackedStores.erase(findit);
+	    }
 	  }
 	}
 
 	{
 	  DenseMap<ShadowInstruction*, TrackedAlloc*>::iterator findit = pass->trackedAllocs.find(SI);
 	  if(findit != pass->trackedAllocs.end()) {
-	    findit->second->isCommitted = true;
-	    pass->trackedAllocs.erase(findit);
+	    if(discarding)
+	      findit->second->discard();
+	    else {
+	      findit->second->isCommitted = true;
+	      pass->trackedAllocs.erase(findit);
+	    }
 	  }
 	}
 
@@ -3263,15 +3437,25 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
   // This call will disable the context if it's not a good idea.
   findProfitableIntegration();
 
+  // ...as will this one, if it (or some of its children) won't fit in the size budget.
+  enforceSizeBudget();
+
   if(isEnabled()) {
 
     // The TL and DSE stores were backed up to deal with the possibility
     // that the context would not be committed: we don't need those after all.
     releaseBackupStores();
 
+    // Now that disabled contexts are known, report the TL checks that will actually be committed.
+    if(TLReportEnabled())
+      reportTLChecks();
+
     // Create residual blocks for disabled loops
     prepareCommitCall();
 
+    // Let one lliowd check cover runs of checked reads that share a validity window.
+    batchVFSChecks();
+
     if(!pass->statsFile.empty())
       preCommitStats(true);
 
@@ -3282,7 +3466,7 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     findSaveSplits();
 
     // Find dead instructions.
-    runDIE();
+    runDIEFromRoot();
 
     // Save a DOT representation if need be, for the GUI to use.
     saveDOT();
@@ -3291,6 +3475,9 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     commitCFG();
     commitArgsAndInstructions();
 
+    // Fold runs of identical peeled iterations back into loops where that's smaller.
+    rerollPeeledLoops();
+
     postCommitOptimise();
 
   }
@@ -3341,23 +3528,27 @@ void LLPEAnalysisPass::commit() {
     // during specialisation.
     writeLliowdConfig();
 
-    BasicBlock* preludeBlock = 0;
-
     // Maybe insert an init call to connect to the file-watcher daemon.
-    // Find the committed function where the init call should go:
+    // Find the committed function(s) where the init call should go:
+    std::vector<Function*> writePreludeFns;
     if(llioPreludeStackIdx == -1) {
 
-      Function* writePreludeFn = llioPreludeFn;
-      if(llioPreludeFn == &RootIA->F)
-	writePreludeFn = RootIA->CommitF;
-
-      if(writePreludeFn)
-	preludeBlock = &writePreludeFn->getEntryBlock();
+      if(llioPreludeFn == &RootIA->F) {
+	if(batchRoots.empty())
+	  writePreludeFns.push_back(RootIA->CommitF);
+	else
+	  writePreludeFns = batchRoots;
+      }
+      else if(llioPreludeFn)
+	writePreludeFns.push_back(llioPreludeFn);
 
     }
 
     // Add an lliowd_init() prelude to the beginning of the requested function:
-    if(preludeBlock) {
+    for(std::vector<Function*>::iterator FI = writePreludeFns.begin(),
+	  FE = writePreludeFns.end(); FI != FE; ++FI) {
+
+      BasicBlock* preludeBlock = &(*FI)->getEntryBlock();
 
       BasicBlock::iterator it = preludeBlock->begin();
       while(it != preludeBlock->end() && isa<AllocaInst>(it))
@@ -3371,6 +3562,12 @@ void LLPEAnalysisPass::commit() {
 
   }
 
+  // Record which contexts depended on which files, if requested.
+  writeFileDeps();
+
+  // Fold together residual functions that came out identical.
+  mergeIdenticalCommitFunctions();
+
   // If requested, write verbose stats about this specialisation attempt.
   if(!statsFile.empty()) {
 
@@ -3384,6 +3581,20 @@ void LLPEAnalysisPass::commit() {
       stats.print(RFO);
   }
 
+  // If requested, report (and diff against a baseline) the loads that need thread-interference checks.
+  writeTLReport();
+
+  // In batch mode each specialisation was named as it was committed; the original root is left alone
+  // unless a dispatcher is wanted.
+  if(!batchRoots.empty()) {
+    // The original root remains as unspecialised code (and the dispatcher's fallback), so it
+    // must not keep the last configuration's argv.
+    eraseRootArgvInsts();
+    emitBatchDispatcher();
+    errs() << "\n";
+    return;
+  }
+
   // Redirect internal callers to use the specialised fuction.
   RootIA->F.replaceAllUsesWith(RootIA->CommitF);
 
@@ -3401,3 +3612,36 @@ void LLPEAnalysisPass::commit() {
 
 }
 
+// Name the just-committed root of a batch specialisation <root>.<name> and make it externally visible.
+// Unlike a single specialisation it doesn't replace the original root, which later configurations
+// will specialise again.
+void LLPEAnalysisPass::finishBatchSpecialisation(const std::string& name) {
+
+  Function* CommitF = RootIA->CommitF;
+  if(!CommitF) {
+
+    errs() << "Batch configuration " << name << " produced no specialised root\n";
+    exit(1);
+
+  }
+
+  std::string newName;
+  {
+    raw_string_ostream RSO(newName);
+    RSO << RootIA->F.getName() << "." << name;
+  }
+
+  if(getGlobalModule()->getFunction(newName)) {
+
+    errs() << "Can't name batch specialisation " << newName << ": name already in use\n";
+    exit(1);
+
+  }
+
+  CommitF->setName(newName);
+  if(CommitF->hasLocalLinkage())
+    CommitF->setLinkage(GlobalValue::ExternalLinkage);
+
+  batchRoots.push_back(CommitF);
+
+}
@@ -10,9 +10,15 @@
 #include "llvm/Analysis/LLPE.h"
 #include "llvm/IR/Function.h"
 #include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Support/CommandLine.h"
 
 using namespace llvm;
 
+static cl::opt<unsigned> SplitMaxInsts("llpe-split-max-insts", cl::init(50000));
+static cl::opt<unsigned> SplitMinInsts("llpe-split-min-insts", cl::init(10000));
+static cl::opt<unsigned> SplitCallWeight("llpe-split-call-weight", cl::init(100));
+static cl::opt<unsigned> SplitLoopFactor("llpe-split-loop-factor", cl::init(10));
+
 // Code in this file determines how to split committed code into residual functions. We don't want to just
 // inline everything everywhere, since this makes a huge function that chokes the LLVM optimisation/analysis
 // passes, nor do we want to simply emit a residual function per specialised context since this leaves
@@ -35,6 +41,7 @@ void llvm::patchReferences(std::vector<std::pair<WeakVH, uint32_t> >& Refs, Valu
     release_assert(isa<SelectInst>(it->first));
 
     Instruction* I = cast<Instruction>(it->first);
+    GlobalIHP->pendingPatchTargets.erase(I);
 
     I->setOperand(it->second, V);
     // Note this would be unsafe if any of the patch recipients were listed more than
@@ -367,6 +374,7 @@ uint64_t IntegrationAttempt::findSaveSplits() {
 void IntegrationAttempt::addPatchRequest(ShadowValue Needed, Instruction* PatchI, uint32_t PatchOp) {
 
   std::pair<WeakVH, uint32_t> PRQ(WeakVH(PatchI), PatchOp);
+  pass->pendingPatchTargets.insert(PatchI);
 
   switch(Needed.t) {
 
@@ -457,20 +465,95 @@ void InlineAttempt::splitCommitHere() {
 
 }
 
-#define SPLIT_THRESHOLD 50000
+// Estimate how many times this context will be entered for each entry to the specialised root function.
+// Where a profile is available, use the relative frequency of the call block in each enclosing context;
+// otherwise assume each loop that will remain residual (i.e. isn't peeled) runs SplitLoopFactor times.
+double InlineAttempt::estimateDynamicEntries() {
+
+  double entries = 1.0;
+  InlineAttempt* Ctx = this;
+
+  while(!Ctx->isRootMainCall()) {
+
+    // Shared contexts must be split anyway, so any representative caller will do.
+    if(Ctx->Callers.empty())
+      break;
+    
+    ShadowBB* CallBB = Ctx->Callers[0]->parent;
+    IntegrationAttempt* Parent = CallBB->IA;
+
+    if(pass->profiledFunctions.count(&Parent->F)) {
+
+      entries *= Parent->getProfileWeight(CallBB->invar);
+
+    }
+    else {
+
+      for(const ShadowLoopInvar* L = CallBB->invar->naturalScope; L && L != Parent->L; L = L->parent)
+	entries *= SplitLoopFactor;
+
+    }
+
+    Ctx = Parent->getFunctionRoot();
+
+  }
+
+  return entries;
+
+}
+
+// Return the rough per-call cost of committing this context out of line: the call itself,
+// plus passing each argument that won't be replaced by a constant, plus any return value.
+uint32_t InlineAttempt::getSplitBoundaryCost() {
+
+  uint32_t cost = 2;
+
+  for(uint32_t i = 0, ilim = F.arg_size(); i != ilim; ++i) {
+
+    if(!willBeReplacedWithConstantOrDeleted(ShadowValue(&argShadows[i])))
+      ++cost;
+
+  }
+
+  if(!F.getFunctionType()->getReturnType()->isVoidTy())
+    ++cost;
+
+  return cost;
+
+}
 
 // Similarly to IntegrationAttempt::findSaveSplits above, return the number of instructions this context
-// and its children will emit in our parent's commit function. If that number would be excessive,
+// and its children will emit in our parent's commit function. If it is worth it,
 // split this context and its children off into a new commit function and note that we now only
 // show up as a single call instruction to our parent.
+// Contexts larger than SplitMaxInsts are always split, since the optimiser copes badly with
+// huge functions, and contexts smaller than SplitMinInsts never are. In between we split when the
+// code size outweighs the cost of crossing the call boundary as often as we expect to.
 uint64_t InlineAttempt::findSaveSplits() {
   
   if(isCommitted())
     return residualInstructionsHere;
+
+  if(mustCommitOutOfLine()) {
+    splitCommitHere();
+    return 1;
+  }
   
-  uint64_t residuals;
+  uint64_t residuals = IntegrationAttempt::findSaveSplits();
+  bool split;
+
+  if(residuals > SplitMaxInsts)
+    split = true;
+  else if(residuals < SplitMinInsts)
+    split = false;
+  else {
+
+    double callCost = ((double)getSplitBoundaryCost()) * estimateDynamicEntries() * SplitCallWeight;
+    split = ((double)residuals) > callCost;
+
+  }
 
-  if(mustCommitOutOfLine() || (residuals = IntegrationAttempt::findSaveSplits()) > SPLIT_THRESHOLD) {
+  if(split) {
     splitCommitHere();
     return 1;
   }
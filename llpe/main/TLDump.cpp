@@ -9,8 +9,236 @@
 
 #include "llvm/Analysis/LLPE.h"
 
+#include "llvm/IR/Function.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
 // Debugging functions that dunp the state of the tentative-load or dead-store analysis code.
 
+using namespace llvm;
+
+static cl::opt<std::string> TLReportFile("llpe-tl-report", cl::init(""));
+static cl::opt<std::string> TLReportBaseline("llpe-tl-report-baseline", cl::init(""));
+
+// Tentative-load report: every load that ends up needing a runtime check against
+// interference from other threads, with the reason it was tentative, written as
+// function <tab> block <tab> instruction index <tab> cause <tab> count
+// and sorted so that two reports can be compared by line. The cause of a load
+// that was tentative because of a yield point is the yield point most recently
+// walked by the TL analysis when the load was examined; after control-flow merges
+// this is a good hint rather than a proof.
+
+// Causes of checks decided by TLAnalyseInstruction, looked up by countTentativeInstructions.
+static DenseMap<ShadowInstruction*, std::pair<ShadowInstructionInvar*, std::string> > pendingTLChecks;
+// Description of the most recent yield point walked.
+static std::string lastTLClobber;
+// Counted checks, keyed by the report line minus its count.
+static std::map<std::string, uint64_t> TLReport;
+
+static void describeInst(ShadowInstruction* SI, raw_ostream& RSO) {
+
+  ShadowBBInvar* BBI = SI->parent->invar;
+  RSO << SI->parent->IA->F.getName() << "\t";
+  if(BBI->BB->hasName())
+    RSO << BBI->BB->getName();
+  else
+    RSO << "#" << BBI->idx;
+  RSO << "\t" << SI->invar->idx;
+
+}
+
+bool llvm::TLReportEnabled() {
+
+  return !TLReportFile.empty();
+
+}
+
+// SI may have been clobbered by other threads: note it as the cause of subsequent checks.
+void llvm::noteTLClobber(ShadowInstruction* SI) {
+
+  if(!TLReportEnabled())
+    return;
+
+  std::string where;
+  {
+    raw_string_ostream RSO(where);
+    describeInst(SI, RSO);
+  }
+  std::replace(where.begin(), where.end(), '\t', '/');
+
+  lastTLClobber.clear();
+  raw_string_ostream RSO(lastTLClobber);
+  RSO << "yield " << where;
+  if(Function* F = getCalledFunction(SI))
+    RSO << " (" << F->getName() << ")";
+  else
+    RSO << " (" << SI->invar->I->getOpcodeName() << ")";
+  RSO.flush();
+
+}
+
+// Start a new TL walk: loads are no longer attributed to yield points seen by an earlier one.
+void llvm::resetTLClobber() {
+
+  lastTLClobber.clear();
+
+}
+
+// Start a new specialisation run (see -llpe-batch-config): forget the previous run's pending checks,
+// whose instructions are gone. Counted checks accumulate across runs.
+void llvm::resetTLReportState() {
+
+  pendingTLChecks.clear();
+  lastTLClobber.clear();
+
+}
+
+// SI's TL state was just decided: record or forget its reason for needing a check.
+void llvm::noteTLCheck(ShadowInstruction* SI) {
+
+  if(!TLReportEnabled())
+    return;
+
+  if(SI->isThreadLocal != TLS_MUSTCHECK) {
+    pendingTLChecks.erase(SI);
+    return;
+  }
+
+  std::string cause;
+  if(SI->hasOrderingConstraint() || inst_is<AtomicRMWInst>(SI) || inst_is<AtomicCmpXchgInst>(SI))
+    cause = "ordered access";
+  else if(lastTLClobber.empty())
+    cause = "tentative on entry";
+  else
+    cause = lastTLClobber;
+
+  pendingTLChecks[SI] = std::make_pair(SI->invar, cause);
+
+}
+
+// SI will be committed with a runtime check: count it in the report.
+void llvm::countTLCheck(ShadowInstruction* SI) {
+
+  if(!TLReportEnabled())
+    return;
+
+  std::string key;
+  {
+    raw_string_ostream RSO(key);
+    describeInst(SI, RSO);
+    RSO << "\t";
+
+    DenseMap<ShadowInstruction*, std::pair<ShadowInstructionInvar*, std::string> >::iterator findit = 
+      pendingTLChecks.find(SI);
+    if(findit != pendingTLChecks.end() && findit->second.first == SI->invar)
+      RSO << findit->second.second;
+    else
+      RSO << "unknown";
+  }
+
+  ++TLReport[key];
+
+}
+
+// Read a report written by a previous run.
+static void readTLReport(std::string& path, std::map<std::string, uint64_t>& Out) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
+  if(std::error_code ec = MB.getError()) {
+
+    errs() << "Failed to load TL report from " << path << ": " << ec.message() << "\n";
+    exit(1);
+
+  }
+
+  StringRef Remaining = (*MB)->getBuffer();
+  while(!Remaining.empty()) {
+
+    std::pair<StringRef, StringRef> LineSplit = Remaining.split('\n');
+    StringRef Line = LineSplit.first;
+    Remaining = LineSplit.second;
+
+    if(Line.empty() || Line[0] == '#')
+      continue;
+
+    size_t lastTab = Line.rfind('\t');
+    uint64_t count;
+    if(lastTab == StringRef::npos || Line.substr(lastTab + 1).getAsInteger(10, count)) {
+
+      errs() << "-llpe-tl-report-baseline: bad line " << Line << "\n";
+      exit(1);
+
+    }
+
+    Out[Line.substr(0, lastTab)] += count;
+
+  }
+
+}
+
+// Write the report, and if a baseline was given, print what changed relative to it.
+void llvm::writeTLReport() {
+
+  if(!TLReportEnabled())
+    return;
+
+  uint64_t total = 0;
+
+  {
+    std::error_code error;
+    raw_fd_ostream RFO(TLReportFile.c_str(), error, sys::fs::F_None);
+    if(error) {
+      errs() << "Failed to open " << TLReportFile << ": " << error.message() << "\n";
+      return;
+    }
+
+    RFO << "# function\tblock\tinstruction\tcause\tchecks\n";
+    for(std::map<std::string, uint64_t>::iterator it = TLReport.begin(), itend = TLReport.end(); it != itend; ++it) {
+      RFO << it->first << "\t" << it->second << "\n";
+      total += it->second;
+    }
+  }
+
+  errs() << "TL report: " << total << " checked loads written to " << TLReportFile << "\n";
+
+  if(TLReportBaseline.empty())
+    return;
+
+  std::map<std::string, uint64_t> Baseline;
+  readTLReport(TLReportBaseline, Baseline);
+
+  uint64_t baseTotal = 0;
+  for(std::map<std::string, uint64_t>::iterator it = Baseline.begin(), itend = Baseline.end(); it != itend; ++it) {
+
+    baseTotal += it->second;
+    std::map<std::string, uint64_t>::iterator findit = TLReport.find(it->first);
+    uint64_t now = findit == TLReport.end() ? 0 : findit->second;
+    if(now < it->second)
+      errs() << "- " << it->first << "\t" << it->second << " -> " << now << "\n";
+
+  }
+
+  for(std::map<std::string, uint64_t>::iterator it = TLReport.begin(), itend = TLReport.end(); it != itend; ++it) {
+
+    std::map<std::string, uint64_t>::iterator findit = Baseline.find(it->first);
+    uint64_t before = findit == Baseline.end() ? 0 : findit->second;
+    if(before < it->second)
+      errs() << "+ " << it->first << "\t" << before << " -> " << it->second << "\n";
+
+  }
+
+  errs() << "TL report: " << baseTotal << " checked loads in baseline, " << total << " now\n";
+
+}
+
 namespace llvm {
 
   void TLDump(IntegrationAttempt* IA) {
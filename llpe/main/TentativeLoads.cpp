@@ -54,9 +54,35 @@ TLLocalStore* TLMapPointer::getMapForBlock(ShadowBB* BB) {
 
 }
 
+// Bitmap of bytes [Start, Stop) within a small object. Bytes beyond the small-object limit don't exist.
+static uint64_t smallGoodMask(uint64_t Start, uint64_t Stop) {
+
+  if(Stop > TL_SMALL_OBJECT_BYTES)
+    Stop = TL_SMALL_OBJECT_BYTES;
+  if(Start >= Stop)
+    return 0;
+
+  uint64_t below = (Stop == 64) ? ~((uint64_t)0) : ((((uint64_t)1) << Stop) - 1);
+  return below & ~((((uint64_t)1) << Start) - 1);
+
+}
+
+// Summarise an interval map describing a small object as a bitmap.
+static uint64_t rangesToSmallGood(TLMapTy* M) {
+
+  uint64_t good = 0;
+  for(TLMapTy::iterator it = M->begin(), itend = M->end(); it != itend; ++it)
+    good |= smallGoodMask(it.start(), it.stop());
+  return good;
+
+}
+
 // Copy the store entries. The entries themselves may still be shared.
 TLMapPointer TLMapPointer::getReadableCopy() {
 
+  if(isSmall)
+    return *this;
+
   TLMapTy* newMap = new TLMapTy(TLMapAllocator);
   for(TLMapTy::iterator it = M->begin(), itend = M->end(); it != itend; ++it)
     newMap->insert(it.start(), it.stop(), *it);
@@ -68,16 +94,151 @@ TLMapPointer TLMapPointer::getReadableCopy() {
 // Maps themselves are not shared at the moment, so just delete it.
 bool TLMapPointer::dropReference() {
 
-  delete M;
+  if(!isSmall)
+    delete M;
   M = 0;
+  smallGood = 0;
+  isSmall = false;
 
   return true;
 
 }
 
+// Switch a map describing a small object to the inline representation.
+void TLMapPointer::makeSmall() {
+
+  if(isSmall)
+    return;
+
+  smallGood = rangesToSmallGood(M);
+  delete M;
+  M = 0;
+  isSmall = true;
+
+}
+
+// Is all of [Start, Stop) known good?
+bool TLMapPointer::isGood(uint64_t Start, uint64_t Stop) {
+
+  if(isSmall) {
+
+    if(Stop > TL_SMALL_OBJECT_BYTES)
+      return false;
+    uint64_t mask = smallGoodMask(Start, Stop);
+    return (smallGood & mask) == mask;
+
+  }
+
+  TLMapTy::iterator it = M->find(Start);
+  return it != M->end() && it.start() <= Start && it.stop() >= Stop;
+
+}
+
+// Mark [Start, Stop) known good.
+void TLMapPointer::markGood(uint64_t Start, uint64_t Stop) {
+
+  if(isSmall) {
+
+    smallGood |= smallGoodMask(Start, Stop);
+    return;
+
+  }
+
+  // IntervalMap doesn't permit overlapping inserts, so figure out what offsets need marking, if any.
+  SmallVector<std::pair<uint64_t, uint64_t>, 1> addRanges;
+
+  TLMapTy::iterator it = M->find(Start), itend = M->end();
+
+  if(it == itend || it.start() >= Stop) {
+
+    addRanges.push_back(std::make_pair(Start, Stop));
+
+  }
+  else {
+
+    // Gap at left?
+
+    if(it.start() > Start)
+      addRanges.push_back(std::make_pair(Start, it.start()));
+
+    for(; it != itend && it.start() < Stop; ++it) {
+    
+      // Gap to the right of this extent?
+      if(it.stop() < Stop) {
+
+	TLMapTy::iterator nextit = it;
+	++nextit;
+
+	uint64_t gapend;
+	if(nextit == itend)
+	  gapend = Stop;
+	else
+	  gapend = std::min(Stop, nextit.start());
+
+	if(it.stop() != gapend)
+	  addRanges.push_back(std::make_pair(it.stop(), gapend));
+
+      }
+
+    }
+
+  }
+
+  for(SmallVector<std::pair<uint64_t, uint64_t>, 1>::iterator it = addRanges.begin(),
+	itend = addRanges.end(); it != itend; ++it) {
+
+    M->insert(it->first, it->second, true);
+
+  }
+
+}
+
+// Mark the whole object tentative.
+void TLMapPointer::clear() {
+
+  if(isSmall)
+    smallGood = 0;
+  else
+    M->clear();
+
+}
+
+void TLMapPointer::print(raw_ostream& RSO, bool brief) {
+
+  if(isSmall) {
+
+    for(uint64_t i = 0; i < TL_SMALL_OBJECT_BYTES; ++i) {
+      if(smallGood & (((uint64_t)1) << i))
+	RSO << i << " ";
+    }
+    RSO << "\n";
+    return;
+
+  }
+
+  for(TLMapTy::iterator it = M->begin(), itend = M->end(); it != itend; ++it)
+    RSO << it.start() << "-" << it.stop() << "\n";
+
+}
+
 // Merge two is-known-good arrays. An offset is good if it's good in both parents.
 void TLMapPointer::mergeStores(TLMapPointer* mergeFrom, TLMapPointer* mergeTo, uint64_t ASize, TLMerger* Visitor) {
 
+  // Small objects merge in the inline representation, whichever form either side currently has
+  // (the empty store and fresh copies of it are always interval maps).
+  if(ASize <= TL_SMALL_OBJECT_BYTES) {
+
+    mergeTo->makeSmall();
+    if(mergeFrom->isSmall)
+      mergeTo->smallGood &= mergeFrom->smallGood;
+    else
+      mergeTo->smallGood &= rangesToSmallGood(mergeFrom->M);
+    return;
+
+  }
+
+  release_assert((!mergeFrom->isSmall) && (!mergeTo->isSmall) && "Small TL map for a large object?");
+
   // Intersect the sets per byte. The values are just booleans, so overwriting without erasing is fine.
 
   SmallVector<std::pair<uint64_t, uint64_t>, 4> keepRanges;
@@ -114,8 +275,12 @@ TLMapPointer* ShadowBB::getWritableTLStore(ShadowValue O) {
   bool isNewStore;
   TLMapPointer* ret = tlStore->getOrCreateStoreFor(O, &isNewStore);
 
-  if(isNewStore)
-    ret->M = new TLMapTy(TLMapAllocator);
+  if(isNewStore) {
+    if(O.getAllocSize(IA) <= TL_SMALL_OBJECT_BYTES)
+      *ret = TLMapPointer((uint64_t)0);
+    else
+      ret->M = new TLMapTy(TLMapAllocator);
+  }
 
   return ret;
 
@@ -128,6 +293,7 @@ static void markAllObjectsTentative(ShadowInstruction* SI, ShadowBB* BB) {
   BB->tlStore = BB->tlStore->getEmptyMap();
   BB->tlStore->allOthersClobbered = true;
   BB->IA->yieldState = BARRIER_HERE;
+  noteTLClobber(SI);
 
   if(inst_is<LoadInst>(SI) || inst_is<AtomicRMWInst>(SI))
     errs() << "Clobber all at " << SI->parent->IA->F.getName() << "," << SI->parent->invar->BB->getName() << "," << std::distance(SI->parent->invar->BB->begin(), BasicBlock::iterator(SI->invar->I)) << "\n";
@@ -174,70 +340,15 @@ static void markGoodBytes(ShadowValue GoodPtr, uint64_t Len, bool contextEnabled
   if(PtrTarget.second.V.isGV() &&  PtrTarget.second.V.u.GV->G->isConstant())
     return;
 
-  SmallVector<std::pair<uint64_t, uint64_t>, 1> addRanges;
-
   TLMapPointer* store = BB->tlStore->getReadableStoreFor(PtrTarget.second.V);
   uint64_t start = PtrTarget.second.Offset + Offset;
   uint64_t stop = PtrTarget.second.Offset + Offset + Len;
 
-  if(!store) {
-   
-    addRanges.push_back(std::make_pair(start, stop));
-
-  }
-  else {
-
-    // Figure out what offsets need marking, if any.
-    TLMapTy::iterator it = store->M->find(start), itend = store->M->end();
-
-    if(it == itend || it.start() >= stop) {
-
-      addRanges.push_back(std::make_pair(start, stop));
-
-    }
-    else {
-
-      // Gap at left?
-
-      if(it.start() > start)
-	addRanges.push_back(std::make_pair(start, it.start()));
-
-      for(; it != itend && it.start() < stop; ++it) {
-    
-	// Gap to the right of this extent?
-	if(it.stop() < stop) {
-
-	  TLMapTy::iterator nextit = it;
-	  ++nextit;
-
-	  uint64_t gapend;
-	  if(nextit == itend)
-	    gapend = stop;
-	  else
-	    gapend = std::min(stop, nextit.start());
-
-	  if(it.stop() != gapend)
-	    addRanges.push_back(std::make_pair(it.stop(), gapend));
-
-	}
-
-      }
-
-    }
-
-  }
-  
-  if(!addRanges.empty()) {
-
-    TLMapPointer* writeStore = BB->getWritableTLStore(PtrTarget.second.V);
-    for(SmallVector<std::pair<uint64_t, uint64_t>, 1>::iterator it = addRanges.begin(),
-	  itend = addRanges.end(); it != itend; ++it) {
-
-      writeStore->M->insert(it->first, it->second, true);
+  // Already known good?
+  if(store && store->isGood(start, stop))
+    return;
 
-    }
-
-  }
+  BB->getWritableTLStore(PtrTarget.second.V)->markGood(start, stop);
 
 }
 
@@ -460,22 +571,30 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
 
 	}
 	
-	SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4>::iterator findit =
-	  GlobalIHP->lockDomains.find(CallI);
-
-	if(findit != GlobalIHP->lockDomains.end()) {
+	if(YieldDomain* Domain = GlobalIHP->getYieldDomain(CallI, F)) {
 
-	  // This a bit of a hack -- the user can annotate a particular yield function
-	  // as only clobbering some particular globals.
+	  // The user has declared exactly which globals and allocation sites this
+	  // yield point may expose to other threads; only those become tentative.
 	  
-	  for(std::vector<GlobalVariable*>::iterator it = findit->second.begin(),
-		itend = findit->second.end(); it != itend; ++it) {
+	  noteTLClobber(SI);
+
+	  for(std::vector<GlobalVariable*>::iterator it = Domain->globals.begin(),
+		itend = Domain->globals.end(); it != itend; ++it) {
 
 	    ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(*it)];
 	    ShadowValue SV(SGV);
 	    TLMapPointer* TLObj = SI->parent->getWritableTLStore(SV);
 	    // Mark whole object tentative:
-	    TLObj->M->clear();
+	    TLObj->clear();
+
+	  }
+
+	  for(SmallPtrSet<Instruction*, 4>::iterator it = Domain->allocSites.begin(),
+		itend = Domain->allocSites.end(); it != itend; ++it) {
+
+	    std::vector<uint32_t>& Objects = GlobalIHP->heapObjectsBySite[*it];
+	    for(std::vector<uint32_t>::iterator objit = Objects.begin(), objitend = Objects.end(); objit != objitend; ++objit)
+	      SI->parent->getWritableTLStore(ShadowValue::getPtrIdx(-1, *objit))->clear();
 
 	  }
 
@@ -518,18 +637,10 @@ static bool shouldCheckRead(ImprovedVal& Ptr, uint64_t Size, ShadowBB* BB) {
     return BB->tlStore->allOthersClobbered;
   }
 
-  if(verbose) {
-
-    for(TLMapTy::iterator it = Map->M->begin(), itend = Map->M->end(); it != itend; ++it) {
-
-      errs() << it.start() << "-" << it.stop() << "\n";
-
-    }
-
-  }
+  if(verbose)
+    Map->print(errs(), false);
 
-  TLMapTy::iterator it = Map->M->find(Ptr.Offset);
-  bool coveredByMap = (it != Map->M->end() && ((int64_t)it.start()) <= Ptr.Offset && ((int64_t)it.stop()) >= Ptr.Offset + ((int64_t)Size));
+  bool coveredByMap = Ptr.Offset >= 0 && Map->isGood(Ptr.Offset, Ptr.Offset + Size);
 
   return !coveredByMap;
     
@@ -805,6 +916,15 @@ void llvm::doTLStoreMerge(ShadowBB* BB) {
 // Find tentative loads across this whole context.
 void InlineAttempt::findTentativeLoads(bool commitDisabledHere, bool secondPass) {
 
+  resetTLClobber();
+  initTLEntryStore();
+  findTentativeLoadsInLoop(0, commitDisabledHere, secondPass);
+
+}
+
+// Prepare the entry block's TL store, which the caller has passed in.
+void InlineAttempt::initTLEntryStore() {
+
   if(isRootMainCall()) {
     BBs[0]->tlStore = new TLLocalStore(0);
     BBs[0]->tlStore->allOthersClobbered = false;
@@ -817,8 +937,6 @@ void InlineAttempt::findTentativeLoads(bool commitDisabledHere, bool secondPass)
     BBs[0]->tlStore->pushStackFrame(this);
   }
 
-  findTentativeLoadsInLoop(0, commitDisabledHere, secondPass);
-
 }
 
 // SI read IVS from ReadPtr[ReadOffset:ReadOffset+ReadSize]. If IVS refers to an unavailable pointer or FD,
@@ -836,9 +954,9 @@ bool IntegrationAttempt::squashUnavailableObject(ShadowInstruction& SI, const Im
       // Stack objects are always available, so no need to check them.
       if(IV.V.isPtrIdx() && IV.V.getFrameNo() == -1) {
 
-	// Globals too:
+	// Globals too. Objects whose allocating context was discarded have no allocValue.
 	AllocData* AD = getAllocData(IV.V);
-	if(AD->allocValue.isInst()) {
+	if(AD->allocValue.isInst() || AD->allocValue.isInval()) {
 
 	  if(AD->isCommitted && !AD->committedVal)
 	    squash = true;
@@ -1051,6 +1169,7 @@ void IntegrationAttempt::TLAnalyseInstruction(ShadowInstruction& SI, bool commit
     
     if(SI.isThreadLocal != TLS_NEVERCHECK)
       SI.isThreadLocal = shouldCheckLoad(SI);
+    noteTLCheck(&SI);
     
     if(SI.isThreadLocal == TLS_MUSTCHECK) {
 
@@ -1234,50 +1353,55 @@ void IntegrationAttempt::findTentativeLoadsInLoop(const ShadowLoopInvar* L, bool
 
     }
 
-    // Give a store copy to each successor block that needs it. If latchToHeader is true,
-    // ignore branches to outside the current loop; otherwise ignore any latch->header edge.
+    TLPassStoreToSuccessors(BB, L, latchToHeader);
+    
+  }
+
+}
 
-    for(uint32_t i = 0; i < BB->invar->succIdxs.size(); ++i) {
+// Give a store copy to each successor block that needs it. If latchToHeader is true,
+// ignore branches to outside the current loop; otherwise ignore any latch->header edge.
+void IntegrationAttempt::TLPassStoreToSuccessors(ShadowBB* BB, const ShadowLoopInvar* L, bool latchToHeader) {
 
-      if(!BB->succsAlive[i])
-	continue;
-      
-      ShadowBBInvar* SuccBBI = getBBInvar(BB->invar->succIdxs[i]);
-      if(L) {
+  for(uint32_t i = 0; i < BB->invar->succIdxs.size(); ++i) {
 
-	if(L != this->L && latchToHeader && !L->contains(SuccBBI->naturalScope))
-	  continue;
-	else if(L != this->L && (!latchToHeader) && SuccBBI->idx == L->headerIdx) {
-	  release_assert(BB->invar->idx == L->latchIdx);
-	  continue;
-	}
+    if(!BB->succsAlive[i])
+      continue;
+      
+    ShadowBBInvar* SuccBBI = getBBInvar(BB->invar->succIdxs[i]);
+    if(L) {
 
+      if(L != this->L && latchToHeader && !L->contains(SuccBBI->naturalScope))
+	continue;
+      else if(L != this->L && (!latchToHeader) && SuccBBI->idx == L->headerIdx) {
+	release_assert(BB->invar->idx == L->latchIdx);
+	continue;
       }
 
-      // Create a store reference for each live successor
-      ++BB->tlStore->refCount;
-
     }
 
-    // Drop stack allocations here.
+    // Create a store reference for each live successor
+    ++BB->tlStore->refCount;
 
-    if(BB->invar->succIdxs.size() == 0) {
+  }
 
-      if(invarInfo->frameSize != -1) {
-	BB->tlStore = BB->tlStore->getWritableFrameList();
-	BB->tlStore->popStackFrame();
-      }
+  // Drop stack allocations here.
 
-    }
+  if(BB->invar->succIdxs.size() == 0) {
 
-    // Drop the reference belonging to this block.
-    // Return blocks need to keep their references until they're consumed by doTLCallMerge.
+    if(invarInfo->frameSize != -1) {
+      BB->tlStore = BB->tlStore->getWritableFrameList();
+      BB->tlStore->popStackFrame();
+    }
 
-    if(!isa<ReturnInst>(BB->invar->BB->getTerminator()))
-      SAFE_DROP_REF(BB->tlStore);
-    
   }
 
+  // Drop the reference belonging to this block.
+  // Return blocks need to keep their references until they're consumed by doTLCallMerge.
+
+  if(!isa<ReturnInst>(BB->invar->BB->getTerminator()))
+    SAFE_DROP_REF(BB->tlStore);
+
 }
 
 // Stats interface -- count instructions that need a runtime check. Recurse into uncommitted
@@ -1351,6 +1475,61 @@ void IntegrationAttempt::countTentativeInstructions() {
 
 }
 
+// TL report interface -- as countTentativeInstructions, but called once we know which contexts
+// will be committed, and visiting only those.
+void IntegrationAttempt::reportTLChecks() {
+
+  if(isCommitted() || !isEnabled())
+    return;
+
+  for(uint32_t i = BBsOffset, ilim = BBsOffset + nBBs; i != ilim; ++i) {
+
+    ShadowBBInvar* BBI = getBBInvar(i);
+    ShadowBB* BB = getBB(*BBI);
+    if(!BB)
+      continue;
+
+    if(BBI->naturalScope != L) {
+
+      const ShadowLoopInvar* subL = immediateChildLoop(L, BBI->naturalScope);
+      PeelAttempt* LPA;
+      if((LPA = getPeelAttempt(subL)) && LPA->isTerminated() && LPA->isEnabled()) {
+
+	while(i != ilim && subL->contains(getBBInvar(i)->naturalScope))
+	  ++i;
+	--i;
+	continue;
+
+      }
+
+    }
+
+    for(uint32_t j = 0, jlim = BBI->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction* SI = &BB->insts[j];
+      if(requiresRuntimeCheck2(ShadowValue(SI), false) && SI->needsRuntimeCheck == RUNTIME_CHECK_NONE)
+	countTLCheck(SI);
+
+    }
+
+  }
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it)
+    it->second->reportTLChecks();
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    if(!(it->second->isTerminated() && it->second->isEnabled()))
+      continue;
+
+    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i)
+      it->second->Iterations[i]->reportTLChecks();
+
+  }
+
+}
+
 // Any runtime checks needed within this loop?
 bool PeelAttempt::containsTentativeLoads() {
 
@@ -41,7 +41,8 @@ static RegisterPass<LLPEAnalysisPass> X("llpe-analysis", "LLPE Analysis",
 InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F, 
 			     ShadowInstruction* _CI, int depth,
 			     bool pathCond) : 
-  IntegrationAttempt(Pass, F, 0, depth, 0)
+  IntegrationAttempt(Pass, F, 0, depth, 0),
+  stackFunctions(Pass->stackFunctionsFactory.getEmptySet())
 { 
 
   SeqNumber = Pass->IAs.size();
@@ -57,12 +58,16 @@ InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F,
   instructionsCommitted = false;
   emittedAlloca = false;
   blocksReachableOnFailure = 0;
+  failsMidFunction = false;
+  usingSharedFallback = false;
   CommitF = 0;
   targetCallInfo = 0;
   integrationGoodnessValid = false;
   backupTlStore = 0;
   backupDSEStore = 0;
   isStackTop = false;
+  DIEGeneration = 0;
+  chargedSize = 0;
   DT = pass->DTs[&F];
   if(_CI) {
     Callers.push_back(_CI);
@@ -72,6 +77,11 @@ InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F,
     uniqueParent = 0;
   }
 
+  // Share the parent's stack set so that recursion checks don't need to walk the stack.
+  if(uniqueParent)
+    stackFunctions = uniqueParent->getFunctionRoot()->stackFunctions;
+  stackFunctions = Pass->stackFunctionsFactory.add(stackFunctions, &F);
+
   prepareShadows();
 
 }
@@ -92,7 +102,7 @@ PeelIteration::PeelIteration(LLPEAnalysisPass* Pass, IntegrationAttempt* P, Peel
 PeelAttempt::PeelAttempt(LLPEAnalysisPass* Pass, IntegrationAttempt* P, Function& _F, 
 			 const ShadowLoopInvar* _L, int depth) 
   : pass(Pass), parent(P), F(_F), residualInstructions(-1), nesting_depth(depth), stack_depth(0), 
-    enabled(true), L(_L), totalIntegrationGoodness(0), integrationGoodnessValid(false)
+    enabled(true), L(_L), overBudget(false), totalIntegrationGoodness(0), integrationGoodnessValid(false)
 {
 
   SeqNumber = Pass->IAs.size();
@@ -187,6 +197,9 @@ PeelAttempt::~PeelAttempt() {
   pass->IAs[SeqNumber] = 0;
 
   for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), it2 = Iterations.end(); it != it2; it++) {
+    // Iterations already freed were uncounted by releaseContextMemory.
+    if((*it)->commitState != COMMIT_FREED)
+      --pass->livePeelIterations;
     delete *it;
   }
 
@@ -453,6 +466,142 @@ namespace llvm {
   size_t getStringPathConditionCount();
 }
 
+// Analyse and commit a specialisation of root function F given argument constants argConstants,
+// and argv pointer argument argvIdx if any.
+void LLPEAnalysisPass::specialiseRoot(Function& F, std::vector<Constant*>& argConstants, uint32_t argvIdx) {
+
+  resetTLReportState();
+
+  // Last parameter: reserve extra GV slots for the constants that path condition parsing will produce.
+  initShadowGlobals(*F.getParent(), getStringPathConditionCount());
+
+  InlineAttempt* IA = new InlineAttempt(this, F, 0, 0);
+  if(targetCallStack.size()) {
+
+    IA->setTargetCall(targetCallStack[0], 0);
+
+  }
+
+  // Note ignored blocks and path conditions:
+  parseArgsPostCreation(IA);
+
+  // Now that all globals have grabbed heap slots, insert extra locations per special function.
+  createSpecialLocations();
+
+  argStores = new ArgStore[F.arg_size()];
+  
+  for(unsigned i = 0; i < F.arg_size(); ++i) {
+
+    if(argConstants[i])
+      setParam(IA, i, argConstants[i]);
+    else {
+      ImprovedValSetSingle* IVS = newIVS();
+      IVS->SetType = ValSetTypeOldOverdef;
+      IA->argShadows[i].i.PB = IVS;
+    }
+
+  }
+
+  if(argvIdx != 0xffffffff) {
+
+    ImprovedValSetSingle* NewIVS = newIVS();
+    NewIVS->set(ImprovedVal(ShadowValue(&IA->argShadows[argvIdx]), 0), ValSetTypePB);
+    IA->argShadows[argvIdx].i.PB = NewIVS;
+    argStores[argvIdx] = ArgStore(heap.size());
+    heap.push_back(AllocData());
+    heap.back().allocIdx = heap.size() - 1;
+    heap.back().isCommitted = false;
+    heap.back().allocValue = ShadowValue(&IA->argShadows[argvIdx]);
+    heap.back().allocType = IA->argShadows[argvIdx].getType();
+
+  }
+
+  createPointerArguments(IA);
+  initGlobalFDStore();
+
+  RootIA = IA;
+
+  errs() << "Interpreting";
+  IA->analyse();
+  IA->finaliseAndCommit(false);
+  fixNonLocalUses();
+  errs() << "\n";
+
+}
+
+// Discard the per-specialisation state left by a previous specialiseRoot, keeping everything derived
+// only from the program: function invariants, dominator trees, mod-ref info and so on.
+// Residual functions already committed are kept (and remain in commitFunctions).
+void LLPEAnalysisPass::resetSpecialisationState() {
+
+  Function& RootF = RootIA->F;
+  delete RootIA;
+  RootIA = 0;
+
+  IAs.clear();
+  IAsByFunction.clear();
+  targetCallStackIAs.clear();
+  livePeelIterations = 0;
+
+  heap.clear();
+  fds.clear();
+  delete[] argStores;
+  argStores = 0;
+  delete[] shadowGlobals;
+  shadowGlobals = 0;
+  shadowGlobalsIdx.clear();
+  arenaObjects.clear();
+
+  // Keep the allocation sites registered by parseArgs; only the objects found there are per-run.
+  for(DenseMap<Instruction*, std::vector<uint32_t> >::iterator it = heapObjectsBySite.begin(),
+	itend = heapObjectsBySite.end(); it != itend; ++it)
+    it->second.clear();
+
+  trackedStores.clear();
+  trackedAllocs.clear();
+  committedHeapAllocations.clear();
+  committedFDs.clear();
+  pendingPatchTargets.clear();
+  indirectDIEUsers.clear();
+  memcpyValues.clear();
+  forwardableOpenCalls.clear();
+  resolvedReadCalls.clear();
+  resolvedSeekCalls.clear();
+
+  optimisticForwardStatus.clear();
+  barrierInstructions.clear();
+  latchStoresRetained.clear();
+  shortHeaders.clear();
+
+  // Path conditions are re-parsed against each new root context.
+  pathConditions = PathConditions();
+  for(DenseMap<Function*, ShadowFunctionInvar*>::iterator it = functionInfo.begin(),
+	itend = functionInfo.end(); it != itend; ++it) {
+
+    delete it->second->pathConditions;
+    it->second->pathConditions = 0;
+
+  }
+
+  // Take out the argv stores the last configuration added to the root's entry block, and drop the
+  // root's invariant info, which describes them, to be rebuilt for the next configuration.
+  eraseRootArgvInsts();
+  functionInfo.erase(&RootF);
+
+  resetSizeBudget();
+
+}
+
+// Remove the argv stores that loadArgv added to the root's entry block for the current configuration.
+void LLPEAnalysisPass::eraseRootArgvInsts() {
+
+  for(std::vector<Instruction*>::reverse_iterator it = rootArgvInsts.rbegin(),
+	itend = rootArgvInsts.rend(); it != itend; ++it)
+    (*it)->eraseFromParent();
+  rootArgvInsts.clear();
+
+}
+
 // Top-level entry point:
 
 bool LLPEAnalysisPass::runOnModule(Module& M) {
@@ -488,6 +637,9 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
 
   }
 
+  // Report what a previous run's file dependencies say is now out of date.
+  checkFileDepsBaseline();
+
   Function* FoundF = M.getFunction(RootFunctionName);
   if((!FoundF) || FoundF->isDeclaration()) {
 
@@ -510,65 +662,40 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   std::vector<Constant*> argConstants(F.arg_size(), 0);
   uint32_t argvIdx = 0xffffffff;
   parseArgs(F, argConstants, argvIdx);
+  // An argv given on the command line is common to all configurations, so its stores stay.
+  rootArgvInsts.clear();
 
   populateGVCaches(&M);
   initSpecialFunctionsMap(M);
-  // Last parameter: reserve extra GV slots for the constants that path condition parsing will produce.
-  initShadowGlobals(M, getStringPathConditionCount());
   initBlacklistedFunctions(M);
 
-  InlineAttempt* IA = new InlineAttempt(this, F, 0, 0);
-  if(targetCallStack.size()) {
+  if(batchConfigs.empty()) {
 
-    IA->setTargetCall(targetCallStack[0], 0);
+    specialiseRoot(F, argConstants, argvIdx);
 
   }
+  else {
 
-  // Note ignored blocks and path conditions:
-  parseArgsPostCreation(IA);
+    // Batch mode: specialise once per configuration, reusing the dominator trees, invariant
+    // function info and mod-ref models built above.
+    for(uint32_t i = 0, ilim = batchConfigs.size(); i != ilim; ++i) {
 
-  // Now that all globals have grabbed heap slots, insert extra locations per special function.
-  createSpecialLocations();
+      if(i != 0)
+	resetSpecialisationState();
 
-  argStores = new ArgStore[F.arg_size()];
-  
-  for(unsigned i = 0; i < F.arg_size(); ++i) {
+      std::vector<Constant*> configArgConstants(argConstants);
+      uint32_t configArgvIdx = argvIdx;
+      parseSpecialisationArgs(F, batchConfigs[i], configArgConstants, configArgvIdx);
+      noteBatchAssumptions(batchConfigs[i], configArgConstants, configArgvIdx);
 
-    if(argConstants[i])
-      setParam(IA, i, argConstants[i]);
-    else {
-      ImprovedValSetSingle* IVS = newIVS();
-      IVS->SetType = ValSetTypeOldOverdef;
-      IA->argShadows[i].i.PB = IVS;
-    }
-
-  }
-
-  if(argvIdx != 0xffffffff) {
+      errs() << batchConfigs[i].name << ": ";
+      specialiseRoot(F, configArgConstants, configArgvIdx);
+      finishBatchSpecialisation(batchConfigs[i].name);
 
-    ImprovedValSetSingle* NewIVS = newIVS();
-    NewIVS->set(ImprovedVal(ShadowValue(&IA->argShadows[argvIdx]), 0), ValSetTypePB);
-    IA->argShadows[argvIdx].i.PB = NewIVS;
-    argStores[argvIdx] = ArgStore(heap.size());
-    heap.push_back(AllocData());
-    heap.back().allocIdx = heap.size() - 1;
-    heap.back().isCommitted = false;
-    heap.back().allocValue = ShadowValue(&IA->argShadows[argvIdx]);
-    heap.back().allocType = IA->argShadows[argvIdx].getType();
+    }
 
   }
 
-  createPointerArguments(IA);
-  initGlobalFDStore();
-
-  RootIA = IA;
-
-  errs() << "Interpreting";
-  IA->analyse();
-  IA->finaliseAndCommit(false);
-  fixNonLocalUses();
-  errs() << "\n";
-  
   if(IHPSaveDOTFiles) {
 
     // Function sharing is now decided, and hence the graph structure, so create
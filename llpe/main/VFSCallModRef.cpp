@@ -13,6 +13,9 @@
 
 #include <llvm/Analysis/LLPE.h>
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
 
 // For various structures and constants:
 #include <termios.h>
@@ -26,6 +29,8 @@
 
 using namespace llvm;
 
+static cl::opt<std::string> SyscallModelFile("llpe-syscall-models", cl::init(""));
+
 // This file describes the modified and referenced parameters of various Linux syscalls.
 // If you want to generalise to another kernel or treat the libc interface like the syscall interface (for example)
 // you'll want to factor this out.
@@ -363,11 +368,139 @@ void LLPEAnalysisPass::initMRInfo(Module* M) {
 
   for(uint32_t i = 0; VFSCallFunctions[i].Name; ++i) {
 
+    // Not used by this program? Then don't map the null Function* to its info.
     Function* F = M->getFunction(VFSCallFunctions[i].Name);
+    if(!F)
+      continue;
     functionMRInfo[F] = VFSCallFunctions[i];
 
   }
 
+  if(!SyscallModelFile.empty())
+    loadMRModels(M, SyscallModelFile);
+
+}
+
+static void badModelLine(StringRef Line, const char* why) {
+
+  errs() << "-llpe-syscall-models: " << why << " in line " << Line << "\n";
+  exit(1);
+
+}
+
+static uint64_t parseModelArgIndex(StringRef Line, StringRef Arg, Function* F) {
+
+  uint64_t idx;
+  if((!Arg.startswith("arg")) || Arg.substr(3).getAsInteger(10, idx))
+    badModelLine(Line, "expected argN");
+
+  // Vararg functions may take more; clobberSyscallModLocations checks those per call.
+  if((!F->isVarArg()) && idx >= F->arg_size())
+    badModelLine(Line, "argument index out of range");
+
+  return idx;
+
+}
+
+// Load extra mod-ref models from a file, one function per line, fields separated by spaces:
+// function nomodref
+// function loc1 loc2 ...
+// where each loc is one of:
+// errno         -- the errno global
+// ret           -- the object the call returns
+// argN          -- all of the object argument N points to
+// argN:SIZE     -- SIZE bytes at argument N
+// argN:argM     -- argument M's value bytes at argument N
+// argN:argM*K   -- K times argument M's value bytes at argument N
+// Models given here replace any built-in model for the same function.
+void LLPEAnalysisPass::loadMRModels(Module* M, const std::string& path) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
+  if(std::error_code ec = MB.getError()) {
+
+    errs() << "Failed to load syscall models from " << path << ": " << ec.message() << "\n";
+    exit(1);
+
+  }
+
+  StringRef Remaining = (*MB)->getBuffer();
+  while(!Remaining.empty()) {
+
+    std::pair<StringRef, StringRef> LineSplit = Remaining.split('\n');
+    StringRef Line = LineSplit.first.trim();
+    Remaining = LineSplit.second;
+
+    if(Line.empty() || Line[0] == '#')
+      continue;
+
+    SmallVector<StringRef, 8> Fields;
+    Line.split(Fields, " ", -1, false);
+
+    Function* F = M->getFunction(Fields[0]);
+    if(!F)
+      continue;
+
+    IHPFunctionInfo& FI = functionMRInfo[F];
+    FI.Name = F->getName().data();
+    FI.NoModRef = false;
+    FI.LocationDetails = 0;
+    FI.getLocationDetailsFor = 0;
+
+    if(Fields.size() == 2 && Fields[1] == "nomodref") {
+      FI.NoModRef = true;
+      continue;
+    }
+
+    // Null-terminated, and like the built-in tables these live as long as the pass.
+    IHPLocationMRInfo* Details = new IHPLocationMRInfo[Fields.size()];
+    uint32_t nDetails = 0;
+
+    for(uint32_t i = 1, ilim = Fields.size(); i != ilim; ++i) {
+
+      StringRef Loc = Fields[i];
+      if(Loc == "errno") {
+	Details[nDetails++].Location = &locErrno;
+	continue;
+      }
+      else if(Loc == "ret") {
+	Details[nDetails++].Location = &locReturnVal;
+	continue;
+      }
+
+      std::pair<StringRef, StringRef> ArgSplit = Loc.split(':');
+
+      IHPLocationInfo* NewLoc = new IHPLocationInfo();
+      NewLoc->getLocation = 0;
+      NewLoc->argIndex = parseModelArgIndex(Line, ArgSplit.first, F);
+      NewLoc->argSize = AliasAnalysis::UnknownSize;
+      NewLoc->sizeArgIndex = 0;
+      NewLoc->sizeArgMultiplier = 0;
+
+      StringRef Size = ArgSplit.second;
+      if(Size.startswith("arg")) {
+
+	std::pair<StringRef, StringRef> MulSplit = Size.split('*');
+	NewLoc->sizeArgIndex = parseModelArgIndex(Line, MulSplit.first, F);
+	NewLoc->sizeArgMultiplier = 1;
+	if((!MulSplit.second.empty()) && MulSplit.second.getAsInteger(10, NewLoc->sizeArgMultiplier))
+	  badModelLine(Line, "bad size multiplier");
+
+      }
+      else if((!Size.empty()) && Size.getAsInteger(10, NewLoc->argSize)) {
+
+	badModelLine(Line, "bad size");
+
+      }
+
+      Details[nDetails++].Location = NewLoc;
+
+    }
+
+    Details[nDetails].Location = 0;
+    FI.LocationDetails = Details;
+
+  }
+
 }
 
 IHPFunctionInfo* LLPEAnalysisPass::getMRInfo(Function* F) {
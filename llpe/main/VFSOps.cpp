@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <stdio.h>
 
@@ -40,10 +41,17 @@ using namespace llvm;
 // checks for file modifications and the original unspecialised program.
 static cl::opt<bool> ElimRedundantChecks("int-elim-read-checks");
 
+// Disable merging of lliowd checks that share a validity window (see batchVFSChecks).
+static cl::opt<bool> NoBatchVFSChecks("llpe-no-batch-file-checks");
+
 // Specify a file that provides the stdin stream for specialisation.
 // Introduced checks will use memcmp rather than referring to the given file.
 static cl::opt<std::string> SpecStdIn("int-spec-stdin");
 
+// Largest file mapping we'll model with its contents (see executeMmapCall); larger mappings
+// are treated as unknown memory.
+static cl::opt<unsigned> MaxMmapBytes("llpe-max-mmap-bytes", cl::init(16 * 1024 * 1024));
+
 // Attempt to retrieve a constant string from Ptr, using the symbolic store as of SearchFrom if necessary. Used to get the
 // filename argument for 'open' et al.
 bool IntegrationAttempt::getConstantString(ShadowValue Ptr, ShadowInstruction* SearchFrom, std::string& Result) {
@@ -468,6 +476,7 @@ bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, std
   if(!Filename.empty()) {
 
     noteLLIODependency(Filename);
+    noteFileReader(Filename, this);
     // Use the file-watcher daemon at runtime to check the specialisation
     // is still correct.
     SI->needsRuntimeCheck = RUNTIME_CHECK_READ_LLIOWD;
@@ -499,6 +508,85 @@ bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, std
 
 }
 
+// Try to run mmap call SI, which maps a file we know the contents of. Only read-only mappings
+// of a regular file, lying entirely within the file, are modelled: the mapping becomes a heap
+// object initialised with the file's bytes. The real mmap call remains in the specialised program,
+// preceded by an lliowd check as for read.
+// Return true if we modelled the call; otherwise it is treated as an ordinary unexpanded call.
+bool IntegrationAttempt::executeMmapCall(ShadowInstruction* SI) {
+
+  // Drop any check noted when this call was resolved on an earlier visit.
+  if(SI->needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD)
+    SI->needsRuntimeCheck = RUNTIME_CHECK_NONE;
+
+  if(SI->getNumArgOperands() != 6)
+    return false;
+
+  uint64_t mapBytes, prot, flags, fileOffset;
+  if((!tryGetConstantIntReplacement(SI->getCallArgOperand(1), mapBytes)) ||
+     (!tryGetConstantIntReplacement(SI->getCallArgOperand(2), prot)) ||
+     (!tryGetConstantIntReplacement(SI->getCallArgOperand(3), flags)) ||
+     (!tryGetConstantIntReplacement(SI->getCallArgOperand(5), fileOffset))) {
+
+    LPDEBUG("Can't resolve mmap call " << itcache(SI) << " because its arguments are unresolved\n");
+    return false;
+
+  }
+
+  if((prot & PROT_WRITE) || (flags & (MAP_FIXED | MAP_ANONYMOUS)) || !(flags & (MAP_SHARED | MAP_PRIVATE))) {
+
+    LPDEBUG("Can't resolve mmap call " << itcache(SI) << " because it isn't a read-only file mapping\n");
+    return false;
+
+  }
+
+  if(mapBytes == 0 || mapBytes > MaxMmapBytes || fileOffset % getpagesize() != 0)
+    return false;
+
+  uint32_t FD = getFD(SI->getCallArgOperand(4));
+  if(FD == (uint32_t)-1 || SI->parent->fdStore->fds.size() <= FD || pass->fds[FD].isFifo)
+    return false;
+
+  std::string& Filename = SI->parent->fdStore->fds[FD].filename;
+  if(filenameIsForbidden(Filename))
+    return false;
+
+  // Beyond the end of the file the mapping is partly zero-filled and partly inaccessible:
+  // don't try to model that.
+  struct stat file_stat;
+  if(::stat(Filename.c_str(), &file_stat) == -1 || !(file_stat.st_mode & S_IFREG) ||
+     fileOffset + mapBytes > (uint64_t)file_stat.st_size) {
+
+    LPDEBUG("Can't resolve mmap call " << itcache(SI) << " because it doesn't map part of a regular file\n");
+    return false;
+
+  }
+
+  std::vector<Constant*> constBytes;
+  std::string errors;
+  LLVMContext& Context = SI->invar->I->getContext();
+  if((!getFileBytes(Filename, fileOffset, mapBytes, constBytes, Context, errors)) || constBytes.size() != mapBytes) {
+
+    LPDEBUG("Can't resolve mmap call " << itcache(SI) << ": " << errors << "\n");
+    return false;
+
+  }
+
+  LPDEBUG("Successfully resolved " << itcache(SI) << " which maps " << mapBytes << " bytes\n");
+
+  noteVFSOp();
+
+  ArrayType* ArrType = ArrayType::get(IntegerType::get(Context, 8), mapBytes);
+  executeMmapInst(SI, ConstantArray::get(ArrType, constBytes));
+
+  noteLLIODependency(Filename);
+  noteFileReader(Filename, this);
+  SI->needsRuntimeCheck = RUNTIME_CHECK_READ_LLIOWD;
+
+  return true;
+
+}
+
 // Try to find a VFS function call made by SI, and if we find one try to execute it at specialisation time.
 // Return value: is this a VFS call (regardless of whether we resolved it successfully)
 bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
@@ -512,6 +600,17 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     return false;
 
   const FunctionType *FT = F->getFunctionType();
+
+  // mmap and munmap count as VFS calls only when we can model them;
+  // otherwise they are ordinary unexpanded calls.
+  if(F->getName() == "mmap" || F->getName() == "mmap64")
+    return executeMmapCall(SI);
+
+  // Release the mapping, then let the unexpanded call define the return value and errno.
+  if(F->getName() == "munmap") {
+    executeMunmapInst(SI);
+    return false;
+  }
   
   if(!(F->getName() == "read" || F->getName() == "llseek" || F->getName() == "lseek" || 
        F->getName() == "lseek64" || F->getName() == "close" || F->getName() == "stat" ||
@@ -694,8 +793,10 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     // Write the relevant data into the symbolic store.
     executeReadInst(SI, FDS.filename, FDS.pos, cBytes);
 
-    if(!isFifo)
+    if(!isFifo) {
       noteLLIODependency(FDS.filename);
+      noteFileReader(FDS.filename, this);
+    }
 
     if(isFifo)
       SI->needsRuntimeCheck = RUNTIME_CHECK_READ_MEMCMP;
@@ -1037,6 +1138,146 @@ void IntegrationAttempt::tryKillAllVFSOps() {
 
 }
 
+// Can SI run between an lliowd_ok() check and a later specialised read or stat without
+// invalidating the check? That holds if SI cannot communicate with other threads or processes,
+// since then a file change that happened during SI is indistinguishable from one that happened
+// after the later read. Resolved VFS calls are fine except for fifo reads, which really execute.
+static bool preservesVFSCheckWindow(ShadowInstruction* SI, LLPEAnalysisPass* pass) {
+
+  if(inst_is<CallInst>(SI) || inst_is<InvokeInst>(SI)) {
+
+    DenseMap<ShadowInstruction*, ReadFile>::iterator readit = pass->resolvedReadCalls.find(SI);
+    if(readit != pass->resolvedReadCalls.end())
+      return !readit->second.isFifo;
+
+    if(pass->resolvedSeekCalls.count(SI))
+      return true;
+
+    if(inst_is<DbgInfoIntrinsic>(SI))
+      return true;
+
+    if(MemIntrinsic* MI = dyn_cast_inst<MemIntrinsic>(SI))
+      return !MI->isVolatile();
+
+    // Anything else, including calls we'll commit inline, might yield or talk to the outside world.
+    return false;
+
+  }
+
+  return !(SI->hasOrderingConstraint() || inst_is<AtomicRMWInst>(SI) || inst_is<AtomicCmpXchgInst>(SI));
+
+}
+
+// Is a check made earlier in this context certain to be valid at the top of BB?
+// Only edges within this context are considered, and back edges always close the window.
+static bool VFSCheckWindowOpenAtEntry(IntegrationAttempt* IA, ShadowBB* BB, std::vector<bool>& windowOpen) {
+
+  ShadowBBInvar* BBI = BB->invar;
+  bool anyLivePred = false;
+
+  for(uint32_t i = 0, ilim = BBI->predIdxs.size(); i != ilim; ++i) {
+
+    uint32_t predIdx = BBI->predIdxs[i];
+    bool inScope;
+    ShadowBB* PredBB = IA->getBB(predIdx, &inScope);
+
+    if(!inScope)
+      return false;
+
+    if((!PredBB) || PredBB->edgeIsDead(BBI))
+      continue;
+
+    if(predIdx >= BBI->idx || !windowOpen[predIdx - IA->BBsOffset])
+      return false;
+
+    anyLivePred = true;
+
+  }
+
+  return anyLivePred;
+
+}
+
+// Find lliowd-checked reads and stats that are dominated by an earlier checked VFS call
+// with no intervening instruction that could observe the outside world (see preservesVFSCheckWindow).
+// The earlier check covers them, so drop theirs: a failure at the first check already resumes
+// unspecialised code at the first VFS call of the region, which then re-executes the rest.
+void IntegrationAttempt::batchVFSChecks() {
+
+  if(isCommitted() || pass->omitChecks || NoBatchVFSChecks)
+    return;
+
+  // windowOpen[i]: some lliowd check made in this context is still valid at the end of BBs[i].
+  std::vector<bool> windowOpen(nBBs, false);
+
+  for(uint32_t i = 0; i != nBBs; ++i) {
+
+    ShadowBB* BB = BBs[i];
+    if(!BB)
+      continue;
+
+    ShadowBBInvar* BBI = BB->invar;
+
+    if(BBI->naturalScope != L) {
+
+      const ShadowLoopInvar* subL = immediateChildLoop(L, BBI->naturalScope);
+      PeelAttempt* LPA;
+
+      if((LPA = getPeelAttempt(subL)) && LPA->isTerminated() && LPA->isEnabled()) {
+
+	// Each iteration is committed separately; batch within each.
+	for(uint32_t k = 0, klim = LPA->Iterations.size(); k != klim; ++k)
+	  LPA->Iterations[k]->batchVFSChecks();
+
+	// Skip past the loop blocks, leaving their windows closed.
+	while(i != nBBs && subL->contains(getBBInvar(i + BBsOffset)->naturalScope))
+	  ++i;
+	--i;
+	continue;
+
+      }
+
+    }
+
+    bool open = VFSCheckWindowOpenAtEntry(this, BB, windowOpen);
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction* SI = &BB->insts[j];
+
+      if(SI->needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD) {
+
+	if(open) {
+
+	  LPDEBUG("Check for " << itcache(SI) << " covered by an earlier lliowd check\n");
+	  SI->needsRuntimeCheck = RUNTIME_CHECK_NONE;
+
+	}
+
+	// Either way a check is now in force.
+	open = true;
+	continue;
+
+      }
+
+      if(InlineAttempt* IA = getInlineAttempt(SI)) {
+
+	if(IA->isEnabled())
+	  IA->batchVFSChecks();
+
+      }
+
+      if(!preservesVFSCheckWindow(SI, pass))
+	open = false;
+
+    }
+
+    windowOpen[i] = open;
+
+  }
+
+}
+
 // Read strFileName[realFilePos : realFilePos + realBytes] as an array of i8 typed Constants.
 // 'errors' will carry a verbose error report. Return true on success.
 bool llvm::getFileBytes(std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors) {
@@ -0,0 +1,29 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* f is committed out of line (see Makefile), so its use of main's buffer
+   must be patched in after main's residual code is generated. */
+
+int f(char* buf, int n) {
+
+  int i, total = 0;
+  for(i = 0; i < n; ++i)
+    total += buf[i];
+  printf("%d\n", total);
+  return total;
+
+}
+
+int main(int argc, char** argv) {
+
+  char* buf = malloc(16);
+  memset(buf, 1, 16);
+  if(argc > 1)
+    buf[0] = 2;
+  int res = f(buf, 16);
+  free(buf);
+  return res == 16 ? 0 : 1;
+
+}